@@ -0,0 +1,709 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "UAX.h"
+
+/**
+ ** Microbenchmarks for the UCD getters, the bidi engine and normalization: `make bench`, or `./UAX-bench <filter>` to run only the benchmarks whose name contains <filter>.
+ ** Every benchmark runs over each corpus once to warm up, then Repeats timed runs of at least Min_Run_Seconds each; the median and the fastest run are reported.
+ **/
+
+using namespace UAX;
+
+static const size_t Corpus_Length = 1 << 16;
+static const size_t Paragraph_Length = 1024; // Bidi::Run is given the corpus this many codepoints at a time, unless the corpus says otherwise
+static const int Repeats = 7;
+static const double Min_Run_Seconds = 0.02;
+
+/**
+ ** Corpora -- generated from a fixed seed so runs are comparable
+ **/
+struct Random {
+  uint64_t state;
+  Random(uint64_t seed): state(seed) {}
+  uint32_t next() {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return (uint32_t)(state >> 33);
+  }
+  uint32_t below(uint32_t n) { return next() % n; }
+  Codepoint in(Codepoint first, Codepoint last) { return first + below(last - first + 1); }
+};
+
+struct Corpus {
+  std::string name;
+  size_t paragraph_length = Paragraph_Length;
+  std::vector<Codepoint> utf32;
+  std::vector<uint16_t> utf16;
+  std::vector<uint8_t> utf8;
+};
+
+static void append_utf16(std::vector<uint16_t> &out, Codepoint code) {
+  if (code >= 0x10000) {
+    out.push_back(0xD800 + ((code - 0x10000) >> 10));
+    out.push_back(0xDC00 + ((code - 0x10000) & 0x3FF));
+  } else {
+    out.push_back(code);
+  }
+}
+
+static void append_utf8(std::vector<uint8_t> &out, Codepoint code) {
+  if (code < 0x80) {
+    out.push_back(code);
+  } else if (code < 0x800) {
+    out.push_back(0xC0 | (code >> 6));
+    out.push_back(0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    out.push_back(0xE0 | (code >> 12));
+    out.push_back(0x80 | ((code >> 6) & 0x3F));
+    out.push_back(0x80 | (code & 0x3F));
+  } else {
+    out.push_back(0xF0 | (code >> 18));
+    out.push_back(0x80 | ((code >> 12) & 0x3F));
+    out.push_back(0x80 | ((code >> 6) & 0x3F));
+    out.push_back(0x80 | (code & 0x3F));
+  }
+}
+
+template<typename F> Corpus make_corpus(const char *name, F generate) {
+  Corpus corpus;
+  corpus.name = name;
+  Random random(0x5eed);
+  while (corpus.utf32.size() < Corpus_Length)
+    generate(random, corpus.utf32);
+  corpus.utf32.resize(Corpus_Length);
+  for (Codepoint code : corpus.utf32) {
+    append_utf16(corpus.utf16, code);
+    append_utf8(corpus.utf8, code);
+  }
+  return corpus;
+}
+
+static void word(Random &random, std::vector<Codepoint> &text, Codepoint first, Codepoint last) {
+  for (uint32_t n = 2 + random.below(8); n > 0; --n)
+    text.push_back(random.in(first, last));
+}
+
+static std::vector<Corpus> make_corpora() {
+  std::vector<Corpus> corpora;
+
+  corpora.push_back(make_corpus("ascii", [](Random &random, std::vector<Codepoint> &text) {
+    word(random, text, 'a', 'z');
+    static const char punctuation[] = " ,.;:!?-'\"";
+    text.push_back(random.below(4) ? ' ' : punctuation[random.below(sizeof(punctuation) - 1)]);
+  }));
+
+  corpora.push_back(make_corpus("latin1", [](Random &random, std::vector<Codepoint> &text) {
+    for (uint32_t n = 2 + random.below(8); n > 0; --n)
+      text.push_back(random.below(3) ? random.in('a', 'z') : random.in(0xC0, 0xFF));
+    text.push_back(random.below(8) ? ' ' : random.in(0xA1, 0xBF));
+  }));
+
+  corpora.push_back(make_corpus("cjk", [](Random &random, std::vector<Codepoint> &text) {
+    for (uint32_t n = 4 + random.below(20); n > 0; --n)
+      text.push_back(random.below(4) ? random.in(0x4E00, 0x9FFF) : random.in(0x3041, 0x30FF));
+    text.push_back(random.below(2) ? 0x3001 : 0x3002);
+  }));
+
+  corpora.push_back(make_corpus("arabic_hebrew", [](Random &random, std::vector<Codepoint> &text) {
+    switch (random.below(8)) {
+      case 0: case 1: case 2: word(random, text, 0x0627, 0x064A); break; // Arabic letters
+      case 3: case 4: word(random, text, 0x05D0, 0x05EA); break; // Hebrew letters
+      case 5: word(random, text, '0', '9'); break;
+      case 6: word(random, text, 0x0660, 0x0669); break; // Arabic-Indic digits
+      case 7: word(random, text, 'a', 'z'); break;
+    }
+    static const Codepoint brackets[][2] = { {'(', ')'}, {'[', ']'}, {'{', '}'} };
+    if (random.below(6) == 0) {
+      const Codepoint *pair = brackets[random.below(3)];
+      text.push_back(pair[0]);
+      word(random, text, 0x05D0, 0x05EA);
+      text.push_back(' ');
+      word(random, text, '0', '9');
+      text.push_back(pair[1]);
+    }
+    static const Codepoint separators[] = { ' ', ' ', ' ', ',', '.', '-', '/', '%', 0x060C };
+    text.push_back(separators[random.below(sizeof(separators) / sizeof(separators[0]))]);
+  }));
+
+  corpora.push_back(make_corpus("numbers", [](Random &random, std::vector<Codepoint> &text) { // weak types: EN, AN, ET, ES, CS, NSM around a few strong letters
+    static const Codepoint weak[] = { '0', '5', '9', 0x0660, 0x0665, '$', '%', 0x00B0, '+', '-', ',', '.', ':', '/', 0x0300, ' ' };
+    for (uint32_t n = 2 + random.below(12); n > 0; --n)
+      text.push_back(weak[random.below(sizeof(weak) / sizeof(weak[0]))]);
+    switch (random.below(3)) {
+      case 0: text.push_back(random.in('a', 'z')); break;
+      case 1: text.push_back(random.in(0x05D0, 0x05EA)); break;
+      case 2: text.push_back(random.in(0x0627, 0x064A)); break;
+    }
+  }));
+
+  corpora.push_back(make_corpus("nested_isolates", [](Random &random, std::vector<Codepoint> &text) {
+    static const Codepoint initiators[] = { 0x2066, 0x2067, 0x2068 }; // LRI RLI FSI
+    uint32_t depth = 1 + random.below(60);
+    for (uint32_t d = 0; d < depth; ++d) {
+      text.push_back(initiators[random.below(3)]);
+      if (random.below(2))
+        word(random, text, 0x05D0, 0x05EA);
+      else if (random.below(2))
+        word(random, text, 'a', 'z');
+    }
+    for (uint32_t d = 0; d < depth; ++d) {
+      text.push_back(0x2069); // PDI
+      if (random.below(3) == 0)
+        text.push_back(' ');
+    }
+  }));
+
+  corpora.push_back(make_corpus("neutral_runs", [](Random &random, std::vector<Codepoint> &text) {
+    static const Codepoint neutrals[] = { ' ', ' ', '-', '*', '=', '.', ',', '!', '"', 0x2014, 0x00B7 };
+    text.push_back(random.below(2) ? 0x05D0 : 'a');
+    for (uint32_t n = 100 + random.below(400); n > 0; --n)
+      text.push_back(neutrals[random.below(sizeof(neutrals) / sizeof(neutrals[0]))]);
+  }));
+
+  // adversarial: one paragraph that is a single run of neutrals between two strong characters. Resolving it must stay linear in its length
+  corpora.push_back(make_corpus("one_neutral_paragraph", [](Random &random, std::vector<Codepoint> &text) {
+    static const Codepoint neutrals[] = { ' ', '-', '*', '=', '.', ',', '!', '"', 0x2014, 0x00B7, 0x0009 };
+    if (text.empty() || text.size() == Corpus_Length - 1)
+      text.push_back(0x05D0);
+    else
+      text.push_back(neutrals[random.below(sizeof(neutrals) / sizeof(neutrals[0]))]);
+  }));
+  corpora.back().paragraph_length = Corpus_Length;
+
+  // adversarial: one JSON-like LTR paragraph of deeply nested bracket pairs that hold only RTL letters and numbers, so N0 has to look through every pair to its end
+  corpora.push_back(make_corpus("nested_brackets", [](Random &random, std::vector<Codepoint> &text) {
+    static std::vector<Codepoint> open; // closing brackets still owed, innermost last
+    if (text.empty()) {
+      open.clear();
+      text.push_back('a');
+    }
+    uint32_t choice = random.below(8);
+    if ((choice < 3 && open.size() < 100) || open.empty()) {
+      bool object = random.below(2);
+      text.push_back(object ? '{' : '[');
+      open.push_back(object ? '}' : ']');
+    } else if (choice < 5) {
+      text.push_back(open.back());
+      open.pop_back();
+      text.push_back(',');
+    } else {
+      if (random.below(2))
+        word(random, text, 0x05D0, 0x05EA);
+      else
+        word(random, text, '0', '9');
+      text.push_back(random.below(2) ? ':' : ' ');
+    }
+  }));
+  corpora.back().paragraph_length = Corpus_Length;
+
+  // adversarial: one paragraph of thousands of short isolates side by side, each one an isolating run sequence of its own inside the one that steps over them all
+  corpora.push_back(make_corpus("sibling_isolates", [](Random &random, std::vector<Codepoint> &text) {
+    static const Codepoint initiators[] = { 0x2066, 0x2067, 0x2068 }; // LRI RLI FSI
+    word(random, text, 'a', 'z');
+    text.push_back(' ');
+    text.push_back(initiators[random.below(3)]);
+    if (random.below(2))
+      word(random, text, 0x05D0, 0x05EA);
+    else
+      word(random, text, '0', '9');
+    text.push_back(0x2069); // PDI
+    text.push_back(' ');
+  }));
+  corpora.back().paragraph_length = Corpus_Length;
+
+  // a document of paragraphs of mixed text, for RunParagraphs. Bidi::Run still gets it Paragraph_Length codepoints at a time
+  corpora.push_back(make_corpus("document", [](Random &random, std::vector<Codepoint> &text) {
+    for (uint32_t n = 4 + random.below(300); n > 0; --n) {
+      switch (random.below(6)) {
+        case 0: case 1: word(random, text, 'a', 'z'); break;
+        case 2: case 3: word(random, text, 0x05D0, 0x05EA); break;
+        case 4: word(random, text, 0x0627, 0x064A); break;
+        case 5: word(random, text, '0', '9'); break;
+      }
+      text.push_back(random.below(10) ? ' ' : '.');
+    }
+    text.push_back(random.below(2) ? 0x000A : 0x2029);
+  }));
+
+  // Latin and Greek words with accents, about half of them precomposed and half as a letter and combining marks (sometimes out of canonical order), and
+  // Korean as syllables or conjoining jamo. Every normalization form has work to do here
+  corpora.push_back(make_corpus("accents", [](Random &random, std::vector<Codepoint> &text) {
+    static const Codepoint marks[] = { 0x0300, 0x0301, 0x0302, 0x0303, 0x0308, 0x030A, 0x0323, 0x0327, 0x0328, 0x0342, 0x0345 };
+    switch (random.below(4)) {
+      case 0: case 1:
+        for (uint32_t n = 2 + random.below(8); n > 0; --n) {
+          text.push_back(random.below(2) ? random.in('a', 'z') : random.in(0x1F00, 0x1F6F)); // Greek Extended is mostly precomposed
+          for (uint32_t m = random.below(4) == 0 ? 1 + random.below(2) : 0; m > 0; --m)
+            text.push_back(marks[random.below(sizeof(marks) / sizeof(marks[0]))]);
+        }
+        break;
+      case 2:
+        word(random, text, 0x00C0, 0x00FF);
+        break;
+      case 3:
+        for (uint32_t n = 2 + random.below(4); n > 0; --n) {
+          if (random.below(2)) {
+            text.push_back(random.in(0xAC00, 0xD7A3));
+          } else {
+            text.push_back(random.in(0x1100, 0x1112));
+            text.push_back(random.in(0x1161, 0x1175));
+            if (random.below(2))
+              text.push_back(random.in(0x11A8, 0x11C2));
+          }
+        }
+        break;
+    }
+    text.push_back(random.below(8) ? ' ' : '.');
+  }));
+
+  return corpora;
+}
+
+/**
+ ** Harness
+ **/
+static volatile uint32_t sink; // keeps results alive so the optimizer can't drop the work
+
+typedef std::chrono::steady_clock Clock;
+
+template<typename F> bool bench(const char *name, const Corpus &corpus, const char *filter, F run) {
+  std::string full_name = std::string(name) + "/" + corpus.name;
+  if (filter && !strstr(full_name.c_str(), filter))
+    return false;
+  const size_t codepoints = corpus.utf32.size();
+
+  auto start = Clock::now(); // warm-up, and find how many passes make a run of Min_Run_Seconds
+  run();
+  double once = std::chrono::duration<double>(Clock::now() - start).count();
+  int passes = std::max(1, (int)(Min_Run_Seconds / std::max(once, 1e-9)));
+
+  std::vector<double> ns_per_codepoint;
+  for (int r = 0; r < Repeats; ++r) {
+    start = Clock::now();
+    for (int p = 0; p < passes; ++p)
+      run();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    ns_per_codepoint.push_back(seconds * 1e9 / ((double)passes * codepoints));
+  }
+  std::sort(ns_per_codepoint.begin(), ns_per_codepoint.end());
+  double median = ns_per_codepoint[Repeats / 2];
+  printf("%-40s %9.3f ns/cp (min %9.3f) %10.2f Mcp/s\n", full_name.c_str(), median, ns_per_codepoint[0], 1e3 / median);
+  return true;
+}
+
+int main(int argc, char const *argv[]) {
+  const char *filter = argc > 1 ? argv[1] : nullptr;
+  std::vector<Corpus> corpora = make_corpora();
+
+  std::vector<Bidi_Class> classes(Corpus_Length);
+  std::vector<Bidi::EmbeddingLevel> levels(Corpus_Length);
+  std::vector<uint8_t> scratch(Bidi::ScratchBufferSize(Corpus_Length));
+  std::vector<uint8_t> level_runs_scratch(Bidi::LevelRunsScratchBufferSize(Corpus_Length));
+  std::vector<Bidi::ResolvedLevelRun> runs(Corpus_Length);
+  std::vector<Codepoint> normalized(Normalization::BufferSizeForCompatibilityDecomposition(Corpus_Length));
+
+  // Classify_Bidi against the scalar Get_Bidi_Class loop as the share of ASCII falls: a block with any codepoint past U+00FF is looked up one codepoint at a time
+  for (uint32_t ascii_percent : { 100, 99, 90, 50, 0 }) {
+    char name[32];
+    snprintf(name, sizeof(name), "ascii_%u%%", ascii_percent);
+    const Corpus corpus = make_corpus(name, [ascii_percent](Random &random, std::vector<Codepoint> &text) {
+      if (random.below(100) < ascii_percent)
+        text.push_back(random.below(6) ? random.in('a', 'z') : ' ');
+      else
+        switch (random.below(3)) {
+          case 0: text.push_back(random.in(0x05D0, 0x05EA)); break; // Hebrew letters
+          case 1: text.push_back(random.in(0x0627, 0x064A)); break; // Arabic letters
+          case 2: text.push_back(random.in(0x4E00, 0x9FFF)); break; // CJK ideographs
+        }
+    });
+    const Codepoint *text = corpus.utf32.data();
+    const size_t length = corpus.utf32.size();
+    bench("Classify_Bidi", corpus, filter, [&] {
+      Classify_Bidi(text, length, classes.data());
+      sink = (uint32_t)classes[length - 1];
+    });
+    bench("Classify_Bidi/scalar", corpus, filter, [&] {
+      for (size_t i = 0; i < length; ++i)
+        classes[i] = Get_Bidi_Class(text[i]);
+      sink = (uint32_t)classes[length - 1];
+    });
+  }
+
+  for (const Corpus &corpus : corpora) {
+    const Codepoint *text = corpus.utf32.data();
+    const size_t length = corpus.utf32.size();
+    const size_t paragraph_length = corpus.paragraph_length;
+
+    #define BENCH_GETTER(GETTER, EXPRESSION) \
+      bench(#GETTER, corpus, filter, [&] { \
+        uint32_t sum = 0; \
+        for (size_t i = 0; i < length; ++i) { \
+          const Codepoint c = text[i]; \
+          sum += (uint32_t)(EXPRESSION); \
+        } \
+        sink = sum; \
+      })
+    BENCH_GETTER(Get_Properties, Get_Properties(c).script);
+    BENCH_GETTER(Get_Bidi_Class, Get_Bidi_Class(c));
+    BENCH_GETTER(Get_Script, Get_Script(c));
+    BENCH_GETTER(Get_Line_Break, Get_Line_Break(c));
+    BENCH_GETTER(Get_East_Asian_Width, Get_East_Asian_Width(c));
+    BENCH_GETTER(Get_Bidi_Mirroring, Get_Bidi_Mirroring(c));
+    Bidi_Paired_Bracket_Type bracket_type;
+    BENCH_GETTER(Get_Bidi_Paired_Bracket, Get_Bidi_Paired_Bracket(c, bracket_type) + (uint32_t)bracket_type);
+    #undef BENCH_GETTER
+
+    bench("Classify_Bidi", corpus, filter, [&] {
+      Classify_Bidi(text, length, classes.data());
+      sink = (uint32_t)classes[length - 1];
+    });
+
+    // RequiresAlgorithm stops at the first RTL character, so it's timed per paragraph like Run
+    bench("RequiresAlgorithm/utf32", corpus, filter, [&] {
+      uint32_t count = 0;
+      for (size_t i = 0; i < length; i += paragraph_length)
+        count += Bidi::RequiresAlgorithm(&text[i], std::min(paragraph_length, length - i));
+      sink = count;
+    });
+    bench("RequiresAlgorithm/utf16", corpus, filter, [&] {
+      uint32_t count = 0;
+      const size_t units = corpus.utf16.size(), chunk = units / (length / paragraph_length);
+      for (size_t i = 0; i < units; i += chunk)
+        count += Bidi::RequiresAlgorithm(&corpus.utf16[i], std::min(chunk, units - i));
+      sink = count;
+    });
+    bench("RequiresAlgorithm/utf8", corpus, filter, [&] {
+      uint32_t count = 0;
+      const size_t units = corpus.utf8.size(), chunk = units / (length / paragraph_length);
+      for (size_t i = 0; i < units; i += chunk)
+        count += Bidi::RequiresAlgorithm(&corpus.utf8[i], std::min(chunk, units - i));
+      sink = count;
+    });
+
+    bench("Bidi::Run", corpus, filter, [&] {
+      uint32_t sum = 0;
+      for (size_t i = 0; i < length; i += paragraph_length) {
+        Bidi::EmbeddingLevel paragraph_level;
+        Bidi::Run(&text[i], std::min(paragraph_length, length - i), Bidi::BaseDirection::Auto, paragraph_level, &levels[i], scratch.data());
+        sum += paragraph_level;
+      }
+      sink = sum + levels[length - 1];
+    });
+
+    // from classes and bracket info looked up beforehand, as a caller that keeps them would
+    std::vector<Bidi_Class> text_classes(length);
+    std::vector<Bidi::BracketInfo> text_brackets(length);
+    Classify_Bidi(text, length, text_classes.data());
+    for (size_t i = 0; i < length; ++i)
+      text_brackets[i] = Bidi::GetBracketInfo(text[i]);
+    bench("Bidi::Run/classes", corpus, filter, [&] {
+      uint32_t sum = 0;
+      for (size_t i = 0; i < length; i += paragraph_length) {
+        Bidi::EmbeddingLevel paragraph_level;
+        Bidi::Run(&text_classes[i], &text_brackets[i], std::min(paragraph_length, length - i), Bidi::BaseDirection::Auto, paragraph_level, &levels[i], scratch.data());
+        sum += paragraph_level;
+      }
+      sink = sum + levels[length - 1];
+    });
+
+    // the same, allocating the scratch buffer and levels for each paragraph, or taking them from a Context
+    bench("Bidi::Run/allocating", corpus, filter, [&] {
+      uint32_t sum = 0;
+      for (size_t i = 0; i < length; i += paragraph_length) {
+        size_t n = std::min(paragraph_length, length - i);
+        std::vector<uint8_t> paragraph_scratch(Bidi::ScratchBufferSize(n));
+        std::vector<Bidi::EmbeddingLevel> paragraph_levels(n);
+        Bidi::EmbeddingLevel paragraph_level;
+        Bidi::Run(&text[i], n, Bidi::BaseDirection::Auto, paragraph_level, paragraph_levels.data(), paragraph_scratch.data());
+        sum += paragraph_level + paragraph_levels[n - 1];
+      }
+      sink = sum;
+    });
+    Bidi::Context context;
+    bench("Bidi::Context::Run", corpus, filter, [&] {
+      uint32_t sum = 0;
+      for (size_t i = 0; i < length; i += paragraph_length) {
+        size_t n = std::min(paragraph_length, length - i);
+        Bidi::EmbeddingLevel paragraph_level;
+        const Bidi::EmbeddingLevel *paragraph_levels = context.Run(&text[i], n, Bidi::BaseDirection::Auto, paragraph_level);
+        sum += paragraph_level + paragraph_levels[n - 1];
+      }
+      sink = sum;
+    });
+
+    // with the phase stats on, for what they cost, and then where the time went
+    Bidi::ResetPhaseStats();
+    Bidi::EnablePhaseStats(true);
+    bench("Bidi::Run/phase_stats", corpus, filter, [&] {
+      uint32_t sum = 0;
+      for (size_t i = 0; i < length; i += paragraph_length) {
+        Bidi::EmbeddingLevel paragraph_level;
+        Bidi::Run(&text[i], std::min(paragraph_length, length - i), Bidi::BaseDirection::Auto, paragraph_level, &levels[i], scratch.data());
+        sum += paragraph_level;
+      }
+      sink = sum + levels[length - 1];
+    });
+    Bidi::EnablePhaseStats(false);
+    Bidi::PhaseStats phase_stats = Bidi::GetPhaseStats();
+    if (phase_stats.runs > 0) {
+      uint64_t total = 0;
+      for (int p = 0; p < Bidi::Phase_Count; ++p)
+        total += phase_stats.nanoseconds[p];
+      printf("  ");
+      for (int p = 0; p < Bidi::Phase_Count; ++p)
+        printf(" %s %.1f%%", Bidi::PhaseName((Bidi::Phase)p), 100.0 * phase_stats.nanoseconds[p] / std::max(total, (uint64_t)1));
+      printf("\n   %.2f isolating run sequences and %.2f lookahead steps per paragraph, max depth %d\n",
+             (double)phase_stats.isolating_run_sequences / phase_stats.runs, (double)phase_stats.lookahead_steps / phase_stats.runs, (int)phase_stats.max_depth);
+    }
+
+    // UTF-16 and UTF-8 paragraphs: decoded to UTF-32 first and then Run(), or Run() on the code units
+    std::vector<Codepoint> decoded(Corpus_Length);
+    std::vector<uint8_t> units_scratch(Bidi::ScratchBufferSize(corpus.utf8.size())); // sized by code units
+    bench("Bidi::Run/decode_utf16", corpus, filter, [&] {
+      uint32_t sum = 0;
+      const size_t units = corpus.utf16.size(), chunk = units / (length / paragraph_length);
+      for (size_t i = 0; i < units; i += chunk) {
+        size_t end = std::min(i + chunk, units), count = 0;
+        for (size_t u = i; u < end; )
+          decoded[count++] = Unicode::Next_UTF16(corpus.utf16.data(), end, u);
+        Bidi::EmbeddingLevel paragraph_level;
+        Bidi::Run(decoded.data(), count, Bidi::BaseDirection::Auto, paragraph_level, levels.data(), scratch.data());
+        sum += paragraph_level;
+      }
+      sink = sum + levels[0];
+    });
+    bench("Bidi::Run/utf16", corpus, filter, [&] {
+      uint32_t sum = 0;
+      const size_t units = corpus.utf16.size(), chunk = units / (length / paragraph_length);
+      for (size_t i = 0; i < units; i += chunk) {
+        Bidi::EmbeddingLevel paragraph_level;
+        Bidi::Run(&corpus.utf16[i], std::min(chunk, units - i), Bidi::BaseDirection::Auto, paragraph_level, levels.data(), Bidi::LevelsFor::Codepoints, units_scratch.data());
+        sum += paragraph_level;
+      }
+      sink = sum + levels[0];
+    });
+    bench("Bidi::Run/decode_utf8", corpus, filter, [&] {
+      uint32_t sum = 0;
+      const size_t units = corpus.utf8.size(), chunk = units / (length / paragraph_length);
+      for (size_t i = 0; i < units; i += chunk) {
+        size_t end = std::min(i + chunk, units), count = 0;
+        for (size_t u = i; u < end; )
+          decoded[count++] = Unicode::Next_UTF8(corpus.utf8.data(), end, u);
+        Bidi::EmbeddingLevel paragraph_level;
+        Bidi::Run(decoded.data(), count, Bidi::BaseDirection::Auto, paragraph_level, levels.data(), scratch.data());
+        sum += paragraph_level;
+      }
+      sink = sum + levels[0];
+    });
+    bench("Bidi::Run/utf8", corpus, filter, [&] {
+      uint32_t sum = 0;
+      const size_t units = corpus.utf8.size(), chunk = units / (length / paragraph_length);
+      for (size_t i = 0; i < units; i += chunk) {
+        Bidi::EmbeddingLevel paragraph_level;
+        Bidi::Run(&corpus.utf8[i], std::min(chunk, units - i), Bidi::BaseDirection::Auto, paragraph_level, levels.data(), Bidi::LevelsFor::Codepoints, units_scratch.data());
+        sum += paragraph_level;
+      }
+      sink = sum + levels[0];
+    });
+
+    bench("Bidi::RunLevelRuns", corpus, filter, [&] {
+      uint32_t sum = 0;
+      for (size_t i = 0; i < length; i += paragraph_length) {
+        Bidi::EmbeddingLevel paragraph_level;
+        sum += Bidi::RunLevelRuns(&text[i], std::min(paragraph_length, length - i), Bidi::BaseDirection::Auto, paragraph_level, runs.data(), runs.size(), level_runs_scratch.data());
+      }
+      sink = sum + runs[0].level;
+    });
+
+    std::vector<Bidi::EmbeddingLevel> paragraph_levels; // each paragraph is resolved once, then reordered as a single line
+    for (size_t i = 0; i < length; i += paragraph_length) {
+      paragraph_levels.push_back(0);
+      Bidi::Run(&text[i], std::min(paragraph_length, length - i), Bidi::BaseDirection::Auto, paragraph_levels.back(), &levels[i], scratch.data());
+    }
+    std::vector<Bidi::EmbeddingLevel> line_levels(length);
+    std::vector<size_t> visual_to_logical(length), logical_to_visual(length);
+    bench("Bidi::ReorderLine", corpus, filter, [&] {
+      for (size_t i = 0, p = 0; i < length; i += paragraph_length, ++p) {
+        size_t end = std::min(i + paragraph_length, length);
+        Bidi::ReorderLine(text, levels.data(), paragraph_levels[p], i, end, &line_levels[i], &visual_to_logical[i], &logical_to_visual[i]);
+      }
+      sink = (uint32_t)visual_to_logical[0];
+    });
+
+    // L4 over the resolved levels: Get_Bidi_Mirroring() on every odd-level character, as a renderer does by hand, or ApplyMirroring()
+    std::vector<Codepoint> glyphs(length);
+    bench("Get_Bidi_Mirroring/odd_levels", corpus, filter, [&] {
+      for (size_t i = 0; i < length; ++i) {
+        Codepoint mirror = (levels[i] & 1) && levels[i] != Bidi::Removed_Level ? Get_Bidi_Mirroring(text[i]) : 0;
+        glyphs[i] = mirror ? mirror : text[i];
+      }
+      sink = glyphs[length - 1];
+    });
+    bench("Bidi::ApplyMirroring", corpus, filter, [&] {
+      sink = (uint32_t)Bidi::ApplyMirroring(text, levels.data(), length, glyphs.data()) + glyphs[length - 1];
+    });
+
+    // the paragraphs as lines of 80 codepoints: a VisualMap built for each, and the caret walked across each line from the left, by VisualMap::NextVisual() or by
+    // ReorderLine() again at every step
+    const size_t Line_Length = 80;
+    struct Line {
+      size_t start, end, paragraph;
+    };
+    std::vector<Line> lines;
+    for (size_t i = 0, p = 0; i < length; i += paragraph_length, ++p)
+      for (size_t j = i; j < std::min(i + paragraph_length, length); j += Line_Length)
+        lines.push_back(Line { j, std::min(j + Line_Length, std::min(i + paragraph_length, length)), p });
+    std::vector<Bidi::VisualMap> maps;
+    bench("Lines/Bidi::VisualMap", corpus, filter, [&] {
+      maps.clear();
+      for (const Line &line : lines)
+        maps.push_back(Bidi::VisualMap(text, levels.data(), paragraph_levels[line.paragraph], line.start, line.end));
+      sink = (uint32_t)maps.back().RunCount();
+    });
+    if (maps.size() == lines.size()) {
+      bench("Lines/Bidi::VisualMap/NextVisual", corpus, filter, [&] {
+        size_t sum = 0;
+        for (const Bidi::VisualMap &map : maps)
+          for (size_t i = map.VisualToLogical(0); i != Bidi::VisualMap::None; i = map.NextVisual(i, true))
+            sum += i;
+        sink = (uint32_t)sum;
+      });
+    }
+    bench("Lines/Bidi::ReorderLine/NextVisual", corpus, filter, [&] {
+      size_t sum = 0;
+      for (const Line &line : lines) {
+        const size_t n = line.end - line.start;
+        for (size_t step = 0; step < n; ++step) {
+          Bidi::ReorderLine(text, levels.data(), paragraph_levels[line.paragraph], line.start, line.end, &line_levels[0], &visual_to_logical[0], &logical_to_visual[0]);
+          sum += visual_to_logical[step];
+        }
+      }
+      sink = (uint32_t)sum;
+    });
+
+    // the corpus as short labels of 5 to 80 codepoints: each given to RequiresAlgorithm() and Run() by itself, or all of them to RunBatch() on the calling thread or the shared pool
+    std::vector<Bidi::TextSpan> labels;
+    for (size_t i = 0, n = 0; i < length; i += labels.back().length, ++n)
+      labels.push_back(Bidi::TextSpan { &text[i], std::min(length - i, 5 + (n * 37) % 76) });
+    std::vector<Bidi::EmbeddingLevel> label_levels(labels.size());
+    bench("Labels/Bidi::Run", corpus, filter, [&] {
+      uint32_t sum = 0;
+      size_t offset = 0;
+      for (size_t l = 0; l < labels.size(); offset += labels[l].length, ++l) {
+        if (!Bidi::RequiresAlgorithm(labels[l].text, labels[l].length)) {
+          label_levels[l] = 0;
+          memset(&levels[offset], 0, labels[l].length);
+          continue;
+        }
+        Bidi::Run(labels[l].text, labels[l].length, Bidi::BaseDirection::Auto, label_levels[l], &levels[offset], scratch.data());
+        sum += label_levels[l];
+      }
+      sink = sum;
+    });
+    Bidi::ThreadPool calling_thread(1);
+    bench("Labels/Bidi::RunBatch", corpus, filter, [&] {
+      Bidi::RunBatch(labels.data(), labels.size(), Bidi::BaseDirection::Auto, label_levels.data(), levels.data(), &calling_thread);
+      sink = label_levels[0] + levels[length - 1];
+    });
+    bench("Labels/Bidi::RunBatch/shared_pool", corpus, filter, [&] {
+      Bidi::RunBatch(labels.data(), labels.size(), Bidi::BaseDirection::Auto, label_levels.data(), levels.data());
+      sink = label_levels[0] + levels[length - 1];
+    });
+    // the same labels again and again, so after the warm-up pass every one is a hit
+    Bidi::RunCache cache;
+    bench("Labels/Bidi::RunCache", corpus, filter, [&] {
+      uint32_t sum = 0;
+      size_t offset = 0;
+      for (size_t l = 0; l < labels.size(); offset += labels[l].length, ++l) {
+        cache.Run(labels[l].text, labels[l].length, Bidi::BaseDirection::Auto, label_levels[l], &levels[offset]);
+        sum += label_levels[l];
+      }
+      sink = sum;
+    });
+
+    // an editor inserting, deleting and replacing a few characters at a time in a paragraph of 16K codepoints and in one the length of the corpus: the whole paragraph run
+    // again after each edit, or just what the edit can change. The edits are seeded, and then undone in reverse order, so every pass starts from the same text
+    for (size_t edit_length : { length / 4, length }) {
+      struct Edit {
+        size_t start, end;
+        std::vector<Codepoint> inserted;
+      };
+      const size_t Edits = 16;
+      std::vector<Edit> edits;
+      std::vector<Codepoint> edited(text, text + edit_length);
+      Random random(0xed17);
+      for (size_t e = 0; e < Edits; ++e) {
+        Edit edit;
+        const uint32_t kind = random.below(3); // insert, delete, replace
+        edit.start = random.below((uint32_t)edited.size());
+        edit.end = kind == 0 ? edit.start : std::min(edited.size(), edit.start + 1 + random.below(8));
+        if (kind != 1)
+          for (size_t c = 1 + random.below(8), from = random.below((uint32_t)(length - c)); c > 0; --c, ++from)
+            edit.inserted.push_back(text[from]);
+        Edit undo = { edit.start, edit.start + edit.inserted.size(), std::vector<Codepoint>(edited.begin() + edit.start, edited.begin() + edit.end) };
+        edited.erase(edited.begin() + edit.start, edited.begin() + edit.end);
+        edited.insert(edited.begin() + edit.start, edit.inserted.begin(), edit.inserted.end());
+        edits.insert(edits.begin() + e, edit);
+        edits.insert(edits.begin() + e + 1, undo);
+      }
+      edited.assign(text, text + edit_length);
+
+      char name[64];
+      snprintf(name, sizeof(name), "Edit/%zuK/Bidi::Run", edit_length >> 10);
+      std::vector<uint8_t> edit_scratch(Bidi::ScratchBufferSize(edit_length + 8 * Edits));
+      std::vector<Bidi::EmbeddingLevel> edit_levels(edit_length + 8 * Edits);
+      bench(name, corpus, filter, [&] {
+        uint32_t sum = 0;
+        for (const Edit &edit : edits) {
+          edited.erase(edited.begin() + edit.start, edited.begin() + edit.end);
+          edited.insert(edited.begin() + edit.start, edit.inserted.begin(), edit.inserted.end());
+          Bidi::EmbeddingLevel paragraph_level;
+          Bidi::Run(edited.data(), edited.size(), Bidi::BaseDirection::Auto, paragraph_level, edit_levels.data(), edit_scratch.data());
+          sum += paragraph_level + edit_levels[edit.start];
+        }
+        sink = sum;
+      });
+      snprintf(name, sizeof(name), "Edit/%zuK/Bidi::EditableParagraph", edit_length >> 10);
+      Bidi::EditableParagraph editable(text, edit_length, Bidi::BaseDirection::Auto);
+      size_t incremental = 0;
+      const bool ran = bench(name, corpus, filter, [&] {
+        uint32_t sum = 0;
+        incremental = 0;
+        for (const Edit &edit : edits) {
+          editable.Replace(edit.start, edit.end, edit.inserted.data(), edit.inserted.size());
+          incremental += editable.LastResolvedLength() < editable.Length();
+          sum += editable.ParagraphEmbeddingLevel() + editable.EmbeddingLevels()[std::min(edit.start, editable.Length() - 1)];
+        }
+        sink = sum;
+      });
+      if (ran)
+        printf("%-40s %zu of %zu edits resolved part of the paragraph\n", "", incremental, edits.size());
+    }
+
+    if (Bidi::CountParagraphs(text, length) > 1) {
+      std::vector<Bidi::Paragraph> paragraphs(Bidi::CountParagraphs(text, length));
+      bench("Bidi::RunParagraphs", corpus, filter, [&] {
+        Bidi::RunParagraphs(text, length, Bidi::BaseDirection::Auto, paragraphs.data(), levels.data());
+        sink = paragraphs.back().embedding_level + levels[length - 1];
+      });
+    }
+
+    // the whole corpus at once; the quick check alone is the cost of text that is already normalized
+    bench("Normalization::QuickCheck", corpus, filter, [&] {
+      sink = (uint32_t)Normalization::QuickCheck(text, length, Normalization::Form::NFC);
+    });
+    static const char *form_names[] = { "Normalization::NFD", "Normalization::NFC", "Normalization::NFKD", "Normalization::NFKC" };
+    for (Normalization::Form form : { Normalization::Form::NFD, Normalization::Form::NFC, Normalization::Form::NFKD, Normalization::Form::NFKC }) {
+      bench(form_names[(int)form], corpus, filter, [&] {
+        sink = (uint32_t)Normalization::Normalize(text, length, form, normalized.data());
+      });
+    }
+  }
+
+  return 0;
+}
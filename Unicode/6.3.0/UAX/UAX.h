@@ -1,6 +1,7 @@
 #ifndef UAX_H
 #define UAX_H
 
+#include <functional>
 #include "UCD.h"
 
 namespace UAX {
@@ -18,9 +19,11 @@ namespace UAX {
     typedef uint8_t EmbeddingLevel;
     
     /**
-     ** Returns 'true' if the full Bidi Algorithm is required, 'false' if not (text purely LTR)
+     ** Returns 'true' if the full Bidi Algorithm is required, 'false' if not (text purely LTR). The UTF-16 and UTF-8 overloads take code units and need no transcoding
      **/
     bool RequiresAlgorithm(const Codepoint *text, const size_t length);
+    bool RequiresAlgorithm(const uint16_t *utf16, const size_t length);
+    bool RequiresAlgorithm(const uint8_t *utf8, const size_t length);
     
     /**
      ** Given a length of text, Run() requires a scratch buffer of this size. A scratch buffer allocation may be reused across Run()'s
@@ -29,51 +32,386 @@ namespace UAX {
     
     /**
      ** Determine the paragraph embedding level and find the nested embedding level for all input characters. resolved_embedding_levels must hold 'length' x sizeof(EmbeddingLevel). scratch_buffer must be an allocation of ScratchBufferSize(length) bytes.
+     ** Characters removed by X9 (embedding and override formatting characters, and BN) are left at Removed_Level.
      **/
     void Run(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, void *scratch_buffer
       #if UAX_BIDI_ENABLE_DEBUG_TRACE
       ,bool debug_trace = false
       #endif
     );
+    static const EmbeddingLevel Removed_Level = 255;
+    
+    /**
+     ** Run(), with the levels given as runs of characters at the same level instead of one per character. A character removed by X9 goes in the run before it, or the one after it at
+     ** the start of the paragraph (5.2). Returns the number of runs; only the first run_capacity of them are written to runs, and there are never more than 'length' of them.
+     ** 'length' must fit in a uint32_t (less one). scratch_buffer must be an allocation of LevelRunsScratchBufferSize(length) bytes, the same as ScratchBufferSize(length): the runs are
+     ** read from the algorithm's level runs, with no level per character kept anywhere
+     **/
+    struct ResolvedLevelRun {
+      uint32_t start, length;
+      EmbeddingLevel level;
+    };
+    size_t LevelRunsScratchBufferSize(const size_t text_length);
+    size_t RunLevelRuns(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, ResolvedLevelRun *runs, const size_t run_capacity, void *scratch_buffer);
+
+    /**
+     ** Run() on UTF-16 or UTF-8 code units, decoded as the characters are classified so no UTF-32 copy is needed; an ill-formed sequence is U+FFFD, as Next_UTF16() and Next_UTF8()
+     ** decode it. 'length' is in code units, for ScratchBufferSize() too, and resolved_embedding_levels must hold 'length' levels: one per codepoint with LevelsFor::Codepoints, or one per
+     ** code unit with LevelsFor::CodeUnits, each code unit taking the level of the codepoint it is part of. Returns the number of levels written
+     **/
+    enum class LevelsFor {
+      Codepoints,
+      CodeUnits,
+    };
+    size_t Run(const uint16_t *utf16, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, const LevelsFor levels_for, void *scratch_buffer
+      #if UAX_BIDI_ENABLE_DEBUG_TRACE
+      ,bool debug_trace = false
+      #endif
+    );
+    size_t Run(const uint8_t *utf8, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, const LevelsFor levels_for, void *scratch_buffer
+      #if UAX_BIDI_ENABLE_DEBUG_TRACE
+      ,bool debug_trace = false
+      #endif
+    );
+
+    /**
+     ** Run() on the Bidi_Class of each character instead of its text, for a caller that already has them (kept across edits, or made up as in BidiTest.txt), so that nothing is
+     ** looked up. BD16 pairs brackets by their codepoints, which brackets stands in for: null if the text has none, or one BracketInfo per character, as GetBracketInfo() gives
+     ** for its codepoint. A BracketInfo only counts for a character of class ON, as with text. 'length' is in characters, for ScratchBufferSize() too
+     **/
+    struct BracketInfo {
+      Bidi_Paired_Bracket_Type type; // None for a character that isn't a bracket
+      Codepoint pair; // the opening bracket of its pair, so two brackets pair if they have the same one -- all of them are in the BMP
+    };
+    BracketInfo GetBracketInfo(const Codepoint code);
+    void Run(const Bidi_Class *classes, const BracketInfo *brackets, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, void *scratch_buffer
+      #if UAX_BIDI_ENABLE_DEBUG_TRACE
+      ,bool debug_trace = false
+      #endif
+    );
+
+    /**
+     ** Counts kept by Run() per thread and summed over all threads by GetRunCounters(), since the start of the process or ResetRunCounters(). A paragraph without explicit formatting characters (or BN) is a single
+     ** level run, so Run() skips X1-X9 and building isolating run sequences for it; a paragraph without brackets skips bracket pairing (N0)
+     **/
+    struct RunCounters {
+      uint64_t runs; // non-empty paragraphs
+      uint64_t single_level_runs; // of those, how many took the single level run path
+      uint64_t bracket_pairings; // and how many had brackets to pair
+    };
+    RunCounters GetRunCounters();
+    void ResetRunCounters();
+
+    /**
+     ** Where Run() spends its time, for finding the slow phase on real input: the time in each phase and what it came across, summed over all threads while EnablePhaseStats(true)
+     ** is on, since it was first switched on or ResetPhaseStats(). Off, Run() checks one flag per paragraph; on, it reads the clock between phases, which the sequence phases
+     ** (W to I) do once per isolating run sequence. A paragraph without explicit formatting does X1-X10 in X10
+     **/
+    enum class Phase {
+      Initializaton, // classes, brackets and isolate pairs looked up
+      The_Paragraph_Level, // P2-P3
+      Explicit_Levels_and_Directions, // X1-X8
+      X9,
+      X10, // level runs and isolating run sequences
+      W, // W1-W7
+      N0,
+      N1_N2,
+      I, // I1-I2, and spreading the levels over code units
+    };
+    static const int Phase_Count = 9;
+    const char *PhaseName(const Phase phase);
+    struct PhaseStats {
+      uint64_t runs; // non-empty paragraphs timed
+      uint64_t nanoseconds[Phase_Count];
+      uint64_t cycles[Phase_Count]; // time stamp counter ticks on x86, 0 elsewhere
+      uint64_t isolates; // isolate initiators matched with a PDI
+      uint64_t bracket_pairs; // paired by BD16
+      uint64_t isolating_run_sequences;
+      uint64_t max_depth; // deepest the directional status stack went above the paragraph level, in any paragraph
+      uint64_t lookahead_steps; // characters looked at again ahead of or behind where a phase is: P2 and FSI looking for a strong character, W5 spreading an EN over ETs, and N1 going back over neutrals
+    };
+    void EnablePhaseStats(const bool enabled);
+    PhaseStats GetPhaseStats();
+    void ResetPhaseStats();
+
+    /**
+     ** Worker threads for RunParagraphs(). A thread_count of 0 means one thread per core. The thread calling ForEach() does its share of the work, so a pool of 1 starts no
+     ** threads of its own. ForEach() calls f(0) ... f(count - 1), spread over the threads, and returns once they have all returned. ForEach() may be called from several
+     ** threads at once (as on the pool RunParagraphs() and RunBatch() share when given none): each call is queued, the pool's threads take on the oldest calls first, and every
+     ** caller works through its own, so no caller waits for another call to finish before its own gets going
+     **/
+    class ThreadPool {
+    public:
+      explicit ThreadPool(unsigned thread_count = 0);
+      ~ThreadPool();
+      unsigned ThreadCount() const;
+      void ForEach(const size_t count, const std::function<void(size_t)> &f);
+      struct State;
+    private:
+      ThreadPool(const ThreadPool &) = delete;
+      ThreadPool &operator=(const ThreadPool &) = delete;
+      State *state;
+    };
+
+    /**
+     ** A paragraph of the text given to RunParagraphs() -- P1: the text up to and including a paragraph separator (CR LF counts as one), or up to the end of the text
+     **/
+    struct Paragraph {
+      size_t start, length;
+      EmbeddingLevel embedding_level; // resolved paragraph embedding level
+    };
+    size_t CountParagraphs(const Codepoint *text, const size_t length);
+
+    /**
+     ** Run() for each paragraph of the text, which each get their own paragraph embedding level by base_direction. paragraphs must hold CountParagraphs(text, length) entries and
+     ** resolved_embedding_levels 'length'. Paragraphs are resolved concurrently on pool, or on a pool of one thread per core shared by the process if pool is null; each thread
+     ** keeps a scratch buffer for the paragraphs it resolves
+     **/
+    void RunParagraphs(const Codepoint *text, const size_t length, const BaseDirection base_direction, Paragraph *paragraphs, EmbeddingLevel *resolved_embedding_levels, ThreadPool *pool = nullptr);
+
+    /**
+     ** Run() for many short texts at once, such as labels and table cells, each a paragraph of its own. The levels of each text follow those of the text before it in
+     ** resolved_embedding_levels, which must hold the lengths of all of them together; resolved_paragraph_embedding_levels holds one level per text. Unless base_direction is Right,
+     ** a text with no R, AL, AN, explicit formatting characters or BN skips the algorithm, as all of it is at level 0 -- for most of the BMP that is checked 4 codepoints at
+     ** a time. The others are run with a scratch buffer kept per thread. The texts are spread over the threads of pool as in RunParagraphs(); a pool of 1 keeps them on the calling thread
+     **/
+    struct TextSpan {
+      const Codepoint *text;
+      size_t length;
+    };
+    void RunBatch(const TextSpan *texts, const size_t count, const BaseDirection base_direction, EmbeddingLevel *resolved_paragraph_embedding_levels, EmbeddingLevel *resolved_embedding_levels, ThreadPool *pool = nullptr);
+
+    /**
+     ** A paragraph that keeps its text and resolved levels between edits, for an editor. Replace() swaps text[start, end) for 'length' new characters and brings the levels up to
+     ** date, the same as Run() over the whole new text would. The explicit levels and isolating run sequences of the last full Run() are kept, and while an edit brings in or
+     ** takes away no explicit formatting character other than BN, they stay as they were; the rules of a sequence don't see past a strong character, so only the text between
+     ** the strong characters of its sequence around the edit is resolved again -- widened to take in any bracket pair of the sequence that crosses it -- or, where that text
+     ** takes in an embedding or isolate boundary, the whole of that one sequence. A full Run() is still needed when the edit changes the paragraph embedding level or the
+     ** direction of an FSI, or brings in the first characters between two explicit formatting characters or takes away the last
+     **/
+    class EditableParagraph {
+    public:
+      EditableParagraph(const Codepoint *text, const size_t length, const BaseDirection base_direction);
+      ~EditableParagraph();
+      void Replace(const size_t start, const size_t end, const Codepoint *text, const size_t length);
+      void Insert(const size_t at, const Codepoint *text, const size_t length) { Replace(at, at, text, length); }
+      void Delete(const size_t start, const size_t end) { Replace(start, end, nullptr, 0); }
+      
+      const Codepoint *Text() const;
+      size_t Length() const;
+      EmbeddingLevel ParagraphEmbeddingLevel() const;
+      const EmbeddingLevel *EmbeddingLevels() const;
+      size_t LastResolvedLength() const; // how many characters the last edit resolved again, the whole paragraph if it needed a full Run()
+      struct State;
+    private:
+      EditableParagraph(const EditableParagraph &) = delete;
+      EditableParagraph &operator=(const EditableParagraph &) = delete;
+      State *state;
+    };
+
+    /**
+     ** Reorder the line text[line_start, line_end) of a paragraph resolved by Run() -- L1 and L2, in time linear in the length of the line. Each output holds one entry per character of the line:
+     **   line_levels: the levels after L1, where segment and paragraph separators, and any whitespace and isolate formatting characters before them or at the end of the line, are reset to
+     **     paragraph_embedding_level. A character at Removed_Level is reset with the whitespace around it, or otherwise takes the level of the character before it, so it has a place in the order
+     **   visual_to_logical: for each visual position from the left, the index in text of the character shown there
+     **   logical_to_visual: for each character of the line, from line_start on, its visual position
+     **/
+    void ReorderLine(const Codepoint *text, const EmbeddingLevel *resolved_embedding_levels, const EmbeddingLevel paragraph_embedding_level, const size_t line_start, const size_t line_end,
+                     EmbeddingLevel *line_levels, size_t *visual_to_logical, size_t *logical_to_visual);
+
+    /**
+     ** L4 -- out[i] is the mirrored glyph of text[i] (Get_Bidi_Mirroring()) if levels[i] is odd and it has one, otherwise text[i]; a character at Removed_Level is left as it is.
+     ** levels are those of Run() or the line_levels of ReorderLine(), and out may be text. Stretches of even levels are skipped 8 levels at a time, and only the characters whose
+     ** properties say they have a mirrored glyph are looked up. Returns how many characters were mirrored
+     **/
+    size_t ApplyMirroring(const Codepoint *text, const EmbeddingLevel *levels, const size_t length, Codepoint *out);
+
+    /**
+     ** The order ReorderLine() finds for a line, kept as its runs of characters at the same level after L1 -- each of which stays together when reordered, reversed if its level
+     ** is odd -- for caret movement, hit testing and selection. Indices are into text, as line_start to line_end - 1, and visual positions count from 0 at the left of the line.
+     ** Mapping either way and NextVisual() find the run by binary search; SelectionRanges() visits only the runs the selection touches. A line is limited to 4G characters. An index or visual position outside the line
+     ** -- any at all, for an empty line -- maps to None, and has level 0
+     **/
+    class VisualMap {
+    public:
+      static const size_t None = (size_t)-1;
+      VisualMap(const Codepoint *text, const EmbeddingLevel *resolved_embedding_levels, const EmbeddingLevel paragraph_embedding_level, const size_t line_start, const size_t line_end);
+      VisualMap(VisualMap &&other);
+      VisualMap &operator=(VisualMap &&other);
+      ~VisualMap();
+
+      size_t LineStart() const;
+      size_t Length() const;
+      size_t RunCount() const;
+      size_t LogicalToVisual(const size_t index) const;
+      size_t VisualToLogical(const size_t visual) const;
+      EmbeddingLevel LevelAt(const size_t index) const; // after L1
+      size_t NextVisual(const size_t index, const bool rightward) const; // the index of the character next to index on the right (or left), None at the end of the line
+
+      /**
+       ** The characters text[start, end) of the line as ranges of visual positions, from left to right, with touching ranges joined. ranges must hold RunCount() entries;
+       ** returns how many were written
+       **/
+      struct VisualRange {
+        size_t visual_start, length;
+      };
+      size_t SelectionRanges(const size_t start, const size_t end, VisualRange *ranges) const;
+      struct State;
+    private:
+      VisualMap(const VisualMap &) = delete;
+      VisualMap &operator=(const VisualMap &) = delete;
+      State *state;
+    };
+
+    /**
+     ** Run(), RunLevelRuns() and ReorderLine() without scratch buffers or outputs to manage: a Context keeps them in memory of its own, which grows (doubling) to fit the longest
+     ** text it has been given and is kept for the next call, so once it has grown a call allocates nothing. The results point into that memory and stay valid until the next
+     ** Run() or RunLevelRuns() for those, or the next ReorderLine() for its line -- so a line can be reordered from the levels Run() returned. retained_capacity caps what is kept
+     ** between calls, for the levels, the runs and a line each (0 keeps it all): memory a longer text needed beyond the cap is given back at the next call that fits in it. A Context is used by one thread at a time, and
+     ** ThreadContext() is one kept for each thread
+     **/
+    class Context {
+    public:
+      explicit Context(const size_t retained_capacity = 0);
+      ~Context();
+      const EmbeddingLevel *Run(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level);
+      const EmbeddingLevel *Run(const uint16_t *utf16, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, const LevelsFor levels_for, size_t &level_count);
+      const EmbeddingLevel *Run(const uint8_t *utf8, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, const LevelsFor levels_for, size_t &level_count);
+      const ResolvedLevelRun *RunLevelRuns(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, size_t &run_count);
+      struct Line {
+        const EmbeddingLevel *line_levels;
+        const size_t *visual_to_logical, *logical_to_visual;
+      };
+      Line ReorderLine(const Codepoint *text, const EmbeddingLevel *resolved_embedding_levels, const EmbeddingLevel paragraph_embedding_level, const size_t line_start, const size_t line_end);
+
+      size_t Capacity() const; // bytes held now
+      void Trim(); // gives back everything held, for a Context that sits unused
+      struct State;
+    private:
+      Context(const Context &) = delete;
+      Context &operator=(const Context &) = delete;
+      State *state;
+    };
+    Context &ThreadContext();
+
+    /**
+     ** Run() for text that comes up again and again, such as UI labels: the paragraph level and the levels (as runs of the same level) of each text and base_direction resolved
+     ** are kept, and the same text gets them back without running the algorithm. Entries are found by a hash of the text, and keep the text to compare with so a collision
+     ** can't give the wrong levels. The cache is split into shard_count shards by hash, each with a lock of its own and memory_limit / shard_count bytes; when a shard is full
+     ** the entries used least recently go first, and a text too big for a shard is resolved without being kept. Safe to call from any number of threads
+     **/
+    class RunCache {
+    public:
+      explicit RunCache(const size_t memory_limit = 16 << 20, const unsigned shard_count = 16);
+      ~RunCache();
+      void Run(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels);
+      void Clear();
+      struct Counters {
+        uint64_t hits, misses, evictions;
+        size_t entries, bytes; // held now
+      };
+      Counters GetCounters() const;
+      struct State;
+    private:
+      RunCache(const RunCache &) = delete;
+      RunCache &operator=(const RunCache &) = delete;
+      State *state;
+    };
   };
   
   namespace Normalization {
     /**
      ** Unicode Normalization Forms -- UAX #15 -- http://unicode.org/reports/tr15/
      **/
+    enum class Form {
+      NFD,
+      NFC,
+      NFKD,
+      NFKC,
+    };
     
+    /**
+     ** Given a length of text, the output buffer of CanonicalDecomposition(), NFD() and NFC() needs room for this many codepoints;
+     ** CompatibilityDecomposition(), NFKD() and NFKC() need the larger BufferSizeForCompatibilityDecomposition()
+     **/
     size_t BufferSizeForCanonicalDecomposition(size_t length);
+    size_t BufferSizeForCompatibilityDecomposition(size_t length);
     
     /**
-     ** 
+     ** Quick check -- UAX #15 section 9. NotNormalized and Normalized are definite, MaybeNormalized means only normalizing will tell (a character
+     ** that may compose with the one before it, NFC and NFKC only)
      **/
     enum class QuickCheckResult {
       Normalized,
       MaybeNormalized,
       NotNormalized,
     };
-    inline QuickCheckResult QuickCheck(const Codepoint *text, const size_t length) {
-      for (int i = 0; i < length; ++i) {
-        // Codepoint ch = text[i];
-        // todo
-      }
-      return QuickCheckResult::NotNormalized;
-    }
+    QuickCheckResult QuickCheck(const Codepoint *text, const size_t length, const Form form = Form::NFC);
     
-    void CanonicalDecomposition();
-    void CanonicalComposition();
-    void CompatibilityDecomposition();
+    /**
+     ** The building blocks, each over the whole text: full decomposition followed by canonical ordering (out must not be text), and canonical composition
+     ** of decomposed text in place. All return the number of codepoints written
+     **/
+    size_t CanonicalDecomposition(const Codepoint *text, const size_t length, Codepoint *out);
+    size_t CompatibilityDecomposition(const Codepoint *text, const size_t length, Codepoint *out);
+    size_t CanonicalComposition(Codepoint *text, const size_t length);
     
-    void NFD(); // CanonicalDecomposition
-    void NFC(); // CanonicalDecomposition -> CanonicalComposition
-    void NFKD(); // CompatibilityDecomposition
-    void NFKC(); // CompatibilityDecomposition -> CanonicalComposition    
+    /**
+     ** Normalize text into out (which must not be text, and is sized by BufferSizeFor...Decomposition() above) and return the number of codepoints written.
+     ** Text that passes the quick check is copied as it is; only the segments around a character that fails it -- from the last starter that nothing can
+     ** reorder or compose across, up to the next one -- are decomposed and, for NFC and NFKC, composed again. Nothing is allocated
+     **/
+    size_t Normalize(const Codepoint *text, const size_t length, const Form form, Codepoint *out);
+    size_t NFD(const Codepoint *text, const size_t length, Codepoint *out); // CanonicalDecomposition
+    size_t NFC(const Codepoint *text, const size_t length, Codepoint *out); // CanonicalDecomposition -> CanonicalComposition
+    size_t NFKD(const Codepoint *text, const size_t length, Codepoint *out); // CompatibilityDecomposition
+    size_t NFKC(const Codepoint *text, const size_t length, Codepoint *out); // CompatibilityDecomposition -> CanonicalComposition
   };
 };
 
 namespace Unicode {
   void UTF8_to_UTF32();
   void UTF32_to_UTF8();
+  
+  /**
+   ** Decode the codepoint starting at text[i] and advance i past it. An ill-formed sequence decodes to U+FFFD and advances i by one code unit
+   **/
+  inline Codepoint Next_UTF8(const uint8_t *text, const size_t length, size_t &i) {
+    uint8_t lead = text[i++];
+    if (lead < 0x80)
+      return lead;
+    int count;
+    Codepoint code, min;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+      count = 1; code = lead & 0x1F; min = 0x80;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+      count = 2; code = lead & 0x0F; min = 0x800;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+      count = 3; code = lead & 0x07; min = 0x10000;
+    } else {
+      return 0xFFFD;
+    }
+    if (i + count > length)
+      return 0xFFFD;
+    for (int k = 0; k < count; ++k) {
+      uint8_t trail = text[i + k];
+      if ((trail & 0xC0) != 0x80)
+        return 0xFFFD;
+      code = (code << 6) | (trail & 0x3F);
+    }
+    if (code < min || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF))
+      return 0xFFFD;
+    i += count;
+    return code;
+  }
+  inline Codepoint Next_UTF16(const uint16_t *text, const size_t length, size_t &i) {
+    uint16_t unit = text[i++];
+    if (unit < 0xD800 || unit > 0xDFFF)
+      return unit;
+    if (unit <= 0xDBFF && i < length && text[i] >= 0xDC00 && text[i] <= 0xDFFF)
+      return 0x10000 + ((Codepoint)(unit - 0xD800) << 10) + (text[i++] - 0xDC00);
+    return 0xFFFD;
+  }
 };
 
 #endif
@@ -1,7 +1,16 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 #include "UAX.h"
 #include "UCDReader.h"
+#include "UAXTestUtil.h"
 
 #define ANSI_FOREGROUND_RED     "\x1b[31m"
 #define ANSI_FOREGROUND_GREEN   "\x1b[32m"
@@ -24,13 +33,571 @@ struct GrowingScratchBuffer {
   }
 };
 
+/**
+ ** RequiresAlgorithm() on every codepoint, embedded in LTR padding at a varying offset so it lands in different SIMD block positions, in all three encodings
+ **/
+int test_RequiresAlgorithm() {
+  int failed = 0;
+  const int Length = 40;
+  for (uint32_t c = 0; c <= 0x10FFFF; ++c) {
+    if (c >= 0xD800 && c <= 0xDFFF)
+      continue;
+    int offset = c % (Length - 3);
+    uint32_t utf32[Length];
+    std::vector<uint16_t> utf16;
+    std::vector<uint8_t> utf8;
+    for (int i = 0; i < Length; ++i) {
+      uint32_t code = (i == offset) ? c : ((i & 1) ? 0x00E9 : 'a');
+      utf32[i] = code;
+      append_utf16(utf16, code);
+      append_utf8(utf8, code);
+    }
+    bool expected;
+    switch (UCD::Get_Bidi_Class(c)) {
+      case UCD::Bidi_Class::Right_To_Left:
+      case UCD::Bidi_Class::Right_To_Left_Embedding:
+      case UCD::Bidi_Class::Right_To_Left_Override:
+      case UCD::Bidi_Class::Right_To_Left_Isolate:
+      case UCD::Bidi_Class::Arabic_Letter:
+        expected = true;
+        break;
+      default:
+        expected = false;
+        break;
+    }
+    if (UAX::Bidi::RequiresAlgorithm(utf32, Length) != expected ||
+        UAX::Bidi::RequiresAlgorithm(utf16.data(), utf16.size()) != expected ||
+        UAX::Bidi::RequiresAlgorithm(utf8.data(), utf8.size()) != expected) {
+      printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " RequiresAlgorithm U+%04X\n", c);
+      ++failed;
+    }
+  }
+  return failed;
+}
+
+/**
+ ** RunParagraphs() on a long random document against Run() on each paragraph by itself, on pools of several sizes, and from several threads at once on one pool
+ **/
+int test_RunParagraphs() {
+  int failed = 0;
+  static const uint32_t alphabet[] = { 'a', 'b', ' ', '1', '(', ')', 0x05D0, 0x05D1, 0x0627, 0x0661, 0x2067, 0x2069, 0x202B, 0x202C, 0x2029, 0x000A, 0x000D, 0x001C };
+  const size_t Length = 200000;
+  uint64_t random = 1;
+  std::vector<uint32_t> text = random_text(random, alphabet, Length);
+  for (size_t i = 0; i < Length; ++i) {
+    if (i % 20000 < 10000 && UCD::Get_Bidi_Class(text[i]) == UCD::Bidi_Class::Paragraph_Separator) // some paragraphs long enough to span several tasks
+      text[i] = ' ';
+  }
+  
+  std::vector<UAX::Bidi::EmbeddingLevel> expected_levels(Length);
+  std::vector<UAX::Bidi::EmbeddingLevel> expected_paragraph_levels;
+  std::vector<size_t> expected_starts;
+  GrowingScratchBuffer<void> scratch;
+  for (size_t start = 0; start < Length; ) {
+    size_t end = start;
+    while (end < Length && UCD::Get_Bidi_Class(text[end]) != UCD::Bidi_Class::Paragraph_Separator)
+      ++end;
+    if (end < Length)
+      end += (text[end] == 0x000D && end + 1 < Length && text[end + 1] == 0x000A) ? 2 : 1;
+    scratch.ensureSize(UAX::Bidi::ScratchBufferSize(end - start));
+    UAX::Bidi::EmbeddingLevel paragraph_level;
+    UAX::Bidi::Run(&text[start], end - start, UAX::Bidi::BaseDirection::Auto, paragraph_level, &expected_levels[start], scratch.buffer);
+    expected_starts.push_back(start);
+    expected_paragraph_levels.push_back(paragraph_level);
+    start = end;
+  }
+  
+  if (UAX::Bidi::CountParagraphs(text.data(), Length) != expected_starts.size()) {
+    printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " CountParagraphs\n");
+    return 1;
+  }
+  for (unsigned thread_count : { 0u, 1u, 2u, 5u }) {
+    UAX::Bidi::ThreadPool own_pool(thread_count == 0 ? 1 : thread_count);
+    std::vector<UAX::Bidi::Paragraph> paragraphs(expected_starts.size());
+    std::vector<UAX::Bidi::EmbeddingLevel> levels(Length);
+    UAX::Bidi::RunParagraphs(text.data(), Length, UAX::Bidi::BaseDirection::Auto, paragraphs.data(), levels.data(), thread_count == 0 ? nullptr : &own_pool);
+    bool same = levels == expected_levels;
+    for (size_t p = 0; p < paragraphs.size(); ++p)
+      same = same && paragraphs[p].start == expected_starts[p] && paragraphs[p].embedding_level == expected_paragraph_levels[p];
+    if (!same) {
+      printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " RunParagraphs on %s\n", thread_count == 0 ? "the shared pool" : "a pool");
+      ++failed;
+    }
+  }
+  
+  const int Callers = 4;
+  UAX::Bidi::ThreadPool pool(3);
+  std::vector<std::vector<UAX::Bidi::EmbeddingLevel>> caller_levels(Callers, std::vector<UAX::Bidi::EmbeddingLevel>(Length));
+  std::vector<std::thread> callers;
+  for (int c = 0; c < Callers; ++c) {
+    callers.push_back(std::thread([&, c] {
+      std::vector<UAX::Bidi::Paragraph> paragraphs(expected_starts.size());
+      for (int repeat = 0; repeat < 3; ++repeat)
+        UAX::Bidi::RunParagraphs(text.data(), Length, UAX::Bidi::BaseDirection::Auto, paragraphs.data(), caller_levels[c].data(), &pool);
+    }));
+  }
+  for (std::thread &caller : callers)
+    caller.join();
+  for (int c = 0; c < Callers; ++c) {
+    if (caller_levels[c] != expected_levels) {
+      printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " RunParagraphs from %d threads at once, caller %d\n", Callers, c);
+      ++failed;
+    }
+  }
+  return failed;
+}
+
+/**
+ ** RunBatch() on many short random texts, mostly Latin with some controls, Arabic digits, Hebrew and explicit formatting, against Run() on each
+ **/
+int test_RunBatch() {
+  int failed = 0;
+  static const uint32_t specials[] = { 0x0000, 0x0008, 0x000E, 0x001B, 0x007F, 0x0085, 0x00AD, 0x05D0, 0x0627, 0x0661, 0x202A, 0x202B, 0x2066, 0x2069, 0x200B, 0x2029, 0x4E00 };
+  uint64_t random = 3;
+  auto next = [&](uint32_t n) { return random_below(random, n); };
+  const size_t Count = 20000;
+  std::vector<uint32_t> characters;
+  std::vector<size_t> starts;
+  for (size_t t = 0; t < Count; ++t) {
+    starts.push_back(characters.size());
+    size_t length = next(81);
+    bool plain = next(3) > 0;
+    for (size_t k = 0; k < length; ++k) {
+      uint32_t pick = next(100);
+      if (plain || pick < 70)
+        characters.push_back(0x20 + next(0x5F));
+      else if (pick < 95)
+        characters.push_back(next(0x0700));
+      else
+        characters.push_back(specials[next(sizeof(specials) / sizeof(specials[0]))]);
+    }
+  }
+  for (uint32_t c = 0; c <= 0x10FFFF; ++c) { // and every codepoint before an L, which any class the pre-filter must not let through would move off level 0
+    starts.push_back(characters.size());
+    characters.push_back(c);
+    characters.push_back('a');
+  }
+  starts.push_back(characters.size());
+  const size_t Count_With_Codepoints = starts.size() - 1;
+  std::vector<UAX::Bidi::TextSpan> texts(Count_With_Codepoints);
+  for (size_t t = 0; t < Count_With_Codepoints; ++t)
+    texts[t] = UAX::Bidi::TextSpan { &characters[starts[t]], starts[t + 1] - starts[t] };
+  
+  GrowingScratchBuffer<void> scratch;
+  for (auto direction : { UAX::Bidi::BaseDirection::Auto, UAX::Bidi::BaseDirection::Left, UAX::Bidi::BaseDirection::Right }) {
+    std::vector<UAX::Bidi::EmbeddingLevel> expected_levels(characters.size()), expected_paragraph_levels(Count_With_Codepoints);
+    for (size_t t = 0; t < Count_With_Codepoints; ++t) {
+      scratch.ensureSize(UAX::Bidi::ScratchBufferSize(texts[t].length));
+      UAX::Bidi::Run(texts[t].text, texts[t].length, direction, expected_paragraph_levels[t], &expected_levels[starts[t]], scratch.buffer);
+    }
+    for (unsigned thread_count : { 1u, 3u }) {
+      UAX::Bidi::ThreadPool pool(thread_count);
+      std::vector<UAX::Bidi::EmbeddingLevel> levels(characters.size()), paragraph_levels(Count_With_Codepoints);
+      UAX::Bidi::RunBatch(texts.data(), Count_With_Codepoints, direction, paragraph_levels.data(), levels.data(), &pool);
+      if (levels != expected_levels || paragraph_levels != expected_paragraph_levels) {
+        printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " RunBatch on %u threads\n", thread_count);
+        ++failed;
+      }
+    }
+  }
+  return failed;
+}
+
+static bool same_as_run(const UAX::Bidi::EditableParagraph &paragraph, const std::vector<uint32_t> &text, const UAX::Bidi::BaseDirection direction, GrowingScratchBuffer<void> &scratch) {
+  std::vector<UAX::Bidi::EmbeddingLevel> levels(text.size());
+  UAX::Bidi::EmbeddingLevel paragraph_level = 0;
+  scratch.ensureSize(UAX::Bidi::ScratchBufferSize(text.size()));
+  UAX::Bidi::Run(text.data(), text.size(), direction, paragraph_level, levels.data(), scratch.buffer);
+  bool same = paragraph.Length() == text.size() && paragraph.ParagraphEmbeddingLevel() == paragraph_level;
+  for (size_t i = 0; same && i < text.size(); ++i)
+    same = paragraph.Text()[i] == text[i] && paragraph.EmbeddingLevels()[i] == levels[i];
+  return same;
+}
+
+/**
+ ** Random edits to a Paragraph, against Run() over the whole text after each one -- some of them to texts thick with explicit formatting characters and BN, and some to
+ ** plain text with none, in which every edit has to be resolved on its own. And an edit next to a BN, in a paragraph with an isolate, that has to be resolved on its own
+ **/
+int test_EditableParagraph() {
+  int failed = 0;
+  static const uint32_t alphabet[] = { 'a', 'b', ' ', ' ', '1', '2', '$', '+', ',', '!', 0x0009, 0x0300, 0x05D0, 0x05D1, 0x0627, 0x0661, '(', ')', '[', ']', 0x2329, 0x3009, 0x3008, 0x232A, 0x2029 };
+  static const uint32_t explicit_formatting[] = { 0x202B, 0x202A, 0x202E, 0x202D, 0x202C, 0x2067, 0x2066, 0x2068, 0x2069, 0x2069, 0x200B, 0x00AD };
+  uint64_t random = 7;
+  auto next = [&](uint32_t n) { return random_below(random, n); };
+  static const uint32_t plain_alphabet[] = { 'a', 'b', 'c', ' ', ' ', '1', '2', ',', '.', '-', 0x0300, 0x05D0, 0x05D1, 0x0627, 0x0661, '(', ')' }; // as in prose, without B
+  uint32_t formatting_odds = 300;
+  auto character = [&] {
+    if (formatting_odds == 0)
+      return plain_alphabet[next(sizeof(plain_alphabet) / sizeof(plain_alphabet[0]))];
+    return next(formatting_odds) ? alphabet[next(sizeof(alphabet) / sizeof(alphabet[0]))] : explicit_formatting[next(sizeof(explicit_formatting) / sizeof(explicit_formatting[0]))];
+  };
+  size_t edits = 0, partial = 0, plain_edits = 0, plain_partial = 0;
+  GrowingScratchBuffer<void> scratch;
+  for (int pass = 0; pass < 8; ++pass) {
+    auto direction = pass < 6 ? (UAX::Bidi::BaseDirection)(pass % 3) : pass == 6 ? UAX::Bidi::BaseDirection::Left : UAX::Bidi::BaseDirection::Right;
+    formatting_odds = pass < 3 ? 300 : pass < 6 ? 12 : 0; // plain text in the last two
+    std::vector<uint32_t> text(1000);
+    for (uint32_t &c : text)
+      c = character();
+    UAX::Bidi::EditableParagraph paragraph(text.data(), text.size(), direction);
+    for (int e = 0; e < 3000; ++e) {
+      size_t length = paragraph.Length();
+      size_t start = next(length + 1);
+      size_t end = std::min(length, start + (next(4) ? next(2) : next(40)));
+      std::vector<uint32_t> inserted(next(4) ? next(2) : next(40));
+      for (uint32_t &c : inserted)
+        c = character();
+      if (length > 4000)
+        inserted.clear();
+      paragraph.Replace(start, end, inserted.data(), inserted.size());
+      text.erase(text.begin() + start, text.begin() + end);
+      text.insert(text.begin() + start, inserted.begin(), inserted.end());
+      if (!same_as_run(paragraph, text, direction, scratch)) {
+        printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " EditableParagraph::Replace(%d, %d, %d characters) edit %d of pass %d\n", (int)start, (int)end, (int)inserted.size(), e, pass);
+        ++failed;
+        break;
+      }
+      bool resolved_part = paragraph.LastResolvedLength() < text.size();
+      if (pass < 6) {
+        ++edits;
+        partial += resolved_part;
+      } else {
+        ++plain_edits;
+        plain_partial += resolved_part;
+      }
+    }
+  }
+  if (partial == 0) {
+    printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " EditableParagraph never resolved only part of the text\n");
+    ++failed;
+  }
+  if (plain_partial < plain_edits) {
+    printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " EditableParagraph resolved all of a plain text again after %d of %d edits\n", (int)(plain_edits - plain_partial), (int)plain_edits);
+    ++failed;
+  }
+  printf("EditableParagraph resolved part of the text after %d of %d edits, and %d of %d edits to plain text\n", (int)partial, (int)edits, (int)plain_partial, (int)plain_edits);
+  
+  // "ab <RLI>אב<PDI> cd<SHY>e f", with "z " typed after the soft hyphen: only "d<SHY>z e" is resolved again
+  std::vector<uint32_t> text = { 'a', 'b', ' ', 0x2067, 0x05D0, 0x05D1, 0x2069, ' ', 'c', 'd', 0x00AD, 'e', ' ', 'f' };
+  UAX::Bidi::EditableParagraph paragraph(text.data(), text.size(), UAX::Bidi::BaseDirection::Auto);
+  const uint32_t typed[] = { 'z', ' ' };
+  paragraph.Insert(11, typed, 2);
+  text.insert(text.begin() + 11, typed, typed + 2);
+  if (!same_as_run(paragraph, text, UAX::Bidi::BaseDirection::Auto, scratch) || paragraph.LastResolvedLength() != 5) {
+    printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " EditableParagraph resolved %d characters again after an edit next to a BN, in a paragraph with an isolate\n", (int)paragraph.LastResolvedLength());
+    ++failed;
+  }
+  return failed;
+}
+
+/**
+ ** Run(), RunLevelRuns() and ReorderLine() through a Context, on random texts of random lengths, against the same with scratch buffers. Once it has seen the longest text,
+ ** with a level run per character, a Context doesn't grow, and a capped one gives back what a longer text took
+ **/
+int test_Context() {
+  int failed = 0;
+  static const uint32_t alphabet[] = { 'a', 'b', ' ', '1', '$', ',', '(', ')', 0x0009, 0x0300, 0x05D0, 0x0627, 0x0661, 0x202B, 0x202C, 0x2067, 0x2069, 0x200B };
+  uint64_t random = 11;
+  auto next = [&](uint32_t n) { return random_below(random, n); };
+  const size_t Max_Length = 600, Retained_Capacity = 4096;
+  UAX::Bidi::Context context, capped(Retained_Capacity);
+  GrowingScratchBuffer<void> scratch;
+  size_t steady_capacity = 0;
+  for (int t = 0; t < 2000; ++t) {
+    std::vector<uint32_t> text = random_text(random, alphabet, t == 0 ? 0 : next(Max_Length + 1));
+    if (t == 0) {
+      for (size_t i = 0; i < Max_Length; ++i)
+        text.push_back(i % 2 ? 0x05D0 : 'a');
+    }
+    std::vector<uint16_t> utf16(text.begin(), text.end());
+    auto direction = (UAX::Bidi::BaseDirection)next(3);
+    size_t length = text.size(), line_start = t == 0 ? 0 : next(length + 1), line_end = t == 0 ? length : line_start + next(length - line_start + 1);
+    
+    std::vector<UAX::Bidi::EmbeddingLevel> levels(length), line_levels(length);
+    std::vector<UAX::Bidi::ResolvedLevelRun> runs(length);
+    std::vector<size_t> visual_to_logical(length), logical_to_visual(length);
+    UAX::Bidi::EmbeddingLevel paragraph_level;
+    scratch.ensureSize(std::max(UAX::Bidi::ScratchBufferSize(length), UAX::Bidi::LevelRunsScratchBufferSize(length)));
+    UAX::Bidi::Run(text.data(), length, direction, paragraph_level, levels.data(), scratch.buffer);
+    size_t run_count = UAX::Bidi::RunLevelRuns(text.data(), length, direction, paragraph_level, runs.data(), length, scratch.buffer);
+    UAX::Bidi::ReorderLine(text.data(), levels.data(), paragraph_level, line_start, line_end, line_levels.data(), visual_to_logical.data(), logical_to_visual.data());
+    
+    for (UAX::Bidi::Context *c : { &context, &capped }) {
+      UAX::Bidi::EmbeddingLevel context_paragraph_level, utf16_paragraph_level, runs_paragraph_level;
+      size_t utf16_count, context_run_count;
+      const UAX::Bidi::ResolvedLevelRun *context_runs = c->RunLevelRuns(text.data(), length, direction, runs_paragraph_level, context_run_count);
+      bool same = runs_paragraph_level == paragraph_level && context_run_count == run_count;
+      for (size_t r = 0; same && r < run_count; ++r)
+        same = context_runs[r].start == runs[r].start && context_runs[r].length == runs[r].length && context_runs[r].level == runs[r].level;
+      const UAX::Bidi::EmbeddingLevel *utf16_levels = c->Run(utf16.data(), length, direction, utf16_paragraph_level, UAX::Bidi::LevelsFor::CodeUnits, utf16_count);
+      same = same && utf16_paragraph_level == paragraph_level && utf16_count == length && std::equal(levels.begin(), levels.end(), utf16_levels);
+      const UAX::Bidi::EmbeddingLevel *context_levels = c->Run(text.data(), length, direction, context_paragraph_level);
+      UAX::Bidi::Context::Line line = c->ReorderLine(text.data(), context_levels, context_paragraph_level, line_start, line_end); // from the levels just returned
+      same = same && context_paragraph_level == paragraph_level && std::equal(levels.begin(), levels.end(), context_levels);
+      size_t line_length = line_end - line_start;
+      same = same && std::equal(line_levels.begin(), line_levels.begin() + line_length, line.line_levels) && std::equal(visual_to_logical.begin(), visual_to_logical.begin() + line_length, line.visual_to_logical) &&
+             std::equal(logical_to_visual.begin(), logical_to_visual.begin() + line_length, line.logical_to_visual);
+      if (!same) {
+        printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " Context%s on text %d of %d characters\n", c == &capped ? " (capped)" : "", t, (int)length);
+        ++failed;
+      }
+    }
+    if (t == 0) {
+      steady_capacity = context.Capacity();
+    } else if (context.Capacity() != steady_capacity) {
+      printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " Context grew from %d to %d bytes on text %d, shorter than the first\n", (int)steady_capacity, (int)context.Capacity(), t);
+      ++failed;
+      break;
+    }
+  }
+  
+  std::vector<uint32_t> short_text(10, 'a');
+  UAX::Bidi::EmbeddingLevel paragraph_level;
+  capped.Run(short_text.data(), short_text.size(), UAX::Bidi::BaseDirection::Auto, paragraph_level);
+  capped.ReorderLine(short_text.data(), capped.Run(short_text.data(), short_text.size(), UAX::Bidi::BaseDirection::Auto, paragraph_level), paragraph_level, 0, short_text.size());
+  if (capped.Capacity() > 3 * Retained_Capacity) { // the results, the runs and the line
+    printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " capped Context kept %d bytes\n", (int)capped.Capacity());
+    ++failed;
+  }
+  capped.Trim();
+  if (capped.Capacity() != 0) {
+    printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " Context kept %d bytes after Trim()\n", (int)capped.Capacity());
+    ++failed;
+  }
+  return failed;
+}
+
+/**
+ ** The phase stats of a few paragraphs, which are only kept while switched on
+ **/
+int test_PhaseStats() {
+  int failed = 0;
+  static const uint32_t isolate_and_brackets[] = { '(', 'a', ')', ' ', 0x2066, 'b', 0x2069, ' ', '$', '$', '1' }; // an isolate, a bracket pair, and an EN after two ETs
+  static const uint32_t plain[] = { 'a', 'b', 'c' };
+  static const uint32_t nested[] = { 0x2067, 0x2067, 'x', 0x2069, 0x2069 };
+  struct {
+    const uint32_t *text;
+    size_t length;
+  } texts[] = { { isolate_and_brackets, 11 }, { plain, 3 }, { nested, 5 } };
+  GrowingScratchBuffer<void> scratch;
+  scratch.ensureSize(UAX::Bidi::ScratchBufferSize(16));
+  UAX::Bidi::EmbeddingLevel levels[16], paragraph_level;
+  
+  UAX::Bidi::ResetPhaseStats();
+  UAX::Bidi::EnablePhaseStats(true);
+  for (auto &text : texts)
+    UAX::Bidi::Run(text.text, text.length, UAX::Bidi::BaseDirection::Auto, paragraph_level, levels, scratch.buffer);
+  UAX::Bidi::EnablePhaseStats(false);
+  UAX::Bidi::Run(isolate_and_brackets, 11, UAX::Bidi::BaseDirection::Auto, paragraph_level, levels, scratch.buffer); // not counted
+  
+  UAX::Bidi::PhaseStats stats = UAX::Bidi::GetPhaseStats();
+  uint64_t nanoseconds = 0;
+  for (int p = 0; p < UAX::Bidi::Phase_Count; ++p)
+    nanoseconds += stats.nanoseconds[p];
+  // IRSs: two around the isolate and one inside it; one for the plain text; for the nested isolates, one at level 0, and one at each of levels 1 and 3
+  if (stats.runs != 3 || stats.isolates != 3 || stats.bracket_pairs != 1 || stats.isolating_run_sequences != 6 || stats.max_depth != 2 || stats.lookahead_steps < 3 || nanoseconds == 0) {
+    printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " PhaseStats: runs %d, isolates %d, bracket pairs %d, isolating run sequences %d, max depth %d, lookahead steps %d, %d ns\n",
+           (int)stats.runs, (int)stats.isolates, (int)stats.bracket_pairs, (int)stats.isolating_run_sequences, (int)stats.max_depth, (int)stats.lookahead_steps, (int)nanoseconds);
+    ++failed;
+  }
+  UAX::Bidi::ResetPhaseStats();
+  if (UAX::Bidi::GetPhaseStats().runs != 0) {
+    printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " PhaseStats not reset\n");
+    ++failed;
+  }
+  return failed;
+}
+
+/**
+ ** A RunCache small enough to evict, looked up from several threads with texts drawn from a pool so most come up again, against Run() on each
+ **/
+int test_RunCache() {
+  int failed = 0;
+  static const uint32_t alphabet[] = { 'a', 'b', ' ', '1', '$', ',', '(', ')', 0x0300, 0x05D0, 0x0627, 0x0661, 0x202B, 0x202C, 0x2067, 0x2069, 0x200B };
+  uint64_t random = 13;
+  auto next = [&](uint32_t n) { return random_below(random, n); };
+  const size_t Pool_Size = 500, Lookups = 20000, Memory_Limit = 64 << 10;
+  std::vector<std::vector<uint32_t>> pool(Pool_Size);
+  std::vector<std::vector<UAX::Bidi::EmbeddingLevel>> expected_levels(Pool_Size);
+  std::vector<UAX::Bidi::EmbeddingLevel> expected_paragraph_levels(Pool_Size);
+  GrowingScratchBuffer<void> scratch;
+  for (size_t t = 0; t < Pool_Size; ++t) {
+    pool[t] = random_text(random, alphabet, next(201));
+    expected_levels[t].resize(pool[t].size());
+    scratch.ensureSize(UAX::Bidi::ScratchBufferSize(pool[t].size()));
+    UAX::Bidi::Run(pool[t].data(), pool[t].size(), (UAX::Bidi::BaseDirection)(t % 3), expected_paragraph_levels[t], expected_levels[t].data(), scratch.buffer);
+  }
+  std::vector<size_t> lookups(Lookups);
+  for (size_t &l : lookups)
+    l = next(4) ? next(Pool_Size / 10) : next(Pool_Size); // a few texts that come up often, and the rest now and then
+  
+  UAX::Bidi::RunCache cache(Memory_Limit, 4);
+  UAX::Bidi::ThreadPool threads(3);
+  std::atomic<int> wrong(0);
+  threads.ForEach(Lookups, [&](size_t l) {
+    size_t t = lookups[l];
+    std::vector<UAX::Bidi::EmbeddingLevel> levels(pool[t].size());
+    UAX::Bidi::EmbeddingLevel paragraph_level;
+    cache.Run(pool[t].data(), pool[t].size(), (UAX::Bidi::BaseDirection)(t % 3), paragraph_level, levels.data());
+    if (levels != expected_levels[t] || paragraph_level != expected_paragraph_levels[t])
+      ++wrong;
+  });
+  UAX::Bidi::RunCache::Counters counters = cache.GetCounters();
+  if (wrong > 0 || counters.hits + counters.misses != Lookups || counters.hits < Lookups / 2 || counters.evictions == 0 || counters.bytes > Memory_Limit) {
+    printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " RunCache: %d wrong, %d hits, %d misses, %d evictions, %d entries in %d bytes\n", (int)wrong, (int)counters.hits, (int)counters.misses,
+           (int)counters.evictions, (int)counters.entries, (int)counters.bytes);
+    ++failed;
+  }
+  cache.Clear();
+  if (cache.GetCounters().entries != 0 || cache.GetCounters().bytes != 0) {
+    printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " RunCache not cleared\n");
+    ++failed;
+  }
+  return failed;
+}
+
+/**
+ ** VisualMap on random lines of random paragraphs, every query against ReorderLine() and, for SelectionRanges(), the visual positions of the selected characters; empty
+ ** lines, where every query gives None or 0; and, in a child process, a line longer than 4G characters, which must fail the assert before it touches the text
+ **/
+int test_VisualMap() {
+  int failed = 0;
+  static const uint32_t alphabet[] = { 'a', 'b', ' ', '1', '2', '$', ',', '(', ')', 0x0009, 0x0300, 0x05D0, 0x05D1, 0x0627, 0x0661, 0x202B, 0x202C, 0x202E, 0x2067, 0x2066, 0x2069, 0x200B };
+  uint64_t random = 17;
+  auto next = [&](uint32_t n) { return random_below(random, n); };
+  GrowingScratchBuffer<void> scratch;
+  std::vector<UAX::Bidi::VisualMap> maps; // kept, to move them around
+  for (int t = 0; t < 3000 && failed == 0; ++t) {
+    std::vector<uint32_t> text = random_text(random, alphabet, 1 + next(120));
+    std::vector<UAX::Bidi::EmbeddingLevel> levels(text.size());
+    UAX::Bidi::EmbeddingLevel paragraph_level;
+    scratch.ensureSize(UAX::Bidi::ScratchBufferSize(text.size()));
+    UAX::Bidi::Run(text.data(), text.size(), (UAX::Bidi::BaseDirection)next(3), paragraph_level, levels.data(), scratch.buffer);
+    size_t line_start = next(text.size()), line_end = line_start + 1 + next(text.size() - line_start), length = line_end - line_start;
+    std::vector<UAX::Bidi::EmbeddingLevel> line_levels(length);
+    std::vector<size_t> visual_to_logical(length), logical_to_visual(length);
+    UAX::Bidi::ReorderLine(text.data(), levels.data(), paragraph_level, line_start, line_end, line_levels.data(), visual_to_logical.data(), logical_to_visual.data());
+    maps.push_back(UAX::Bidi::VisualMap(text.data(), levels.data(), paragraph_level, line_start, line_end));
+    const UAX::Bidi::VisualMap &map = maps.back();
+    
+    bool same = map.LineStart() == line_start && map.Length() == length && map.RunCount() <= length;
+    for (size_t i = 0; same && i < length; ++i) {
+      same = map.LogicalToVisual(line_start + i) == logical_to_visual[i] && map.VisualToLogical(i) == visual_to_logical[i] && map.LevelAt(line_start + i) == line_levels[i] &&
+             map.NextVisual(visual_to_logical[i], true) == (i + 1 < length ? visual_to_logical[i + 1] : UAX::Bidi::VisualMap::None) &&
+             map.NextVisual(visual_to_logical[i], false) == (i > 0 ? visual_to_logical[i - 1] : UAX::Bidi::VisualMap::None);
+    }
+    std::vector<UAX::Bidi::VisualMap::VisualRange> ranges(map.RunCount());
+    for (int s = 0; same && s < 10; ++s) {
+      size_t start = next(text.size() + 1), end = start + next(text.size() - start + 1); // may reach outside the line
+      std::vector<bool> selected(length);
+      for (size_t i = std::max(start, line_start); i < std::min(end, line_end); ++i)
+        selected[logical_to_visual[i - line_start]] = true;
+      size_t count = map.SelectionRanges(start, end, ranges.data()), k = 0;
+      for (size_t v = 0; same && v < length; ++v) {
+        if (!selected[v] || (v > 0 && selected[v - 1]))
+          continue;
+        size_t n = 0;
+        while (v + n < length && selected[v + n])
+          ++n;
+        same = k < count && ranges[k].visual_start == v && ranges[k].length == n;
+        ++k;
+      }
+      same = same && k == count;
+    }
+    if (!same) {
+      printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " VisualMap of line [%d, %d) of text %d\n", (int)line_start, (int)line_end, t);
+      ++failed;
+    }
+  }
+  
+  static const uint32_t text[] = { 'a', 0x05D0, 0x05D1, '1', 0x202B, 'b' };
+  const size_t length = sizeof(text) / sizeof(text[0]);
+  std::vector<UAX::Bidi::EmbeddingLevel> levels(length);
+  UAX::Bidi::EmbeddingLevel paragraph_level;
+  scratch.ensureSize(UAX::Bidi::ScratchBufferSize(length));
+  UAX::Bidi::Run(text, length, UAX::Bidi::BaseDirection::Right, paragraph_level, levels.data(), scratch.buffer);
+  for (size_t line_start = 0; line_start <= length; ++line_start) {
+    UAX::Bidi::VisualMap map(text, levels.data(), paragraph_level, line_start, line_start);
+    UAX::Bidi::VisualMap::VisualRange range;
+    bool empty = map.LineStart() == line_start && map.Length() == 0 && map.RunCount() == 0 && map.SelectionRanges(0, length, &range) == 0;
+    for (size_t i = 0; empty && i <= length; ++i)
+      empty = map.LogicalToVisual(i) == UAX::Bidi::VisualMap::None && map.VisualToLogical(i) == UAX::Bidi::VisualMap::None && map.LevelAt(i) == 0 &&
+              map.NextVisual(i, true) == UAX::Bidi::VisualMap::None && map.NextVisual(i, false) == UAX::Bidi::VisualMap::None;
+    if (!empty) {
+      printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " VisualMap of empty line at %d\n", (int)line_start);
+      ++failed;
+    }
+  }
+  
+#ifndef NDEBUG
+  if (sizeof(size_t) > sizeof(uint32_t)) {
+    pid_t child = fork();
+    if (child == 0) { // no text behind it: the assert has to stop it first
+      freopen("/dev/null", "w", stderr);
+      UAX::Bidi::VisualMap map(nullptr, nullptr, 0, 0, size_t(UINT32_MAX) + 1);
+      _exit(0);
+    }
+    int status = 0;
+    if (child < 0 || waitpid(child, &status, 0) != child || !WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT) {
+      printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " VisualMap of a line past 4G characters did not assert\n");
+      ++failed;
+    }
+  }
+#endif
+  return failed;
+}
+
+/**
+ ** ApplyMirroring() on random text and levels, with stretches of even levels long enough to be skipped, against Get_Bidi_Mirroring() on each odd-level character; and in place
+ **/
+int test_ApplyMirroring() {
+  int failed = 0;
+  static const uint32_t alphabet[] = { 'a', ' ', '(', ')', '<', '>', '[', ']', '{', '}', 0x00AB, 0x00BB, 0x2208, 0x2264, 0x27E8, 0x27E9, 0x05D0, 0x1D7C3, 0x202B };
+  static const UAX::Bidi::EmbeddingLevel level_choices[] = { 0, 1, 2, 3, 61, 62, UAX::Bidi::Removed_Level };
+  uint64_t random = 19;
+  auto next = [&](uint32_t n) { return random_below(random, n); };
+  for (int t = 0; t < 2000; ++t) {
+    std::vector<uint32_t> text = random_text(random, alphabet, next(100));
+    std::vector<UAX::Bidi::EmbeddingLevel> levels(text.size());
+    for (size_t i = 0; i < text.size(); ++i)
+      levels[i] = (i > 0 && next(4)) ? levels[i - 1] : level_choices[next(sizeof(level_choices) / sizeof(level_choices[0]))];
+    std::vector<uint32_t> expected(text), out(text.size());
+    size_t expected_mirrored = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+      uint32_t mirror = UCD::Get_Bidi_Mirroring(text[i]);
+      if ((levels[i] & 1) && levels[i] != UAX::Bidi::Removed_Level && mirror != 0) {
+        expected[i] = mirror;
+        ++expected_mirrored;
+      }
+    }
+    size_t mirrored = UAX::Bidi::ApplyMirroring(text.data(), levels.data(), text.size(), out.data());
+    size_t mirrored_in_place = UAX::Bidi::ApplyMirroring(text.data(), levels.data(), text.size(), text.data());
+    if (out != expected || text != expected || mirrored != expected_mirrored || mirrored_in_place != expected_mirrored) {
+      printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " ApplyMirroring on text %d\n", t);
+      ++failed;
+    }
+  }
+  return failed;
+}
+
 int main (int argc, char const *argv[]) {
   int passed = 0;
   int failed = 0;
   int total = 0;
   
+  failed += test_RequiresAlgorithm();
+  failed += test_RunParagraphs();
+  failed += test_RunBatch();
+  failed += test_EditableParagraph();
+  failed += test_Context();
+  failed += test_PhaseStats();
+  failed += test_RunCache();
+  failed += test_VisualMap();
+  failed += test_ApplyMirroring();
+  
   GrowingScratchBuffer<void> scratch;
   GrowingScratchBuffer<UAX::Bidi::EmbeddingLevel> embedding_levels;
+  GrowingScratchBuffer<void> level_runs_scratch;
   
   withUCDFormattedFile("../UCD/BidiCharacterTest.txt", [&](Fields fields) {
     
@@ -76,13 +643,113 @@ int main (int argc, char const *argv[]) {
       ++i;
     });
     
-    fields.fields[4].asDecimalSequence([&](int order) {
-      // todo - reordering (assume no line breaking)
+    // the same levels from UTF-16 and UTF-8, per codepoint and per code unit
+    std::vector<uint16_t> utf16;
+    std::vector<uint8_t> utf8;
+    std::vector<int> utf16_codepoints, utf8_codepoints; // which codepoint each code unit is part of
+    for (int k = 0; k < length; ++k) {
+      append_utf16(utf16, text[k]);
+      append_utf8(utf8, text[k]);
+      utf16_codepoints.resize(utf16.size(), k);
+      utf8_codepoints.resize(utf8.size(), k);
+    }
+    scratch.ensureSize(UAX::Bidi::ScratchBufferSize(utf8.size()));
+    for (auto levels_for : { UAX::Bidi::LevelsFor::Codepoints, UAX::Bidi::LevelsFor::CodeUnits }) {
+      bool per_unit = levels_for == UAX::Bidi::LevelsFor::CodeUnits;
+      std::vector<UAX::Bidi::EmbeddingLevel> utf16_levels(utf16.size()), utf8_levels(utf8.size());
+      UAX::Bidi::EmbeddingLevel utf16_paragraph_embedding_level, utf8_paragraph_embedding_level;
+      size_t utf16_count = UAX::Bidi::Run(utf16.data(), utf16.size(), dir, utf16_paragraph_embedding_level, utf16_levels.data(), levels_for, scratch.buffer);
+      size_t utf8_count = UAX::Bidi::Run(utf8.data(), utf8.size(), dir, utf8_paragraph_embedding_level, utf8_levels.data(), levels_for, scratch.buffer);
+      bool same_levels = utf16_paragraph_embedding_level == resolved_paragraph_embedding_level && utf8_paragraph_embedding_level == resolved_paragraph_embedding_level &&
+                         utf16_count == (per_unit ? utf16.size() : (size_t)length) && utf8_count == (per_unit ? utf8.size() : (size_t)length);
+      for (size_t k = 0; same_levels && k < utf16_count; ++k)
+        same_levels = utf16_levels[k] == embedding_levels.buffer[per_unit ? utf16_codepoints[k] : k];
+      for (size_t k = 0; same_levels && k < utf8_count; ++k)
+        same_levels = utf8_levels[k] == embedding_levels.buffer[per_unit ? utf8_codepoints[k] : k];
+      if (!same_levels) {
+        fail();
+        printf("UTF-16 and UTF-8 levels per %s differ\n\n", per_unit ? "code unit" : "codepoint");
+      }
+    }
+    
+    // the same levels from the classes and bracket info of the text, and without the bracket info if there are no brackets
+    std::vector<UCD::Bidi_Class> classes(length);
+    std::vector<UAX::Bidi::BracketInfo> brackets(length);
+    bool has_brackets = false;
+    for (int k = 0; k < length; ++k) {
+      classes[k] = UCD::Get_Bidi_Class(text[k]);
+      brackets[k] = UAX::Bidi::GetBracketInfo(text[k]);
+      has_brackets |= brackets[k].type != UCD::Bidi_Paired_Bracket_Type::None;
+    }
+    for (bool with_brackets : { true, false }) {
+      if (!with_brackets && has_brackets)
+        continue;
+      std::vector<UAX::Bidi::EmbeddingLevel> class_levels(length);
+      UAX::Bidi::EmbeddingLevel class_paragraph_embedding_level;
+      scratch.ensureSize(UAX::Bidi::ScratchBufferSize(length));
+      UAX::Bidi::Run(classes.data(), with_brackets ? brackets.data() : nullptr, length, dir, class_paragraph_embedding_level, class_levels.data(), scratch.buffer);
+      if (class_paragraph_embedding_level != resolved_paragraph_embedding_level || !std::equal(class_levels.begin(), class_levels.end(), embedding_levels.buffer)) {
+        fail();
+        printf("levels from classes%s differ\n\n", with_brackets ? " and bracket info" : "");
+      }
+    }
+    
+    // the same levels as runs, with the removed characters folded in
+    level_runs_scratch.ensureSize(UAX::Bidi::LevelRunsScratchBufferSize(length));
+    std::vector<UAX::Bidi::ResolvedLevelRun> runs(length);
+    UAX::Bidi::EmbeddingLevel runs_paragraph_embedding_level;
+    size_t run_count = UAX::Bidi::RunLevelRuns(text, length, dir, runs_paragraph_embedding_level, runs.data(), length, level_runs_scratch.buffer);
+    bool same_runs = run_count > 0 && runs_paragraph_embedding_level == resolved_paragraph_embedding_level && UAX::Bidi::RunLevelRuns(text, length, dir, runs_paragraph_embedding_level, runs.data(), 1, level_runs_scratch.buffer) == run_count;
+    for (size_t r = 0, start = 0; same_runs && r < run_count; start += runs[r].length, ++r) {
+      same_runs = runs[r].start == start && runs[r].length > 0 && (r == 0 || runs[r].level != runs[r - 1].level) && (r + 1 < run_count || start + runs[r].length == (size_t)length);
+      for (size_t k = runs[r].start; k < runs[r].start + runs[r].length; ++k)
+        same_runs = same_runs && (embedding_levels.buffer[k] == runs[r].level || embedding_levels.buffer[k] == UAX::Bidi::Removed_Level);
+    }
+    if (!same_runs) {
+      fail();
+      printf("level runs: ");
+      for (size_t r = 0; r < run_count && r < runs.size(); ++r)
+        printf("%d+%d@%d ", (int)runs[r].start, (int)runs[r].length, runs[r].level);
+      printf("\n\n");
+    }
+    
+    // the whole paragraph as one line. The visual order leaves out the characters removed by X9
+    std::vector<UAX::Bidi::EmbeddingLevel> line_levels(length);
+    std::vector<size_t> visual_to_logical(length), logical_to_visual(length);
+    UAX::Bidi::ReorderLine(text, embedding_levels.buffer, resolved_paragraph_embedding_level, 0, length, line_levels.data(), visual_to_logical.data(), logical_to_visual.data());
+    std::vector<size_t> order;
+    for (size_t v = 0; v < (size_t)length; ++v) {
+      if (logical_to_visual[visual_to_logical[v]] != v) {
+        fail();
+        printf("logical_to_visual is not the inverse of visual_to_logical\n\n");
+        break;
+      }
+      if (embedding_levels.buffer[visual_to_logical[v]] != UAX::Bidi::Removed_Level)
+        order.push_back(visual_to_logical[v]);
+    }
+    i = 0;
+    bool same_order = true;
+    fields.fields[4].asDecimalSequence([&](int index) {
+      same_order = same_order && (size_t)i < order.size() && order[i] == (size_t)index;
+      ++i;
     });
+    if (!same_order || (size_t)i != order.size()) {
+      fail();
+      printf("correct visual order: " ANSI_FOREGROUND_GREEN);
+      fields.fields[4].asDecimalSequence([&](int index) {
+        printf("%d ", index);
+      });
+      printf(ANSI_FOREGROUND_DEFAULT "\n" "visual order: ");
+      for (size_t index : order)
+        printf("%d ", (int)index);
+      printf("\n\n");
+    }
     
     ++total;
   });
   
+  UAX::Bidi::RunCounters counters = UAX::Bidi::GetRunCounters();
+  printf("single level runs %llu / %llu, bracket pairings %llu\n", (unsigned long long)counters.single_level_runs, (unsigned long long)counters.runs, (unsigned long long)counters.bracket_pairings);
   printf("failed %d / %d\n", failed, total);
   if (failed > 0)
     return -1;
@@ -2,127 +2,1925 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include "UAX.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 using namespace UAX;
 using namespace Bidi;
 
-struct BidiAlgorithm {
-  const uint32_t *text;
-  long length;
-  EmbeddingLevel paragraph_embedding_level;
-  EmbeddingLevel *resolved_embedding_levels;
-  struct Metadata { // 12 bytes per character
-    int matching_index; // -1 for none, valid for matching brackets, isolate initiators <-> PDIs
-    int next_isolating_run_sequence; // index of first character in next seq (-1 if none), makes a linked-list of IRSs
-    Bidi_Class bidi_class;
-    unsigned is_isolate_bridge:1; // 1 if isolate initiator or PDI with matching index (can use relative direction of matching_index to determine if initiator or PDI)
-    unsigned sos:1; // sos+eos are set for the first character in each IRS (0 and all the linked characters chained by next_isolating_run_sequence). L=0, R=1
-    unsigned eos:1;
-  } *metadata;
+struct PhaseClock { // the PhaseStats of one Run(), added to the totals at the end of it
+  PhaseStats stats;
+  std::chrono::steady_clock::time_point time;
+  uint64_t ticks;
+  
+  static uint64_t tick_count() {
+    #if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+    #else
+    return 0;
+    #endif
+  }
+  void start() {
+    stats = PhaseStats();
+    stats.runs = 1;
+    time = std::chrono::steady_clock::now();
+    ticks = tick_count();
+  }
+  void lap(const Phase phase) { // the time since the last lap goes to phase
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    uint64_t now_ticks = tick_count();
+    stats.nanoseconds[(int)phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - time).count();
+    stats.cycles[(int)phase] += now_ticks - ticks;
+    time = now;
+    ticks = now_ticks;
+  }
+};
+
+struct ClassifiedText { // the text of the Bidi_Class overload of Run(), for which classify() copies instead of looking up
+  const Bidi_Class *classes;
+  const BracketInfo *brackets;
+};
+
+struct ExplicitStructure { // per character, what X1-X10 left for the implicit rules to work on
+  EmbeddingLevel *levels; // the level X1-X8 gave it, with Overridden_Level added if X6 overrode its class; Removed_Level if X9 removed it
+  uint32_t *sequences; // for a character that isn't removed, the index of its isolating run sequence
+};
+static const EmbeddingLevel Overridden_Level = 0x80; // above any level X1-X8 gives out
+
+template<typename Index> struct BidiAlgorithm { // Index is wide enough to hold the length of the paragraph, see Bidi::Run()
+  static constexpr Index None = Index(-1);
+  static constexpr size_t Max_Length = None; // indices go up to None - 1
+  
+  const void *text; // code units of code_unit_size bytes, read only by Initializaton() (and trace()), so the algorithm runs on UTF-8 and UTF-16 without a UTF-32 copy; or a ClassifiedText
+  size_t code_unit_count;
+  uint8_t code_unit_size;
+  Index length; // in codepoints
+  EmbeddingLevel paragraph_embedding_level;
+  EmbeddingLevel *resolved_embedding_levels;
+  // per character, in separate arrays so that each phase only pulls in what it reads: 2 + sizeof(Index) bytes
+  Bidi_Class *bidi_classes;
+  Index *matching_indices; // None for none, valid for matching brackets, isolate initiators <-> PDIs. Until assign_bracket_pairs() gets to it, a bracket's is its key (see Initializaton())
+  struct Flags {
+    uint8_t is_isolate_bridge:1; // 1 if isolate initiator or PDI with matching index (can use relative direction of matching_index to determine if initiator or PDI)
+    uint8_t is_open_bracket:1; // Bidi_Paired_Bracket_Type of ON characters, looked up once in Initializaton()
+    uint8_t is_close_bracket:1;
+    uint8_t encloses_strong_l:1; // set on the open half of a bracket pair by assign_bracket_pairs(): the pair encloses a strong type (as N0 sees them) of direction L or R
+    uint8_t encloses_strong_r:1;
+    uint8_t code_units:2; // how many code units the character was decoded from, less one
+    uint8_t is_overridden:1; // X6 overrode the class to L or R
+  } *flags;
+  // per level run (BD7), from X10: a run starts at a character X9 left and takes in the ones it removed after it, up to the start of the next. At most one per character
+  Index *run_starts; // and after the last run one more, 'length'
+  Index *run_next; // the level run its isolating run sequence goes on to (BD13): if the run ends with a matched isolate initiator, the one starting with the PDI, otherwise None
+  EmbeddingLevel *run_levels; // as X1-X8 left them
+  Index level_run_count;
+  struct IsolatingRunSequence { // BD13: a list of level runs, linked by next_run
+    Index first_run;
+    Bidi_Class sos, eos;
+  };
+  Index isolating_run_sequence_count; // one starts with each level run that doesn't start with a matched PDI
+  bool has_explicit_formatting; // found by Initializaton(): any character of an explicit formatting class or BN, without which the paragraph is a single level run
+  bool has_brackets; // any ON with a Bidi_Paired_Bracket_Type, without which N0 has nothing to do
+  ExplicitStructure *explicit_structure = nullptr; // filled in once X10 has the sequences, for EditableParagraph
+  PhaseClock *phase_clock = nullptr; // while the phase stats are on
+
+  static size_t scratch_buffer_size(const size_t length) { // the level run arrays sized for a run per character, the most X10 can find
+    return length * (3 * sizeof(Index) + sizeof(Bidi_Class) + sizeof(Flags) + sizeof(EmbeddingLevel)) + sizeof(Index);
+  }
+  template<typename Unit> void run(const Unit *_text, const size_t _length, const BaseDirection base_direction, void *scratch_buffer, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, const LevelsFor levels_for);
+  void run_sequence(const ClassifiedText *_text, const size_t _length, const EmbeddingLevel level, const EmbeddingLevel level_before, const EmbeddingLevel level_after, void *scratch_buffer, EmbeddingLevel *resolved_embedding_levels);
+  void use_scratch_buffer(void *scratch_buffer, const Index capacity);
+
+  struct IsolatingRunSequenceIterator;
+  template<typename Unit> void Initializaton(const Unit *text);
+  void The_Paragraph_Level(const BaseDirection base_direction);
+  void Explicit_Levels_and_Directions();
+  void Preparations_for_Implicit_Processing();
+  void Resolving_Isolating_Run_Sequences();
+  void Resolving_Isolating_Run_Sequence(const IsolatingRunSequence &sequence);
+  void Resolving_Weak_Types(IsolatingRunSequenceIterator &iterator);
+  void Resolving_Neutral_and_Isolate_Formatting_Types(IsolatingRunSequenceIterator &iterator);
+  void Resolving_Implicit_Levels();
+  static EmbeddingLevel implicit_level(const EmbeddingLevel level, const Bidi_Class type);
+  
+  Bidi_Class embedding_direction_for_embedding_level(EmbeddingLevel level) const;
+  void assign_bracket_pairs(IsolatingRunSequenceIterator iterator);
+  void prepare_level_runs();
+  void prepare_single_level_run();
+  bool starts_isolating_run_sequence(const Index run) const;
+  IsolatingRunSequence isolating_run_sequence(const Index first_run) const;
+  void record_explicit_structure();
+  size_t resolved_level_runs(ResolvedLevelRun *runs, const size_t run_capacity) const;
+  void classify(const Codepoint *text);
+  void classify(const ClassifiedText *text);
+  template<typename Unit> void classify(const Unit *text);
+  void classify_bracket(const Index i, const Codepoint code, const Bidi_Paired_Bracket_Type bracket_type);
+  void set_bracket(const Index i, const BracketInfo bracket);
+  void spread_levels_over_code_units();
+  EmbeddingLevel paragraph_embedding_level_for_strong_character_index(const Index first_strong_index) const;
+  Index find_first_strong_index(const Index start_index, const Index end_index) const;
+  
+  #define PHASE_LAP(PHASE) if (phase_clock) phase_clock->lap(Phase::PHASE)
+  #define PHASE_COUNT(FIELD, N) if (phase_clock) phase_clock->stats.FIELD += (N)
+  
+  #if UAX_BIDI_ENABLE_DEBUG_TRACE
+  #define DEBUG_TRACE(...) trace(__VA_ARGS__)
+  bool debug_trace = false;
+  void trace(const char *step, bool headers) const;
+  #else
+  #define DEBUG_TRACE(...)
+  #endif
+};
+
+static const EmbeddingLevel EMBEDDING_LEVEL_IGNORE = Removed_Level;
+static const EmbeddingLevel MAX_DEPTH = 125;
+
+static inline bool requires_algorithm(const Bidi_Class cls) {
+  switch (cls) {
+    case Bidi_Class::Right_To_Left:
+    case Bidi_Class::Right_To_Left_Embedding:
+    case Bidi_Class::Right_To_Left_Override:
+    case Bidi_Class::Right_To_Left_Isolate:
+    case Bidi_Class::Arabic_Letter:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ ** RequiresAlgorithm() -- blocks of text are first tested against the only ranges that hold R, AL, RLE, RLO or RLI codepoints:
+ **   U+0590..U+08FF (Hebrew, Arabic, Syriac, Thaana, NKo, Samaritan, Mandaic), U+200F, U+202B, U+202E, U+2067,
+ **   U+FB1D..U+FDFF and U+FE70..U+FEFE (presentation forms), U+10800..U+10FFF and U+1E800..U+1EFFF (SMP RTL)
+ ** and only a block that hits one of them is decoded and checked codepoint by codepoint.
+ **/
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static inline __m128i in_range_u32(__m128i x, uint32_t first, uint32_t last) { // unsigned (x - first) <= (last - first), via a sign flip since SSE2 only compares signed
+  const __m128i sign = _mm_set1_epi32((int)0x80000000);
+  __m128i offset = _mm_xor_si128(_mm_sub_epi32(x, _mm_set1_epi32((int)first)), sign);
+  return _mm_andnot_si128(_mm_cmpgt_epi32(offset, _mm_set1_epi32((int)((last - first) ^ 0x80000000))), _mm_set1_epi32(-1));
+}
+static inline __m128i in_range_u16(__m128i x, uint16_t first, uint16_t last) {
+  return _mm_cmpeq_epi16(_mm_subs_epu16(_mm_sub_epi16(x, _mm_set1_epi16((short)first)), _mm_set1_epi16((short)(last - first))), _mm_setzero_si128());
+}
+static inline __m128i in_range_u8(__m128i x, uint8_t first, uint8_t last) {
+  return _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(x, _mm_set1_epi8((char)first)), _mm_set1_epi8((char)(last - first))), _mm_setzero_si128());
+}
+static inline __m128i equal_u8(__m128i x, uint8_t value) {
+  return _mm_cmpeq_epi8(x, _mm_set1_epi8((char)value));
+}
+
+static inline bool may_require_algorithm_utf32(const Codepoint *text) { // 4 codepoints
+  __m128i x = _mm_loadu_si128((const __m128i *)text);
+  if (_mm_movemask_epi8(_mm_cmplt_epi32(x, _mm_set1_epi32(0x0590))) == 0xFFFF) // common case: everything below Hebrew
+    return false;
+  __m128i hit = in_range_u32(x, 0x0590, 0x08FF);
+  hit = _mm_or_si128(hit, _mm_cmpeq_epi32(x, _mm_set1_epi32(0x200F)));
+  hit = _mm_or_si128(hit, _mm_cmpeq_epi32(x, _mm_set1_epi32(0x202B)));
+  hit = _mm_or_si128(hit, _mm_cmpeq_epi32(x, _mm_set1_epi32(0x202E)));
+  hit = _mm_or_si128(hit, _mm_cmpeq_epi32(x, _mm_set1_epi32(0x2067)));
+  hit = _mm_or_si128(hit, in_range_u32(x, 0xFB1D, 0xFDFF));
+  hit = _mm_or_si128(hit, in_range_u32(x, 0xFE70, 0xFEFE));
+  hit = _mm_or_si128(hit, in_range_u32(x, 0x10800, 0x10FFF));
+  hit = _mm_or_si128(hit, in_range_u32(x, 0x1E800, 0x1EFFF));
+  return _mm_movemask_epi8(hit) != 0;
+}
+
+static inline bool may_require_algorithm_utf16(const uint16_t *text) { // 8 code units
+  __m128i x = _mm_loadu_si128((const __m128i *)text);
+  if (_mm_movemask_epi8(in_range_u16(x, 0x0000, 0x058F)) == 0xFFFF) // common case: everything below Hebrew
+    return false;
+  __m128i hit = in_range_u16(x, 0x0590, 0x08FF);
+  hit = _mm_or_si128(hit, _mm_cmpeq_epi16(x, _mm_set1_epi16(0x200F)));
+  hit = _mm_or_si128(hit, _mm_cmpeq_epi16(x, _mm_set1_epi16(0x202B)));
+  hit = _mm_or_si128(hit, _mm_cmpeq_epi16(x, _mm_set1_epi16(0x202E)));
+  hit = _mm_or_si128(hit, _mm_cmpeq_epi16(x, _mm_set1_epi16(0x2067)));
+  hit = _mm_or_si128(hit, in_range_u16(x, 0xFB1D, 0xFDFF));
+  hit = _mm_or_si128(hit, in_range_u16(x, 0xFE70, 0xFEFE));
+  hit = _mm_or_si128(hit, in_range_u16(x, 0xD802, 0xD803)); // lead surrogates of U+10800..U+10FFF
+  hit = _mm_or_si128(hit, in_range_u16(x, 0xD83A, 0xD83B)); // lead surrogates of U+1E800..U+1EFFF
+  return _mm_movemask_epi8(hit) != 0;
+}
+
+static inline bool may_require_algorithm_utf8(const uint8_t *text) { // sequences whose lead byte is one of the 16 at text, reads 2 bytes past them
+  __m128i b0 = _mm_loadu_si128((const __m128i *)text);
+  if (_mm_movemask_epi8(b0) == 0) // ASCII
+    return false;
+  __m128i b1 = _mm_loadu_si128((const __m128i *)(text + 1));
+  __m128i b2 = _mm_loadu_si128((const __m128i *)(text + 2));
+  __m128i hit = in_range_u8(b0, 0xD6, 0xDF); // U+0580..U+07FF
+  hit = _mm_or_si128(hit, _mm_and_si128(equal_u8(b0, 0xE0), in_range_u8(b1, 0xA0, 0xA3))); // U+0800..U+08FF
+  __m128i e2_80 = _mm_and_si128(equal_u8(b0, 0xE2), equal_u8(b1, 0x80));
+  __m128i e2_81 = _mm_and_si128(equal_u8(b0, 0xE2), equal_u8(b1, 0x81));
+  hit = _mm_or_si128(hit, _mm_and_si128(e2_80, _mm_or_si128(equal_u8(b2, 0x8F), _mm_or_si128(equal_u8(b2, 0xAB), equal_u8(b2, 0xAE))))); // U+200F, U+202B, U+202E
+  hit = _mm_or_si128(hit, _mm_and_si128(e2_81, equal_u8(b2, 0xA7))); // U+2067
+  hit = _mm_or_si128(hit, _mm_and_si128(equal_u8(b0, 0xEF), in_range_u8(b1, 0xAC, 0xBB))); // U+FB00..U+FEFF
+  hit = _mm_or_si128(hit, _mm_and_si128(equal_u8(b0, 0xF0), _mm_or_si128(equal_u8(b1, 0x90), equal_u8(b1, 0x9E)))); // U+10000..U+10FFF, U+1E000..U+1EFFF
+  return _mm_movemask_epi8(hit) != 0;
+}
+
+static inline bool may_leave_level_zero_utf32(const Codepoint *text) { // 4 codepoints, see resolves_to_level_zero(). Outside of the ranges below it takes a lookup to tell
+  __m128i x = _mm_loadu_si128((const __m128i *)text);
+  __m128i stays = in_range_u32(x, 0x0020, 0x007E); // printable ASCII
+  stays = _mm_or_si128(stays, _mm_andnot_si128(_mm_cmpeq_epi32(x, _mm_set1_epi32(0x00AD)), in_range_u32(x, 0x00A0, 0x058F))); // and on up to Hebrew, but for the BN soft hyphen
+  if (_mm_movemask_epi8(stays) == 0xFFFF) // common case: Latin, Greek, Cyrillic
+    return false;
+  stays = _mm_or_si128(stays, in_range_u32(x, 0x0009, 0x000D)); // tab and line breaks, the controls that aren't BN
+  stays = _mm_or_si128(stays, _mm_andnot_si128(_mm_cmpeq_epi32(x, _mm_set1_epi32(0x180E)), in_range_u32(x, 0x0900, 0x200A))); // Indic to the BN zero width space, but for a BN in Mongolian
+  stays = _mm_or_si128(stays, in_range_u32(x, 0x2010, 0x2029)); // General Punctuation, around the explicit formatting characters
+  stays = _mm_or_si128(stays, in_range_u32(x, 0x202F, 0x205F));
+  stays = _mm_or_si128(stays, in_range_u32(x, 0x2070, 0xFB1C)); // CJK and the rest of the BMP up to the Hebrew presentation forms
+  return _mm_movemask_epi8(stays) != 0xFFFF;
+}
+#endif
+
+bool Bidi::RequiresAlgorithm(const Codepoint *text, const size_t length) {
+  size_t i = 0;
+  #if defined(__SSE2__)
+  for (; i + 16 <= length; i += 16) {
+    if (!may_require_algorithm_utf32(&text[i]) && !may_require_algorithm_utf32(&text[i + 4]) && !may_require_algorithm_utf32(&text[i + 8]) && !may_require_algorithm_utf32(&text[i + 12]))
+      continue;
+    for (size_t j = i; j < i + 16; ++j)
+      if (requires_algorithm(Get_Bidi_Class(text[j])))
+        return true;
+  }
+  #endif
+  for (; i < length; ++i)
+    if (requires_algorithm(Get_Bidi_Class(text[i])))
+      return true;
+  return false;
+}
+
+bool Bidi::RequiresAlgorithm(const uint16_t *text, const size_t length) {
+  size_t i = 0;
+  #if defined(__SSE2__)
+  for (; i + 16 <= length; i += 16) {
+    if (!may_require_algorithm_utf16(&text[i]) && !may_require_algorithm_utf16(&text[i + 8]))
+      continue;
+    size_t j = i;
+    if (j > 0 && text[j] >= 0xDC00 && text[j] <= 0xDFFF) // trail half of a pair that started in the previous (clean) block
+      ++j;
+    while (j < i + 16)
+      if (requires_algorithm(Get_Bidi_Class(Next_UTF16(text, length, j))))
+        return true;
+    i = j - 16; // may have decoded a pair across the block boundary
+  }
+  if (i > 0 && i < length && text[i] >= 0xDC00 && text[i] <= 0xDFFF)
+    ++i;
+  #endif
+  while (i < length)
+    if (requires_algorithm(Get_Bidi_Class(Next_UTF16(text, length, i))))
+      return true;
+  return false;
+}
+
+bool Bidi::RequiresAlgorithm(const uint8_t *text, const size_t length) {
+  size_t i = 0;
+  #if defined(__SSE2__)
+  for (; i + 16 + 2 <= length; i += 16) {
+    if (!may_require_algorithm_utf8(&text[i]))
+      continue;
+    size_t j = i;
+    while (j < i + 16 && (text[j] & 0xC0) == 0x80) // trail bytes of a sequence that started in the previous (clean) block
+      ++j;
+    while (j < i + 16)
+      if (requires_algorithm(Get_Bidi_Class(Next_UTF8(text, length, j))))
+        return true;
+    i = j - 16; // may have decoded a sequence across the block boundary
+  }
+  while (i < length && (text[i] & 0xC0) == 0x80)
+    ++i;
+  #endif
+  while (i < length)
+    if (requires_algorithm(Get_Bidi_Class(Next_UTF8(text, length, i))))
+      return true;
+  return false;
+}
+
+/**
+ ** The algorithm indexes characters and level runs with the narrowest of uint16_t, uint32_t and uint64_t that holds the length of the paragraph, which sizes the scratch buffer
+ ** per character: 9 bytes up to 64K, 15 bytes up to 4G, 27 bytes beyond that
+ **/
+size_t Bidi::ScratchBufferSize(const size_t text_length) {
+  if (text_length <= BidiAlgorithm<uint16_t>::Max_Length)
+    return BidiAlgorithm<uint16_t>::scratch_buffer_size(text_length);
+  if (text_length <= BidiAlgorithm<uint32_t>::Max_Length)
+    return BidiAlgorithm<uint32_t>::scratch_buffer_size(text_length);
+  return BidiAlgorithm<uint64_t>::scratch_buffer_size(text_length);
+}
+
+static std::atomic<bool> phase_stats_enabled(false);
+static struct {
+  std::atomic<uint64_t> runs, nanoseconds[Phase_Count], cycles[Phase_Count], isolates, bracket_pairs, isolating_run_sequences, max_depth, lookahead_steps;
+} phase_totals; // zero, being static
+
+static void add_phase_stats(const PhaseStats &stats) {
+  phase_totals.runs.fetch_add(stats.runs, std::memory_order_relaxed);
+  for (int p = 0; p < Phase_Count; ++p) {
+    phase_totals.nanoseconds[p].fetch_add(stats.nanoseconds[p], std::memory_order_relaxed);
+    phase_totals.cycles[p].fetch_add(stats.cycles[p], std::memory_order_relaxed);
+  }
+  phase_totals.isolates.fetch_add(stats.isolates, std::memory_order_relaxed);
+  phase_totals.bracket_pairs.fetch_add(stats.bracket_pairs, std::memory_order_relaxed);
+  phase_totals.isolating_run_sequences.fetch_add(stats.isolating_run_sequences, std::memory_order_relaxed);
+  phase_totals.lookahead_steps.fetch_add(stats.lookahead_steps, std::memory_order_relaxed);
+  uint64_t max_depth = phase_totals.max_depth.load(std::memory_order_relaxed);
+  while (stats.max_depth > max_depth && !phase_totals.max_depth.compare_exchange_weak(max_depth, stats.max_depth, std::memory_order_relaxed))
+    ;
+}
+
+void Bidi::EnablePhaseStats(const bool enabled) {
+  phase_stats_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+PhaseStats Bidi::GetPhaseStats() {
+  PhaseStats stats;
+  stats.runs = phase_totals.runs.load(std::memory_order_relaxed);
+  for (int p = 0; p < Phase_Count; ++p) {
+    stats.nanoseconds[p] = phase_totals.nanoseconds[p].load(std::memory_order_relaxed);
+    stats.cycles[p] = phase_totals.cycles[p].load(std::memory_order_relaxed);
+  }
+  stats.isolates = phase_totals.isolates.load(std::memory_order_relaxed);
+  stats.bracket_pairs = phase_totals.bracket_pairs.load(std::memory_order_relaxed);
+  stats.isolating_run_sequences = phase_totals.isolating_run_sequences.load(std::memory_order_relaxed);
+  stats.max_depth = phase_totals.max_depth.load(std::memory_order_relaxed);
+  stats.lookahead_steps = phase_totals.lookahead_steps.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void Bidi::ResetPhaseStats() {
+  phase_totals.runs.store(0, std::memory_order_relaxed);
+  for (int p = 0; p < Phase_Count; ++p) {
+    phase_totals.nanoseconds[p].store(0, std::memory_order_relaxed);
+    phase_totals.cycles[p].store(0, std::memory_order_relaxed);
+  }
+  phase_totals.isolates.store(0, std::memory_order_relaxed);
+  phase_totals.bracket_pairs.store(0, std::memory_order_relaxed);
+  phase_totals.isolating_run_sequences.store(0, std::memory_order_relaxed);
+  phase_totals.max_depth.store(0, std::memory_order_relaxed);
+  phase_totals.lookahead_steps.store(0, std::memory_order_relaxed);
+}
+
+const char *Bidi::PhaseName(const Phase phase) {
+  switch (phase) {
+    case Phase::Initializaton:                  return "Initializaton";
+    case Phase::The_Paragraph_Level:            return "The_Paragraph_Level";
+    case Phase::Explicit_Levels_and_Directions: return "Explicit_Levels_and_Directions";
+    case Phase::X9:                             return "X9";
+    case Phase::X10:                            return "X10";
+    case Phase::W:                              return "W";
+    case Phase::N0:                             return "N0";
+    case Phase::N1_N2:                          return "N1_N2";
+    case Phase::I:                              return "I";
+  }
+  return "?";
+}
+
+template<typename Index, typename Unit> static size_t run_algorithm(const Unit *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, const LevelsFor levels_for, void *scratch_buffer
+#if UAX_BIDI_ENABLE_DEBUG_TRACE
+               , bool debug_trace
+#endif
+               ) {
+  BidiAlgorithm<Index> a;
+  #if UAX_BIDI_ENABLE_DEBUG_TRACE
+  a.debug_trace = debug_trace;
+  #endif
+  PhaseClock phase_clock;
+  if (length > 0 && phase_stats_enabled.load(std::memory_order_relaxed)) {
+    a.phase_clock = &phase_clock;
+    phase_clock.start();
+  }
+  a.run(text, length, base_direction, scratch_buffer, resolved_paragraph_embedding_level, resolved_embedding_levels, levels_for);
+  if (a.phase_clock)
+    add_phase_stats(phase_clock.stats);
+  return levels_for == LevelsFor::CodeUnits ? length : a.length;
+}
+
+/**
+ ** The run counters are kept per thread, so that Run() bumps counters no other thread writes to: each thread's are only ever stored to by that thread (a relaxed load
+ ** and store, no locked add), and GetRunCounters() sums the live threads' with what exited threads left behind. ResetRunCounters() doesn't touch the threads' counters,
+ ** it moves the baseline that GetRunCounters() subtracts
+ **/
+struct ThreadRunCounters {
+  std::atomic<uint64_t> runs, single_level_runs, bracket_pairings;
+  ThreadRunCounters();
+  ~ThreadRunCounters();
+  static void bump(std::atomic<uint64_t> &counter) { counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+};
+
+struct RunCountersRegistry {
+  std::mutex mutex; // guards the rest
+  std::vector<ThreadRunCounters *> threads;
+  RunCounters exited = RunCounters(); // left behind by threads that have exited
+  RunCounters baseline = RunCounters();
+  
+  RunCounters sum() const { // with mutex held
+    RunCounters counters = exited;
+    for (const ThreadRunCounters *thread : threads) {
+      counters.runs += thread->runs.load(std::memory_order_relaxed);
+      counters.single_level_runs += thread->single_level_runs.load(std::memory_order_relaxed);
+      counters.bracket_pairings += thread->bracket_pairings.load(std::memory_order_relaxed);
+    }
+    return counters;
+  }
+};
+
+static RunCountersRegistry &run_counters_registry() {
+  static RunCountersRegistry *registry = new RunCountersRegistry(); // never destroyed, so that threads of a pool torn down during exit can still check out
+  return *registry;
+}
+
+static thread_local ThreadRunCounters this_thread_run_counters;
+
+ThreadRunCounters::ThreadRunCounters() : runs(0), single_level_runs(0), bracket_pairings(0) {
+  RunCountersRegistry &registry = run_counters_registry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.threads.push_back(this);
+}
+
+ThreadRunCounters::~ThreadRunCounters() {
+  RunCountersRegistry &registry = run_counters_registry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.exited.runs += runs.load(std::memory_order_relaxed);
+  registry.exited.single_level_runs += single_level_runs.load(std::memory_order_relaxed);
+  registry.exited.bracket_pairings += bracket_pairings.load(std::memory_order_relaxed);
+  registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+}
+
+RunCounters Bidi::GetRunCounters() {
+  RunCountersRegistry &registry = run_counters_registry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  RunCounters counters = registry.sum();
+  counters.runs -= registry.baseline.runs;
+  counters.single_level_runs -= registry.baseline.single_level_runs;
+  counters.bracket_pairings -= registry.baseline.bracket_pairings;
+  return counters;
+}
+
+void Bidi::ResetRunCounters() {
+  RunCountersRegistry &registry = run_counters_registry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  registry.baseline = registry.sum();
+}
+
+#if UAX_BIDI_ENABLE_DEBUG_TRACE
+#define RUN_ALGORITHM(INDEX, LEVELS_FOR) run_algorithm<INDEX>(text, length, base_direction, resolved_paragraph_embedding_level, resolved_embedding_levels, LEVELS_FOR, scratch_buffer, debug_trace)
+#else
+#define RUN_ALGORITHM(INDEX, LEVELS_FOR) run_algorithm<INDEX>(text, length, base_direction, resolved_paragraph_embedding_level, resolved_embedding_levels, LEVELS_FOR, scratch_buffer)
+#endif
+// the index type is picked by the number of code units, which is at least the number of codepoints
+#define RUN_ALGORITHM_FOR_LENGTH(LEVELS_FOR) \
+  (length <= BidiAlgorithm<uint16_t>::Max_Length ? RUN_ALGORITHM(uint16_t, LEVELS_FOR) : \
+   length <= BidiAlgorithm<uint32_t>::Max_Length ? RUN_ALGORITHM(uint32_t, LEVELS_FOR) : RUN_ALGORITHM(uint64_t, LEVELS_FOR))
+
+void Bidi::Run(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, void *scratch_buffer
+#if UAX_BIDI_ENABLE_DEBUG_TRACE
+               , bool debug_trace
+#endif
+               ) {
+  RUN_ALGORITHM_FOR_LENGTH(LevelsFor::Codepoints);
+}
+
+size_t Bidi::Run(const uint16_t *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, const LevelsFor levels_for, void *scratch_buffer
+#if UAX_BIDI_ENABLE_DEBUG_TRACE
+                 , bool debug_trace
+#endif
+                 ) {
+  return RUN_ALGORITHM_FOR_LENGTH(levels_for);
+}
+
+size_t Bidi::Run(const uint8_t *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, const LevelsFor levels_for, void *scratch_buffer
+#if UAX_BIDI_ENABLE_DEBUG_TRACE
+                 , bool debug_trace
+#endif
+                 ) {
+  return RUN_ALGORITHM_FOR_LENGTH(levels_for);
+}
+
+void Bidi::Run(const Bidi_Class *classes, const BracketInfo *brackets, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, void *scratch_buffer
+#if UAX_BIDI_ENABLE_DEBUG_TRACE
+               , bool debug_trace
+#endif
+               ) {
+  const ClassifiedText classified = { classes, brackets };
+  const ClassifiedText *text = &classified;
+  RUN_ALGORITHM_FOR_LENGTH(LevelsFor::Codepoints);
+}
+#undef RUN_ALGORITHM_FOR_LENGTH
+#undef RUN_ALGORITHM
+
+size_t Bidi::LevelRunsScratchBufferSize(const size_t text_length) {
+  return ScratchBufferSize(text_length); // the levels are only kept per level run
+}
+
+template<typename Index, typename MoreRuns> static size_t run_level_runs(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, ResolvedLevelRun *runs, const size_t run_capacity, void *scratch_buffer, MoreRuns more_runs) {
+  BidiAlgorithm<Index> a;
+  PhaseClock phase_clock;
+  if (length > 0 && phase_stats_enabled.load(std::memory_order_relaxed)) {
+    a.phase_clock = &phase_clock;
+    phase_clock.start();
+  }
+  a.run(text, length, base_direction, scratch_buffer, resolved_paragraph_embedding_level, (EmbeddingLevel *)nullptr, LevelsFor::Codepoints); // the runs come from the level runs and the classes
+  size_t count = a.resolved_level_runs(runs, run_capacity);
+  if (count > run_capacity) { // only the runs are gone over again, into room for all of them if more_runs gives it
+    ResolvedLevelRun *all_runs = more_runs(count);
+    if (all_runs)
+      a.resolved_level_runs(all_runs, count);
+  }
+  if (a.phase_clock)
+    add_phase_stats(phase_clock.stats);
+  return count;
+}
+
+template<typename MoreRuns> static size_t run_level_runs_for_length(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, ResolvedLevelRun *runs, const size_t run_capacity, void *scratch_buffer, MoreRuns more_runs) {
+  assert(length <= BidiAlgorithm<uint32_t>::Max_Length); // runs hold uint32_t positions
+  if (length <= BidiAlgorithm<uint16_t>::Max_Length)
+    return run_level_runs<uint16_t>(text, length, base_direction, resolved_paragraph_embedding_level, runs, run_capacity, scratch_buffer, more_runs);
+  return run_level_runs<uint32_t>(text, length, base_direction, resolved_paragraph_embedding_level, runs, run_capacity, scratch_buffer, more_runs);
+}
+
+size_t Bidi::RunLevelRuns(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, ResolvedLevelRun *runs, const size_t run_capacity, void *scratch_buffer) {
+  return run_level_runs_for_length(text, length, base_direction, resolved_paragraph_embedding_level, runs, run_capacity, scratch_buffer, [](size_t) -> ResolvedLevelRun * { return nullptr; });
+}
+
+struct ThreadPool::State {
+  struct Job { // one ForEach(), on the stack of the thread that called it
+    const std::function<void(size_t)> *f;
+    size_t count;
+    std::atomic<size_t> next; // the next f(i) to call, taken by whichever thread gets to it first
+    size_t working = 1; // threads between taking the job and running out of items, the calling thread first; the job is done once this is 0 and it's out of the queue
+    std::condition_variable done;
+    
+    void work() {
+      for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+        (*f)(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  std::mutex mutex; // guards the fields below and Job::working
+  std::condition_variable work_ready;
+  std::vector<Job *> jobs; // ForEach() calls that may have items left, oldest first; each is taken off by the first thread to run out of its items
+  bool stopping = false;
+  
+  void finish(Job &job) { // with mutex held, once this thread has run out of job's items
+    std::vector<Job *>::iterator queued = std::find(jobs.begin(), jobs.end(), &job);
+    if (queued != jobs.end())
+      jobs.erase(queued);
+    if (--job.working == 0)
+      job.done.notify_one();
+  }
+  void thread_main() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      work_ready.wait(lock, [&]{ return stopping || !jobs.empty(); });
+      if (stopping)
+        return;
+      Job &job = *jobs.front();
+      ++job.working;
+      lock.unlock();
+      job.work();
+      lock.lock();
+      finish(job);
+    }
+  }
+};
+
+ThreadPool::ThreadPool(unsigned thread_count): state(new State) {
+  if (thread_count == 0)
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned t = 1; t < thread_count; ++t) // the thread calling ForEach() is the first
+    state->threads.push_back(std::thread(&State::thread_main, state));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->stopping = true;
+  }
+  state->work_ready.notify_all();
+  for (std::thread &thread : state->threads)
+    thread.join();
+  delete state;
+}
+
+unsigned ThreadPool::ThreadCount() const {
+  return (unsigned)state->threads.size() + 1;
+}
+
+void ThreadPool::ForEach(const size_t count, const std::function<void(size_t)> &f) {
+  if (state->threads.empty() || count < 2) {
+    for (size_t i = 0; i < count; ++i)
+      f(i);
+    return;
+  }
+  State::Job job;
+  job.f = &f;
+  job.count = count;
+  job.next = 0;
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->jobs.push_back(&job);
+  }
+  state->work_ready.notify_all();
+  job.work();
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->finish(job);
+  job.done.wait(lock, [&]{ return job.working == 0; });
+}
+
+static size_t paragraph_end(const Codepoint *text, const size_t length, size_t i) { // P1, from the start of a paragraph to past its paragraph separator
+  for (; i < length; ++i) {
+    if (Get_Bidi_Class(text[i]) == Bidi_Class::Paragraph_Separator) {
+      if (text[i] == 0x000D && i + 1 < length && text[i + 1] == 0x000A)
+        ++i;
+      return i + 1;
+    }
+  }
+  return length;
+}
+
+size_t Bidi::CountParagraphs(const Codepoint *text, const size_t length) {
+  size_t count = 0;
+  for (size_t start = 0; start < length; start = paragraph_end(text, length, start))
+    ++count;
+  return count;
+}
+
+struct Arena { // a block of memory kept from one call to the next
+  void *memory = nullptr;
+  size_t capacity = 0;
+  
+  ~Arena() { free(memory); }
+  void *reserve(const size_t size, const size_t retained_capacity = 0) {
+    // grows to at least double, so a stream of longer and longer texts reallocates only a few times; and once more than retained_capacity is held, goes back down to it at
+    // the first call that fits. Its contents are not kept
+    if (size > capacity || (retained_capacity > 0 && capacity > retained_capacity && size <= retained_capacity)) {
+      size_t doubled = capacity * 2;
+      if (retained_capacity > 0)
+        doubled = std::min(doubled, retained_capacity);
+      free(memory);
+      capacity = std::max(size, doubled);
+      memory = malloc(capacity);
+    }
+    return memory;
+  }
+  void release() {
+    free(memory);
+    memory = nullptr;
+    capacity = 0;
+  }
+};
+
+static inline size_t aligned_size(const size_t size) { // so what comes after it in an arena is aligned for anything
+  return (size + 15) & ~(size_t)15;
+}
+
+static void *thread_scratch_buffer(const size_t size) { // grown as needed and kept for the next paragraph the thread resolves
+  thread_local Arena buffer;
+  return buffer.reserve(size);
+}
+
+static ThreadPool *shared_pool() {
+  static ThreadPool *pool = new ThreadPool(); // never destroyed, so it outlives any static that might call RunParagraphs() or RunBatch() during exit
+  return pool;
+}
+
+void Bidi::RunParagraphs(const Codepoint *text, const size_t length, const BaseDirection base_direction, Paragraph *paragraphs, EmbeddingLevel *resolved_embedding_levels, ThreadPool *pool) {
+  size_t paragraph_count = 0;
+  for (size_t start = 0; start < length; ) {
+    size_t end = paragraph_end(text, length, start);
+    paragraphs[paragraph_count].start = start;
+    paragraphs[paragraph_count].length = end - start;
+    ++paragraph_count;
+    start = end;
+  }
+  
+  // the text is cut into tasks of about Task_Length characters, each of which resolves the paragraphs that start in it, so that a thread doesn't go back to the pool for every
+  // short paragraph, and there are still enough tasks to balance out between threads when some paragraphs are much longer than others
+  const size_t Task_Length = 1 << 15;
+  const size_t task_count = (length + Task_Length - 1) / Task_Length;
+  auto resolve_task = [&](const size_t task) {
+    Paragraph *first = std::lower_bound(paragraphs, paragraphs + paragraph_count, task * Task_Length, [](const Paragraph &p, size_t start) { return p.start < start; });
+    for (Paragraph *p = first; p < paragraphs + paragraph_count && p->start < (task + 1) * Task_Length; ++p)
+      Run(&text[p->start], p->length, base_direction, p->embedding_level, &resolved_embedding_levels[p->start], thread_scratch_buffer(ScratchBufferSize(p->length)));
+  };
+  if (paragraph_count < 2) {
+    for (size_t task = 0; task < task_count; ++task)
+      resolve_task(task);
+    return;
+  }
+  (pool ? pool : shared_pool())->ForEach(task_count, resolve_task);
+}
+
+static bool is_explicit_formatting(const Bidi_Class cls) { // classes X9 removes or that start or end an isolate, any of which take more than a single level run
+  switch (cls) {
+    case Bidi_Class::Right_To_Left_Embedding:
+    case Bidi_Class::Left_To_Right_Embedding:
+    case Bidi_Class::Right_To_Left_Override:
+    case Bidi_Class::Left_To_Right_Override:
+    case Bidi_Class::Pop_Directional_Format:
+    case Bidi_Class::Right_To_Left_Isolate:
+    case Bidi_Class::Left_To_Right_Isolate:
+    case Bidi_Class::First_Strong_Isolate:
+    case Bidi_Class::Pop_Directional_Isolate:
+    case Bidi_Class::Boundary_Neutral:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static inline bool leaves_level_zero(const Bidi_Class cls) {
+  switch (cls) {
+    case Bidi_Class::Right_To_Left:
+    case Bidi_Class::Arabic_Letter:
+    case Bidi_Class::Arabic_Number:
+      return true;
+    default:
+      return is_explicit_formatting(cls);
+  }
+}
+
+static bool resolves_to_level_zero(const Codepoint *text, const size_t length) {
+  // without R, AL, AN, explicit formatting or BN, a paragraph at level 0 is a single level run from sos L to eos L, in which W1-W7 leave only L, EN turned L, and neutrals
+  // that N0 and N1 resolve to L between them; so every character stays at level 0. Most of the BMP is in ranges without any of those classes, which are checked 4 codepoints
+  // at a time
+  size_t i = 0;
+  #if defined(__SSE2__)
+  for (; i + 4 <= length; i += 4) {
+    if (!may_leave_level_zero_utf32(&text[i]))
+      continue;
+    for (size_t j = i; j < i + 4; ++j)
+      if (leaves_level_zero(Get_Bidi_Class(text[j])))
+        return false;
+  }
+  #endif
+  for (; i < length; ++i)
+    if (leaves_level_zero(Get_Bidi_Class(text[i])))
+      return false;
+  return true;
+}
+
+void Bidi::RunBatch(const TextSpan *texts, const size_t count, const BaseDirection base_direction, EmbeddingLevel *resolved_paragraph_embedding_levels, EmbeddingLevel *resolved_embedding_levels, ThreadPool *pool) {
+  // tasks of whole texts of about Task_Length characters together, as in RunParagraphs(), each starting where its first text's levels go
+  const size_t Task_Length = 1 << 15;
+  struct Task {
+    size_t first_text, offset;
+  };
+  std::vector<Task> tasks;
+  size_t offset = 0;
+  for (size_t t = 0; t < count; ++t) {
+    if (tasks.empty() || offset - tasks.back().offset >= Task_Length)
+      tasks.push_back(Task { t, offset });
+    offset += texts[t].length;
+  }
+  tasks.push_back(Task { count, offset });
+  auto resolve_task = [&](const size_t task) {
+    size_t offset = tasks[task].offset;
+    for (size_t t = tasks[task].first_text; t < tasks[task + 1].first_text; offset += texts[t].length, ++t) {
+      if (base_direction != BaseDirection::Right && resolves_to_level_zero(texts[t].text, texts[t].length)) {
+        resolved_paragraph_embedding_levels[t] = 0;
+        memset(&resolved_embedding_levels[offset], 0, texts[t].length * sizeof(EmbeddingLevel));
+      } else {
+        Run(texts[t].text, texts[t].length, base_direction, resolved_paragraph_embedding_levels[t], &resolved_embedding_levels[offset], thread_scratch_buffer(ScratchBufferSize(texts[t].length)));
+      }
+    }
+  };
+  if (tasks.size() < 3) {
+    if (tasks.size() == 2)
+      resolve_task(0);
+    return;
+  }
+  (pool ? pool : shared_pool())->ForEach(tasks.size() - 1, resolve_task);
+}
+
+template<typename Index> static void run_explicit_structure(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, void *scratch_buffer, ExplicitStructure *structure) {
+  // Run() that also fills in structure, unless that is null
+  BidiAlgorithm<Index> a;
+  PhaseClock phase_clock;
+  if (length > 0 && phase_stats_enabled.load(std::memory_order_relaxed)) {
+    a.phase_clock = &phase_clock;
+    phase_clock.start();
+  }
+  a.explicit_structure = structure;
+  a.run(text, length, base_direction, scratch_buffer, resolved_paragraph_embedding_level, resolved_embedding_levels, LevelsFor::Codepoints);
+  if (a.phase_clock)
+    add_phase_stats(phase_clock.stats);
+}
+
+template<typename Index> static void run_sequence(const ClassifiedText *text, const size_t length, const EmbeddingLevel level, const EmbeddingLevel level_before, const EmbeddingLevel level_after, EmbeddingLevel *resolved_embedding_levels, void *scratch_buffer) {
+  BidiAlgorithm<Index> a;
+  a.run_sequence(text, length, level, level_before, level_after, scratch_buffer, resolved_embedding_levels);
+}
+
+static bool is_structural(const Bidi_Class cls) { // explicit formatting characters other than BN, which start or end an embedding or isolate
+  return cls != Bidi_Class::Boundary_Neutral && is_explicit_formatting(cls);
+}
+
+struct Bidi::EditableParagraph::State {
+  std::vector<Codepoint> text;
+  std::vector<EmbeddingLevel> levels;
+  // what the last full Run() found X1-X10 to leave (see ExplicitStructure), kept up to date by edits that bring in or take away no structural character
+  std::vector<EmbeddingLevel> explicit_levels;
+  std::vector<uint32_t> sequences;
+  std::vector<uint8_t> scratch;
+  BaseDirection base_direction;
+  EmbeddingLevel paragraph_embedding_level;
+  size_t fsi_count = 0; // FSIs, whose direction depends on the strong characters after them
+  std::vector<size_t> brackets; // indices of the ONs with a Bidi_Paired_Bracket_Type, in order
+  struct BracketPair {
+    uint32_t sequence;
+    size_t open, close;
+    size_t enclosing_close; // the furthest close bracket of the pairs of the sequence up to this one, for widen()
+  };
+  std::vector<BracketPair> pairs; // BD16 for each sequence, by sequence and then open bracket
+  size_t last_resolved_length = 0;
+  
+  // one isolating run sequence at a time for resolve_sequence(), by its characters
+  std::vector<size_t> sequence_indices;
+  std::vector<Bidi_Class> sequence_classes;
+  std::vector<BracketInfo> sequence_brackets;
+  std::vector<EmbeddingLevel> sequence_levels;
+  
+  struct Contents { // of the text an edit takes away or brings in
+    bool structural, strong, brackets, paragraph_separator;
+    Bidi_Class first_strong; // Other_Neutral for none
+    size_t fsi_count;
+  };
+  static Contents look_at(const Codepoint *text, const size_t length, std::vector<size_t> *brackets, const size_t offset) { // adds the indices of its brackets, from offset on
+    Contents contents = Contents();
+    contents.first_strong = Bidi_Class::Other_Neutral;
+    for (size_t i = 0; i < length; ++i) {
+      Properties properties = Get_Properties(text[i]);
+      contents.structural |= is_structural(properties.bidi_class);
+      if (Is_Strong(properties.bidi_class) && !contents.strong)
+        contents.first_strong = properties.bidi_class;
+      contents.strong |= Is_Strong(properties.bidi_class);
+      contents.paragraph_separator |= properties.bidi_class == Bidi_Class::Paragraph_Separator;
+      contents.fsi_count += properties.bidi_class == Bidi_Class::First_Strong_Isolate;
+      if (properties.bidi_class == Bidi_Class::Other_Neutral && properties.bidi_paired_bracket_type != Bidi_Paired_Bracket_Type::None) {
+        contents.brackets = true;
+        if (brackets)
+          brackets->push_back(offset + i);
+      }
+    }
+    return contents;
+  }
+  void run(const size_t start, const size_t end, const BaseDirection direction, EmbeddingLevel &level, ExplicitStructure *structure) {
+    assert(end - start <= BidiAlgorithm<uint32_t>::Max_Length); // sequences are numbered in uint32_t
+    scratch.resize(std::max(scratch.size(), ScratchBufferSize(end - start)));
+    if (end - start <= BidiAlgorithm<uint16_t>::Max_Length)
+      run_explicit_structure<uint16_t>(&text[start], end - start, direction, level, &levels[start], scratch.data(), structure);
+    else
+      run_explicit_structure<uint32_t>(&text[start], end - start, direction, level, &levels[start], scratch.data(), structure);
+  }
+  void run_all() {
+    explicit_levels.resize(text.size());
+    sequences.resize(text.size());
+    ExplicitStructure structure = { explicit_levels.data(), sequences.data() };
+    run(0, text.size(), base_direction, paragraph_embedding_level, &structure);
+    last_resolved_length = text.size();
+    pair_all();
+  }
+  bool is_strong(const size_t i) const {
+    return Is_Strong(Get_Bidi_Class(text[i]));
+  }
+  bool pairs_in(const size_t i) const { // the bracket takes part in BD16 of its sequence
+    return explicit_levels[i] != Removed_Level && !(explicit_levels[i] & Overridden_Level);
+  }
+  EmbeddingLevel first_strong_level(bool &found) const;
+  size_t first_strong_in_isolate(const size_t from, const size_t to) const;
+  bool changes_fsi_direction(const size_t start, const size_t end, const EmbeddingLevel level, const Contents &removed, const Contents &inserted) const;
+  size_t neighbour(const size_t start, const size_t end) const;
+  void resolve_sequence(const size_t at);
+  void pair_brackets(const uint32_t sequence, const std::vector<size_t> &in_sequence, std::vector<BracketPair> &out) const;
+  void pair_all();
+  static void find_enclosing_closes(BracketPair *begin, BracketPair *end);
+  bool widen(size_t &first, size_t &last, const BracketPair *begin, const BracketPair *end, const std::function<bool(size_t, size_t)> &grow) const;
+};
+
+EmbeddingLevel Bidi::EditableParagraph::State::first_strong_level(bool &found) const {
+  // P2, P3, skipping from each isolate initiator to its matching PDI the way Initializaton() matches them up. found is false where that depends on an initiator
+  // overflowing its stack, which is left to Run()
+  found = true;
+  size_t unmatched = 0; // isolate initiators without a matching PDI that P2 is inside of, and which stay on the stack
+  for (size_t i = 0; i < text.size(); ++i) {
+    Bidi_Class cls = Get_Bidi_Class(text[i]);
+    if (Is_Strong(cls))
+      return cls == Bidi_Class::Left_To_Right ? 0 : 1;
+    if (!Is_Isolate_Initiator(cls))
+      continue;
+    size_t depth = 1, j = i + 1;
+    for (; j < text.size() && depth > 0; ++j) {
+      Bidi_Class inside = Get_Bidi_Class(text[j]);
+      if (Is_Isolate_Initiator(inside))
+        ++depth;
+      else if (inside == Bidi_Class::Pop_Directional_Isolate)
+        --depth;
+      if (unmatched + depth >= MAX_DEPTH) {
+        found = false;
+        return 0;
+      }
+    }
+    if (depth == 0)
+      i = j - 1; // the PDI
+    else
+      ++unmatched;
+  }
+  return 0;
+}
+
+size_t Bidi::EditableParagraph::State::first_strong_in_isolate(const size_t from, const size_t to) const {
+  // P2 over text[from, to), skipping isolates: the index of the first strong character, or of the PDI that closes the isolate 'from' is in if that comes first, or 'to'
+  size_t depth = 0;
+  for (size_t i = from; i < to; ++i) {
+    Bidi_Class cls = Get_Bidi_Class(text[i]);
+    if (depth == 0 && (Is_Strong(cls) || cls == Bidi_Class::Pop_Directional_Isolate))
+      return i;
+    if (Is_Isolate_Initiator(cls))
+      ++depth;
+    else if (cls == Bidi_Class::Pop_Directional_Isolate)
+      --depth;
+  }
+  return to;
+}
+
+bool Bidi::EditableParagraph::State::changes_fsi_direction(const size_t start, const size_t end, const EmbeddingLevel level, const Contents &removed, const Contents &inserted) const {
+  // X5c for the isolate the edit [start, end) is in, at 'level': its initiator is the nearest one before it below every level in between, as those of embeddings inside it are
+  // higher and those of isolates closed before the edit no lower. Only a matched FSI whose first strong character of its own is not before the edit changes direction
+  EmbeddingLevel lowest = level;
+  size_t initiator = start;
+  for (size_t i = start; i-- > 0; ) {
+    Bidi_Class cls = Get_Bidi_Class(text[i]);
+    if (explicit_levels[i] == Removed_Level || cls == Bidi_Class::Paragraph_Separator)
+      continue;
+    EmbeddingLevel at = explicit_levels[i] & ~Overridden_Level;
+    if (at >= lowest)
+      continue;
+    if (Is_Isolate_Initiator(cls)) {
+      initiator = i;
+      break;
+    }
+    lowest = at;
+  }
+  if (initiator == start || Get_Bidi_Class(text[initiator]) != Bidi_Class::First_Strong_Isolate || first_strong_in_isolate(initiator + 1, start) < start)
+    return false;
+  size_t after = first_strong_in_isolate(end, text.size());
+  Bidi_Class after_class = after < text.size() ? Get_Bidi_Class(text[after]) : Bidi_Class::Other_Neutral;
+  Bidi_Class was = removed.strong ? removed.first_strong : after_class, is = inserted.strong ? inserted.first_strong : after_class;
+  if ((was == Bidi_Class::Left_To_Right || !Is_Strong(was)) == (is == Bidi_Class::Left_To_Right || !Is_Strong(is)))
+    return false;
+  while (after < text.size() && Get_Bidi_Class(text[after]) != Bidi_Class::Pop_Directional_Isolate)
+    after = first_strong_in_isolate(after + 1, text.size());
+  return after < text.size(); // an FSI without a matching PDI is an LRI
+}
+
+size_t Bidi::EditableParagraph::State::neighbour(const size_t start, const size_t end) const {
+  // the nearest character before text[start, end), or else after it, that X9 doesn't remove, with only BN and B between: an edit with no structural character brings in
+  // text at its explicit level and in its level run. A B is at the paragraph level in any embedding (X8), so one in between ends the level run unless that is the level
+  // too. text.size() if both ways reach a structural character first
+  auto looks_at = [&](const size_t i, bool &crossed_separator, bool &stop) {
+    Bidi_Class cls = Get_Bidi_Class(text[i]);
+    stop = is_structural(cls);
+    if (cls == Bidi_Class::Paragraph_Separator) {
+      crossed_separator = true;
+      return false;
+    }
+    if (stop || explicit_levels[i] == Removed_Level)
+      return false;
+    stop = crossed_separator && (explicit_levels[i] & ~Overridden_Level) != paragraph_embedding_level;
+    return !stop;
+  };
+  bool crossed_separator = false, stop = false;
+  for (size_t i = start; i-- > 0 && !stop; ) {
+    if (looks_at(i, crossed_separator, stop))
+      return i;
+  }
+  crossed_separator = stop = false;
+  for (size_t i = end; i < text.size() && !stop; ++i) {
+    if (looks_at(i, crossed_separator, stop))
+      return i;
+  }
+  return text.size();
+}
+
+void Bidi::EditableParagraph::State::resolve_sequence(const size_t at) {
+  // W1-I2 for the whole isolating run sequence of the character at 'at', from the classes X1-X9 left. Between its characters there are only those X9 removed, B, and those of
+  // the isolates it steps over, which are at higher levels; so it ends each way before the nearest character at its level or lower in another sequence
+  const uint32_t sequence = sequences[at];
+  const EmbeddingLevel level = explicit_levels[at] & ~Overridden_Level;
+  auto inside = [&](const size_t i) {
+    return explicit_levels[i] == Removed_Level || sequences[i] == sequence || (explicit_levels[i] & ~Overridden_Level) > level || Get_Bidi_Class(text[i]) == Bidi_Class::Paragraph_Separator;
+  };
+  size_t first = at, last = at;
+  while (first > 0 && inside(first - 1))
+    --first;
+  while (last + 1 < text.size() && inside(last + 1))
+    ++last;
+  sequence_indices.clear();
+  sequence_classes.clear();
+  sequence_brackets.clear();
+  for (size_t i = first; i <= last; ++i) {
+    if (explicit_levels[i] == Removed_Level || sequences[i] != sequence)
+      continue;
+    Bidi_Class cls = Get_Bidi_Class(text[i]);
+    if (explicit_levels[i] & Overridden_Level) // X6
+      cls = (level & 1) ? Bidi_Class::Right_To_Left : Bidi_Class::Left_To_Right;
+    sequence_indices.push_back(i);
+    sequence_classes.push_back(cls);
+    sequence_brackets.push_back(cls == Bidi_Class::Other_Neutral ? GetBracketInfo(text[i]) : BracketInfo { Bidi_Paired_Bracket_Type::None, 0 });
+  }
+  auto level_next_to = [&](size_t i, const ptrdiff_t step) { // of the character X9 left next to text[i], the paragraph's at either end
+    for (i += step; i < text.size(); i += step) {
+      if (explicit_levels[i] != Removed_Level)
+        return EmbeddingLevel(explicit_levels[i] & ~Overridden_Level);
+    }
+    return paragraph_embedding_level;
+  };
+  const size_t count = sequence_indices.size();
+  const ClassifiedText classified = { sequence_classes.data(), sequence_brackets.data() };
+  sequence_levels.resize(count);
+  scratch.resize(std::max(scratch.size(), ScratchBufferSize(count)));
+  if (count <= BidiAlgorithm<uint16_t>::Max_Length)
+    run_sequence<uint16_t>(&classified, count, level, level_next_to(sequence_indices.front(), -1), level_next_to(sequence_indices.back(), 1), sequence_levels.data(), scratch.data());
+  else
+    run_sequence<uint32_t>(&classified, count, level, level_next_to(sequence_indices.front(), -1), level_next_to(sequence_indices.back(), 1), sequence_levels.data(), scratch.data());
+  for (size_t k = 0; k < count; ++k)
+    levels[sequence_indices[k]] = sequence_levels[k];
+  last_resolved_length = count;
+}
+
+void Bidi::EditableParagraph::State::pair_brackets(const uint32_t sequence, const std::vector<size_t> &in_sequence, std::vector<BracketPair> &out) const {
+  // BD16 as assign_bracket_pairs() does it over the brackets of one sequence, in order, leaving out an open bracket the stack has no room for; out gets them by open bracket
+  size_t open_brackets[MAX_DEPTH];
+  int count = 0;
+  size_t first_pair = out.size();
+  for (size_t i : in_sequence) {
+    Bidi_Paired_Bracket_Type type;
+    Codepoint code = Get_Bidi_Paired_Bracket(text[i], type);
+    if (type == Bidi_Paired_Bracket_Type::Open) {
+      if (count < MAX_DEPTH)
+        open_brackets[count++] = i;
+    } else {
+      for (int m = count - 1; m >= 0; --m) {
+        Codepoint a = text[open_brackets[m]], b = text[i];
+        if (code == a || (a == 0x2329 && b == 0x3009) || (a == 0x3008 && b == 0x232A)) {
+          out.push_back(BracketPair { sequence, open_brackets[m], i, 0 });
+          count = m;
+          break;
+        }
+      }
+    }
+  }
+  std::sort(out.begin() + first_pair, out.end(), [](const BracketPair &a, const BracketPair &b) { return a.open < b.open; });
+  find_enclosing_closes(out.data() + first_pair, out.data() + out.size());
+}
+
+void Bidi::EditableParagraph::State::pair_all() {
+  std::vector<size_t> paired;
+  for (size_t i : brackets) {
+    if (pairs_in(i))
+      paired.push_back(i);
+  }
+  std::stable_sort(paired.begin(), paired.end(), [&](size_t a, size_t b) { return sequences[a] < sequences[b]; });
+  pairs.clear();
+  std::vector<size_t> in_sequence;
+  for (size_t p = 0; p < paired.size(); ) {
+    size_t q = p;
+    in_sequence.clear();
+    for (; q < paired.size() && sequences[paired[q]] == sequences[paired[p]]; ++q)
+      in_sequence.push_back(paired[q]);
+    pair_brackets(sequences[paired[p]], in_sequence, pairs);
+    p = q;
+  }
+}
+
+void Bidi::EditableParagraph::State::find_enclosing_closes(BracketPair *begin, BracketPair *end) {
+  size_t furthest = 0;
+  for (BracketPair *pair = begin; pair < end; ++pair)
+    pair->enclosing_close = furthest = std::max(furthest, pair->close);
+}
+
+bool Bidi::EditableParagraph::State::widen(size_t &first, size_t &last, const BracketPair *begin, const BracketPair *end, const std::function<bool(size_t, size_t)> &grow) const {
+  // a pair of [begin, end) that has one bracket inside [first, last] and the other outside has to be resolved with everything it encloses. The pairs before first that
+  // reach it are found from the furthest close bracket up to each one, outermost first; then, as nothing before first reaches past it any more, the pairs up to last that
+  // reach past it. grow() takes first and last out to new ends and on to the strong characters around them, false if it can't
+  for (;;) {
+    const BracketPair *before = std::lower_bound(begin, end, first, [](const BracketPair &pair, size_t i) { return pair.open < i; });
+    if (before == begin || before[-1].enclosing_close < first)
+      break;
+    const BracketPair *outermost = std::lower_bound(begin, before, first, [](const BracketPair &pair, size_t i) { return pair.enclosing_close < i; });
+    if (!grow(outermost->open, last))
+      return false;
+  }
+  for (;;) {
+    const BracketPair *up_to = std::upper_bound(begin, end, last, [](size_t i, const BracketPair &pair) { return i < pair.open; });
+    size_t furthest = up_to == begin ? 0 : std::min(up_to[-1].enclosing_close, text.size() - 1); // a bracket the edit took away is at its start, which can be the end
+    if (furthest <= last)
+      break;
+    if (!grow(first, furthest))
+      return false;
+  }
+  return true;
+}
+
+Bidi::EditableParagraph::EditableParagraph(const Codepoint *text, const size_t length, const BaseDirection base_direction): state(new State) {
+  state->text.assign(text, text + length);
+  state->levels.resize(length);
+  state->base_direction = base_direction;
+  state->fsi_count = State::look_at(text, length, &state->brackets, 0).fsi_count;
+  state->run_all();
+}
+
+Bidi::EditableParagraph::~EditableParagraph() {
+  delete state;
+}
+
+void Bidi::EditableParagraph::Replace(const size_t start, const size_t end, const Codepoint *text, const size_t length) {
+  State &s = *state;
+  std::vector<size_t> inserted_brackets;
+  State::Contents removed = State::look_at(&s.text[start], end - start, nullptr, 0), inserted = State::look_at(text, length, &inserted_brackets, start);
+  s.fsi_count = s.fsi_count - removed.fsi_count + inserted.fsi_count;
+  auto moved = [&](const size_t i) { // where an index from before the edit is after it, for one the edit took away its start
+    return i >= end ? i - (end - start) + length : std::min(i, start);
+  };
+  size_t first_removed = std::lower_bound(s.brackets.begin(), s.brackets.end(), start) - s.brackets.begin();
+  size_t end_removed = std::lower_bound(s.brackets.begin(), s.brackets.end(), end) - s.brackets.begin();
+  for (size_t b = end_removed; b < s.brackets.size(); ++b)
+    s.brackets[b] = moved(s.brackets[b]);
+  s.brackets.erase(s.brackets.begin() + first_removed, s.brackets.begin() + end_removed);
+  s.brackets.insert(s.brackets.begin() + first_removed, inserted_brackets.begin(), inserted_brackets.end());
+  s.text.erase(s.text.begin() + start, s.text.begin() + end);
+  s.text.insert(s.text.begin() + start, text, text + length);
+  s.levels.erase(s.levels.begin() + start, s.levels.begin() + end);
+  s.levels.insert(s.levels.begin() + start, length, 0);
+  s.explicit_levels.erase(s.explicit_levels.begin() + start, s.explicit_levels.begin() + end);
+  s.explicit_levels.insert(s.explicit_levels.begin() + start, length, Removed_Level);
+  s.sequences.erase(s.sequences.begin() + start, s.sequences.begin() + end);
+  s.sequences.insert(s.sequences.begin() + start, length, 0);
+  // with no structural character brought in or taken away, the embeddings and isolates are where they were, and every other character keeps its explicit level and sequence
+  if (s.text.empty() || removed.structural || inserted.structural) {
+    s.run_all();
+    return;
+  }
+  for (State::BracketPair &pair : s.pairs) {
+    pair.open = moved(pair.open);
+    pair.close = moved(pair.close);
+    pair.enclosing_close = moved(pair.enclosing_close);
+  }
+  
+  // the text the edit brings in is at the explicit level and in the sequence of the characters around it -- unless there are none between the structural characters on either
+  // side of it, when a level run comes or goes
+  const size_t neighbour = s.neighbour(start, start + length);
+  if (neighbour == s.text.size()) {
+    s.run_all();
+    return;
+  }
+  const EmbeddingLevel level = s.explicit_levels[neighbour] & ~Overridden_Level;
+  const bool overridden = s.explicit_levels[neighbour] & Overridden_Level;
+  const uint32_t sequence = s.sequences[neighbour];
+  if (level >= MAX_DEPTH - 1 || ((removed.paragraph_separator || inserted.paragraph_separator) && level != s.paragraph_embedding_level)) {
+    // an isolate in the sequence may overflow, which only X1-X8 tell apart; and a B away from the paragraph level is a level run of its own (X8)
+    s.run_all();
+    return;
+  }
+  if (removed.strong || inserted.strong) { // P2 and the FSIs look for the first strong character
+    bool found = true;
+    EmbeddingLevel paragraph_level = s.base_direction == BaseDirection::Auto ? s.first_strong_level(found) : s.paragraph_embedding_level;
+    if (!found || paragraph_level != s.paragraph_embedding_level || (s.fsi_count > 0 && s.changes_fsi_direction(start, start + length, level, removed, inserted))) {
+      s.run_all();
+      return;
+    }
+  }
+  for (size_t i = start; i < start + length; ++i) {
+    Bidi_Class cls = Get_Bidi_Class(s.text[i]);
+    s.explicit_levels[i] = cls == Bidi_Class::Boundary_Neutral ? Removed_Level : cls == Bidi_Class::Paragraph_Separator ? s.paragraph_embedding_level : s.explicit_levels[neighbour];
+    s.sequences[i] = sequence;
+    if (cls == Bidi_Class::Boundary_Neutral)
+      s.levels[i] = Removed_Level;
+  }
+  
+  // the pairs from before the edit matter as much as the ones after it: a pair the edit breaks up leaves its other bracket outside to be resolved again. Only the sequence
+  // of the edit pairs its brackets any differently
+  auto by_sequence = [](const State::BracketPair &a, const State::BracketPair &b) { return a.sequence < b.sequence; };
+  const State::BracketPair key = { sequence, 0, 0, 0 };
+  auto sequence_pairs = std::equal_range(s.pairs.begin(), s.pairs.end(), key, by_sequence);
+  std::vector<State::BracketPair> old_pairs;
+  if (removed.brackets || inserted.brackets) {
+    old_pairs.assign(sequence_pairs.first, sequence_pairs.second);
+    std::vector<size_t> in_sequence;
+    for (size_t i : s.brackets) {
+      if (s.sequences[i] == sequence && s.pairs_in(i))
+        in_sequence.push_back(i);
+    }
+    std::vector<State::BracketPair> new_pairs;
+    s.pair_brackets(sequence, in_sequence, new_pairs);
+    size_t at = s.pairs.erase(sequence_pairs.first, sequence_pairs.second) - s.pairs.begin();
+    s.pairs.insert(s.pairs.begin() + at, new_pairs.begin(), new_pairs.end());
+    sequence_pairs = std::make_pair(s.pairs.begin() + at, s.pairs.begin() + at + new_pairs.size());
+  }
+  // a strong character ends everything W1-W7 and N1 carry along the sequence and W5 can't reach past it, and its own level depends only on its class; so the levels of the
+  // text from the strong character before the edit up to the one after it don't depend on anything outside, if no structural character comes in between to put part of it
+  // in another sequence, and that part can be run as a paragraph of its own at the explicit level of the sequence. Where one does, the whole sequence is resolved again
+  auto takes_in = [&](const size_t i) {
+    Bidi_Class cls = Get_Bidi_Class(s.text[i]);
+    return !is_structural(cls) && (cls != Bidi_Class::Paragraph_Separator || level == s.paragraph_embedding_level);
+  };
+  size_t first = start, last = start + length;
+  auto to_strong = [&]() {
+    while (first > 0 && !s.is_strong(first)) {
+      if (!takes_in(--first))
+        return false;
+    }
+    for (; last + 1 < s.text.size() && !s.is_strong(last); ++last) {
+      if (!takes_in(last + 1))
+        return false;
+    }
+    return true;
+  };
+  auto grow = [&](const size_t new_first, const size_t new_last) {
+    for (size_t i = new_first; i < first; ++i) {
+      if (!takes_in(i))
+        return false;
+    }
+    for (size_t i = last + 1; i <= new_last; ++i) {
+      if (!takes_in(i))
+        return false;
+    }
+    first = new_first;
+    last = new_last;
+    return to_strong();
+  };
+  bool in_one_sequence = true;
+  while (first > 0 && in_one_sequence && (first == start || !s.is_strong(first)))
+    in_one_sequence = takes_in(--first);
+  for (; last < s.text.size() && in_one_sequence && !s.is_strong(last); ++last)
+    in_one_sequence = takes_in(last);
+  last = std::min(last, s.text.size() - 1);
+  for (size_t was_first = first + 1, was_last = last; in_one_sequence && (first != was_first || last != was_last); ) {
+    was_first = first;
+    was_last = last;
+    in_one_sequence = s.widen(first, last, s.pairs.data() + (sequence_pairs.first - s.pairs.begin()), s.pairs.data() + (sequence_pairs.second - s.pairs.begin()), grow) && s.widen(first, last, old_pairs.data(), old_pairs.data() + old_pairs.size(), grow);
+  }
+  if (!in_one_sequence) {
+    s.resolve_sequence(neighbour);
+    return;
+  }
+  
+  if (overridden) { // X6 made every character L or R, which stays at its explicit level
+    for (size_t i = first; i <= last; ++i)
+      s.levels[i] = s.explicit_levels[i] == Removed_Level ? Removed_Level : level;
+  } else {
+    EmbeddingLevel part_level;
+    s.run(first, last + 1, (level & 1) ? BaseDirection::Right : BaseDirection::Left, part_level, nullptr);
+    for (size_t i = first; i <= last; ++i) {
+      if (s.levels[i] != Removed_Level)
+        s.levels[i] += level - (level & 1);
+    }
+  }
+  s.last_resolved_length = last + 1 - first;
+}
+
+const Codepoint *Bidi::EditableParagraph::Text() const { return state->text.data(); }
+size_t Bidi::EditableParagraph::Length() const { return state->text.size(); }
+EmbeddingLevel Bidi::EditableParagraph::ParagraphEmbeddingLevel() const { return state->paragraph_embedding_level; }
+const EmbeddingLevel *Bidi::EditableParagraph::EmbeddingLevels() const { return state->levels.data(); }
+size_t Bidi::EditableParagraph::LastResolvedLength() const { return state->last_resolved_length; }
+
+void Bidi::ReorderLine(const Codepoint *text, const EmbeddingLevel *resolved_embedding_levels, const EmbeddingLevel paragraph_embedding_level, const size_t line_start, const size_t line_end,
+                       EmbeddingLevel *line_levels, size_t *visual_to_logical, size_t *logical_to_visual) {
+  const size_t length = line_end - line_start;
+  if (length == 0)
+    return;
+  
+  bool trailing = true; // L1, from the end of the line back
+  for (size_t i = length; i-- > 0; ) {
+    EmbeddingLevel level = resolved_embedding_levels[line_start + i];
+    Bidi_Class cls = Get_Bidi_Class(text[line_start + i]);
+    if (level == Removed_Level) { // 5.2 - Retaining Explicit Formatting Characters
+      line_levels[i] = trailing ? paragraph_embedding_level : Removed_Level;
+    } else if (cls == Bidi_Class::Segment_Separator || cls == Bidi_Class::Paragraph_Separator) {
+      line_levels[i] = paragraph_embedding_level;
+      trailing = true;
+    } else if (trailing && (cls == Bidi_Class::White_Space || Is_Isolate_Initiator(cls) || cls == Bidi_Class::Pop_Directional_Isolate)) {
+      line_levels[i] = paragraph_embedding_level;
+    } else {
+      line_levels[i] = level;
+      trailing = false;
+    }
+  }
+  EmbeddingLevel lowest_odd_level = Removed_Level;
+  for (size_t i = 0; i < length; ++i) {
+    if (line_levels[i] == Removed_Level)
+      line_levels[i] = (i > 0) ? line_levels[i - 1] : paragraph_embedding_level;
+    if ((line_levels[i] & 1) && line_levels[i] < lowest_odd_level)
+      lowest_odd_level = line_levels[i];
+  }
+  if (lowest_odd_level == Removed_Level) { // no odd levels, L2 reverses nothing
+    for (size_t i = 0; i < length; ++i) {
+      visual_to_logical[i] = line_start + i;
+      logical_to_visual[i] = i;
+    }
+    return;
+  }
+  
+  // L2 reverses, from the highest level down to the lowest odd level, every sequence of characters at that level or higher. Instead of reversing characters level by level, the
+  // level runs are linked into lists in one pass, a block for each level that is open on a stack: a run is added to the block at its level, and when a block is closed by a run
+  // at a lower level its list is reversed (once for each level closed, so only the odd count of them matters) and added to the block that holds it. Reversing a list swaps its
+  // ends, which works because each run is linked to its neighbours without saying which one comes first. How often a run's characters are reversed follows from its level alone.
+  // The links are kept in visual_to_logical and logical_to_visual at the start of each run, until the outputs are written over them
+  const size_t None = SIZE_MAX;
+  size_t *links[2] = { visual_to_logical, logical_to_visual };
+  auto link = [&](const size_t a, const size_t b) { // a and b are ends of lists, which have a free link
+    links[links[0][a] == None ? 0 : 1][a] = b;
+    links[links[0][b] == None ? 0 : 1][b] = a;
+  };
+  const EmbeddingLevel base_level = lowest_odd_level - 1; // levels below this are never reversed, and count as this level
+  struct Block {
+    EmbeddingLevel level;
+    size_t head, tail; // first and last run of the list
+  } stack[256];
+  int count = 1;
+  stack[0] = Block { base_level, None, None };
+  auto append = [&](Block &block, const size_t head, const size_t tail) {
+    if (head == None)
+      return;
+    if (block.head == None) {
+      block.head = head;
+    } else {
+      link(block.tail, head);
+    }
+    block.tail = tail;
+  };
+  auto close_blocks_above = [&](const EmbeddingLevel level) {
+    while (stack[count - 1].level > level) {
+      Block closed = stack[--count];
+      EmbeddingLevel outer_level = std::max(stack[count - 1].level, level);
+      if ((closed.level - outer_level) & 1)
+        std::swap(closed.head, closed.tail);
+      if (stack[count - 1].level < level) // the block at 'level' started where the closed one did
+        stack[count++] = Block { level, None, None };
+      append(stack[count - 1], closed.head, closed.tail);
+    }
+  };
+  for (size_t run = 0; run < length; ) {
+    size_t end = run + 1;
+    while (end < length && line_levels[end] == line_levels[run])
+      ++end;
+    EmbeddingLevel level = std::max(line_levels[run], base_level);
+    close_blocks_above(level);
+    if (stack[count - 1].level < level)
+      stack[count++] = Block { level, None, None };
+    links[0][run] = links[1][run] = None;
+    append(stack[count - 1], run, run);
+    run = end;
+  }
+  close_blocks_above(base_level);
+  
+  // walk the list for where each run starts visually, kept in logical_to_visual at its start, then fill in both maps run by run
+  size_t visual = 0;
+  for (size_t run = stack[0].head, previous = None; run != None; ) {
+    size_t next = (links[0][run] != previous) ? links[0][run] : links[1][run];
+    size_t end = run + 1;
+    while (end < length && line_levels[end] == line_levels[run])
+      ++end;
+    logical_to_visual[run] = visual;
+    visual += end - run;
+    previous = run;
+    run = next;
+  }
+  for (size_t run = 0; run < length; ) {
+    size_t end = run + 1;
+    while (end < length && line_levels[end] == line_levels[run])
+      ++end;
+    size_t first = logical_to_visual[run];
+    bool reversed = (std::max(line_levels[run], base_level) - base_level) & 1;
+    for (size_t i = run; i < end; ++i) {
+      size_t v = reversed ? first + (end - 1 - i) : first + (i - run);
+      visual_to_logical[v] = line_start + i;
+      logical_to_visual[i] = v;
+    }
+    run = end;
+  }
+}
+
+size_t Bidi::ApplyMirroring(const Codepoint *text, const EmbeddingLevel *levels, const size_t length, Codepoint *out) {
+  const uint64_t Odd_Bits = 0x0101010101010101ull;
+  const uint64_t Ascii_Mirrored[2] = { // ( ) < > and [ ] { }, the only ASCII with mirrored glyphs, which leaves the spaces and punctuation of RTL text without a lookup
+    (1ull << 0x28) | (1ull << 0x29) | (1ull << 0x3C) | (1ull << 0x3E), (1ull << (0x5B - 64)) | (1ull << (0x5D - 64)) | (1ull << (0x7B - 64)) | (1ull << (0x7D - 64)) };
+  size_t mirrored = 0;
+  for (size_t i = 0; i < length; ) {
+    uint64_t eight;
+    if (i + 8 <= length && (memcpy(&eight, &levels[i], 8), (eight & Odd_Bits) == 0)) { // all even, as most of most text is
+      if (out != text)
+        memcpy(&out[i], &text[i], 8 * sizeof(Codepoint));
+      i += 8;
+      continue;
+    }
+    Codepoint code = text[i];
+    if ((levels[i] & 1) && levels[i] != Removed_Level && (code >= 0x80 || ((Ascii_Mirrored[code >> 6] >> (code & 63)) & 1))) {
+      Codepoint mirror = Get_Bidi_Mirroring(code); // 0 unless the properties say it has one, which is a single lookup
+      if (mirror != 0) {
+        code = mirror;
+        ++mirrored;
+      }
+    }
+    out[i++] = code;
+  }
+  return mirrored;
+}
+
+struct Bidi::VisualMap::State { // one block with the runs after it
+  struct Run {
+    uint32_t logical_start, visual_start, length; // from the start of the line
+    EmbeddingLevel level;
+  };
+  size_t line_start;
+  uint32_t length, run_count;
+  
+  Run *runs() { return (Run *)(this + 1); }
+  const Run *runs() const { return (const Run *)(this + 1); }
+  uint32_t *visual_order() { return (uint32_t *)(runs() + run_count); } // the runs from left to right
+  const uint32_t *visual_order() const { return (const uint32_t *)(runs() + run_count); }
+  
+  uint32_t run_at(const uint32_t logical) const { // the run holding the character
+    return uint32_t(std::upper_bound(runs(), runs() + run_count, logical, [](const uint32_t i, const Run &run) { return i < run.logical_start; }) - runs() - 1);
+  }
+  const Run &visual_run_at(const uint32_t visual) const { // the run shown at the visual position
+    const Run *r = runs();
+    return r[*(std::upper_bound(visual_order(), visual_order() + run_count, visual, [r](const uint32_t v, const uint32_t run) { return v < r[run].visual_start; }) - 1)];
+  }
+};
+
+Bidi::VisualMap::VisualMap(const Codepoint *text, const EmbeddingLevel *resolved_embedding_levels, const EmbeddingLevel paragraph_embedding_level, const size_t line_start, const size_t line_end) {
+  // ReorderLine() into memory kept per thread, of which only the runs are kept: each run of a level after L1 is reversed as one by every L2 step that reaches it, so it
+  // stays together, reversed if its level is odd
+  assert(line_start <= line_end && line_end - line_start <= UINT32_MAX); // runs hold uint32_t positions
+  const size_t length = line_end - line_start;
+  size_t *visual_to_logical = (size_t *)thread_scratch_buffer(length * (2 * sizeof(size_t) + sizeof(EmbeddingLevel)));
+  size_t *logical_to_visual = visual_to_logical + length;
+  EmbeddingLevel *line_levels = (EmbeddingLevel *)(logical_to_visual + length);
+  Bidi::ReorderLine(text, resolved_embedding_levels, paragraph_embedding_level, line_start, line_end, line_levels, visual_to_logical, logical_to_visual);
+  size_t run_count = 0;
+  for (size_t i = 0; i < length; ++i)
+    run_count += i == 0 || line_levels[i] != line_levels[i - 1];
+  
+  state = (State *)malloc(sizeof(State) + run_count * (sizeof(State::Run) + sizeof(uint32_t)));
+  state->line_start = line_start;
+  state->length = uint32_t(length);
+  state->run_count = uint32_t(run_count);
+  State::Run *run = state->runs() - 1;
+  for (uint32_t i = 0; i < length; ++i) {
+    if (i == 0 || line_levels[i] != line_levels[i - 1])
+      *++run = State::Run { i, 0, 0, line_levels[i] };
+    ++run->length;
+  }
+  uint32_t *visual_order = state->visual_order();
+  for (uint32_t r = 0; r < run_count; ++r) {
+    State::Run &run = state->runs()[r];
+    run.visual_start = uint32_t(logical_to_visual[(run.level & 1) ? run.logical_start + run.length - 1 : run.logical_start]);
+    visual_order[r] = r;
+  }
+  State::Run *runs = state->runs();
+  std::sort(visual_order, visual_order + run_count, [runs](const uint32_t a, const uint32_t b) { return runs[a].visual_start < runs[b].visual_start; });
+}
+
+Bidi::VisualMap::VisualMap(VisualMap &&other): state(other.state) {
+  other.state = nullptr;
+}
+
+VisualMap &Bidi::VisualMap::operator=(VisualMap &&other) {
+  std::swap(state, other.state);
+  return *this;
+}
+
+Bidi::VisualMap::~VisualMap() {
+  free(state);
+}
+
+size_t Bidi::VisualMap::LineStart() const { return state->line_start; }
+size_t Bidi::VisualMap::Length() const { return state->length; }
+size_t Bidi::VisualMap::RunCount() const { return state->run_count; }
+
+size_t Bidi::VisualMap::LogicalToVisual(const size_t index) const {
+  if (index - state->line_start >= state->length) // before the line too, as the difference wraps
+    return None;
+  const uint32_t i = uint32_t(index - state->line_start);
+  const State::Run &run = state->runs()[state->run_at(i)];
+  return (run.level & 1) ? run.visual_start + (run.logical_start + run.length - 1 - i) : run.visual_start + (i - run.logical_start);
+}
+
+size_t Bidi::VisualMap::VisualToLogical(const size_t visual) const {
+  if (visual >= state->length)
+    return None;
+  const State::Run &run = state->visual_run_at(uint32_t(visual));
+  const uint32_t offset = uint32_t(visual) - run.visual_start;
+  return state->line_start + ((run.level & 1) ? run.logical_start + run.length - 1 - offset : run.logical_start + offset);
+}
+
+EmbeddingLevel Bidi::VisualMap::LevelAt(const size_t index) const {
+  if (index - state->line_start >= state->length)
+    return 0;
+  return state->runs()[state->run_at(uint32_t(index - state->line_start))].level;
+}
+
+size_t Bidi::VisualMap::NextVisual(const size_t index, const bool rightward) const {
+  const size_t visual = LogicalToVisual(index);
+  if (visual == None || (rightward ? visual + 1 >= state->length : visual == 0))
+    return None;
+  return VisualToLogical(rightward ? visual + 1 : visual - 1);
+}
+
+size_t Bidi::VisualMap::SelectionRanges(const size_t start, const size_t end, VisualRange *ranges) const {
+  const size_t first = std::max(start, state->line_start), last = std::min(end, state->line_start + state->length); // clipped to the line
+  if (first >= last)
+    return 0;
+  const uint32_t a = uint32_t(first - state->line_start), b = uint32_t(last - state->line_start);
+  size_t count = 0;
+  for (uint32_t r = state->run_at(a); r < state->run_count && state->runs()[r].logical_start < b; ++r) {
+    const State::Run &run = state->runs()[r];
+    const uint32_t run_end = run.logical_start + run.length;
+    const uint32_t s = std::max(a, run.logical_start), e = std::min(b, run_end);
+    ranges[count++] = VisualRange { (run.level & 1) ? run.visual_start + (run_end - e) : run.visual_start + (s - run.logical_start), e - s };
+  }
+  std::sort(ranges, ranges + count, [](const VisualRange &x, const VisualRange &y) { return x.visual_start < y.visual_start; });
+  size_t joined = 0;
+  for (size_t k = 0; k < count; ++k) {
+    if (joined > 0 && ranges[joined - 1].visual_start + ranges[joined - 1].length == ranges[k].visual_start)
+      ranges[joined - 1].length += ranges[k].length;
+    else
+      ranges[joined++] = ranges[k];
+  }
+  return joined;
+}
+
+struct Bidi::Context::State {
+  Arena results; // for Run() and RunLevelRuns(): the scratch buffer, then the levels
+  Arena runs; // for RunLevelRuns(), apart so it can grow once the number of runs is known
+  Arena line; // for ReorderLine(), apart so it can take the levels from Run()
+  size_t retained_capacity;
+};
+
+Bidi::Context::Context(const size_t retained_capacity): state(new State) {
+  state->retained_capacity = retained_capacity;
+}
+
+Bidi::Context::~Context() {
+  delete state;
+}
+
+const EmbeddingLevel *Bidi::Context::Run(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level) {
+  const size_t scratch_size = aligned_size(ScratchBufferSize(length));
+  uint8_t *memory = (uint8_t *)state->results.reserve(scratch_size + length * sizeof(EmbeddingLevel), state->retained_capacity);
+  EmbeddingLevel *levels = (EmbeddingLevel *)(memory + scratch_size);
+  Bidi::Run(text, length, base_direction, resolved_paragraph_embedding_level, levels, memory);
+  return levels;
+}
 
-  void run(const Codepoint *_text, const size_t _length, const BaseDirection base_direction, Metadata *_metadata, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels);
+template<typename Unit> static const EmbeddingLevel *run_in_context(Arena &arena, const size_t retained_capacity, const Unit *text, const size_t length, const BaseDirection base_direction,
+                                                                    EmbeddingLevel &resolved_paragraph_embedding_level, const LevelsFor levels_for, size_t &level_count) {
+  const size_t scratch_size = aligned_size(ScratchBufferSize(length));
+  uint8_t *memory = (uint8_t *)arena.reserve(scratch_size + length * sizeof(EmbeddingLevel), retained_capacity);
+  EmbeddingLevel *levels = (EmbeddingLevel *)(memory + scratch_size);
+  level_count = Bidi::Run(text, length, base_direction, resolved_paragraph_embedding_level, levels, levels_for, memory);
+  return levels;
+}
 
-  struct IsolatingRunSequenceIterator;
-  void Initializaton();
-  void The_Paragraph_Level(const BaseDirection base_direction);
-  void Explicit_Levels_and_Directions();
-  void Preparations_for_Implicit_Processing();
-  void Resolving_Isolating_Run_Sequences();
-  void Resolving_Weak_Types(IsolatingRunSequenceIterator &iterator);
-  void Resolving_Neutral_and_Isolate_Formatting_Types(IsolatingRunSequenceIterator &iterator);
-  void Resolving_Implicit_Levels(IsolatingRunSequenceIterator &iterator);
-  
-  Bidi_Class embedding_direction_for_embedding_level(EmbeddingLevel level) const;
-  int irs_skip_ignores(int i, const int direction) const;
-  int irs_step(EmbeddingLevel irs_embedding_level, int i, const int direction, int &did_jump, EmbeddingLevel &found_bordering_level) const;
-  void assign_bracket_pairs(const int irs_start);
-  void append_next_isolating_run_sequence(int head, int next);
-  void prepare_isolating_run_sequence(int irs_start);
-  EmbeddingLevel paragraph_embedding_level_for_strong_character_index(const int first_strong_index) const;
-  int find_first_strong_index(const int irs_start, const int end_index) const;
+const EmbeddingLevel *Bidi::Context::Run(const uint16_t *utf16, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, const LevelsFor levels_for, size_t &level_count) {
+  return run_in_context(state->results, state->retained_capacity, utf16, length, base_direction, resolved_paragraph_embedding_level, levels_for, level_count);
+}
+
+const EmbeddingLevel *Bidi::Context::Run(const uint8_t *utf8, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, const LevelsFor levels_for, size_t &level_count) {
+  return run_in_context(state->results, state->retained_capacity, utf8, length, base_direction, resolved_paragraph_embedding_level, levels_for, level_count);
+}
+
+const ResolvedLevelRun *Bidi::Context::RunLevelRuns(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, size_t &run_count) {
+  // most paragraphs have a handful of runs, so the runs start out with room for Initial_Run_Capacity (or whatever an earlier text left) rather than one per character
+  const size_t Initial_Run_Capacity = 64;
+  void *scratch_buffer = state->results.reserve(LevelRunsScratchBufferSize(length), state->retained_capacity);
+  ResolvedLevelRun *runs = (ResolvedLevelRun *)state->runs.reserve(std::min(length, Initial_Run_Capacity) * sizeof(ResolvedLevelRun), state->retained_capacity);
+  run_count = run_level_runs_for_length(text, length, base_direction, resolved_paragraph_embedding_level, runs, state->runs.capacity / sizeof(ResolvedLevelRun), scratch_buffer, [&](const size_t count) {
+    runs = (ResolvedLevelRun *)state->runs.reserve(count * sizeof(ResolvedLevelRun), state->retained_capacity);
+    return runs;
+  });
+  return runs;
+}
+
+Bidi::Context::Line Bidi::Context::ReorderLine(const Codepoint *text, const EmbeddingLevel *resolved_embedding_levels, const EmbeddingLevel paragraph_embedding_level, const size_t line_start, const size_t line_end) {
+  const size_t length = line_end - line_start;
+  size_t *maps = (size_t *)state->line.reserve(length * (2 * sizeof(size_t) + sizeof(EmbeddingLevel)), state->retained_capacity);
+  Line line = { (EmbeddingLevel *)(maps + 2 * length), maps, maps + length };
+  Bidi::ReorderLine(text, resolved_embedding_levels, paragraph_embedding_level, line_start, line_end, (EmbeddingLevel *)line.line_levels, maps, maps + length);
+  return line;
+}
+
+size_t Bidi::Context::Capacity() const {
+  return state->results.capacity + state->runs.capacity + state->line.capacity;
+}
+
+void Bidi::Context::Trim() {
+  state->results.release();
+  state->runs.release();
+  state->line.release();
+}
+
+Context &Bidi::ThreadContext() {
+  thread_local Context context;
+  return context;
+}
+
+struct Bidi::RunCache::State {
+  struct CachedRun {
+    uint32_t length;
+    EmbeddingLevel level;
+  };
+  struct Entry { // one block with the text and its runs after it
+    Entry *newer, *older; // in the order of use within the shard
+    uint64_t hash;
+    size_t length, run_count, bytes;
+    BaseDirection base_direction;
+    EmbeddingLevel paragraph_embedding_level;
+    
+    Codepoint *text() { return (Codepoint *)(this + 1); }
+    CachedRun *runs() { return (CachedRun *)(text() + length); }
+  };
+  static const size_t Index_Bytes = 64; // about what the index takes per entry, counted against the limit with the entry
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_multimap<uint64_t, Entry *> index;
+    Entry *newest = nullptr, *oldest = nullptr;
+    size_t bytes = 0;
+    uint64_t hits = 0, misses = 0, evictions = 0;
+    
+    void unlink(Entry *entry) {
+      (entry->newer ? entry->newer->older : newest) = entry->older;
+      (entry->older ? entry->older->newer : oldest) = entry->newer;
+    }
+    void link_newest(Entry *entry) {
+      entry->newer = nullptr;
+      entry->older = newest;
+      (newest ? newest->newer : oldest) = entry;
+      newest = entry;
+    }
+    Entry *find(const uint64_t hash, const Codepoint *text, const size_t length, const BaseDirection base_direction) {
+      auto range = index.equal_range(hash);
+      for (auto it = range.first; it != range.second; ++it) {
+        Entry *entry = it->second;
+        if (entry->length == length && entry->base_direction == base_direction && memcmp(entry->text(), text, length * sizeof(Codepoint)) == 0)
+          return entry;
+      }
+      return nullptr;
+    }
+    void remove(Entry *entry) {
+      auto range = index.equal_range(entry->hash);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == entry) {
+          index.erase(it);
+          break;
+        }
+      }
+      unlink(entry);
+      bytes -= entry->bytes;
+      free(entry);
+    }
+    void clear() {
+      while (oldest)
+        remove(oldest);
+    }
+  };
+  std::vector<Shard> shards;
+  size_t shard_limit;
   
-  #if UAX_BIDI_ENABLE_DEBUG_TRACE
-  #define DEBUG_TRACE(...) trace(__VA_ARGS__)
-  bool debug_trace = false;
-  void trace(const char *step, bool headers) const;
-  #else
-  #define DEBUG_TRACE(...)
-  #endif
+  State(const unsigned shard_count): shards(shard_count) {}
+  Shard &shard(const uint64_t hash) { return shards[(hash >> 32) % shards.size()]; }
 };
 
-static const EmbeddingLevel EMBEDDING_LEVEL_IGNORE = 255;
-static const EmbeddingLevel MAX_DEPTH = 125;
+static uint64_t hash_text(const Codepoint *text, const size_t length, const BaseDirection base_direction) { // two codepoints per multiply
+  const uint64_t Multiplier = 0xFF51AFD7ED558CCDull;
+  uint64_t hash = (((uint64_t)length << 2) | (uint64_t)base_direction) * 0x9E3779B97F4A7C15ull;
+  size_t i = 0;
+  for (; i + 2 <= length; i += 2) {
+    uint64_t pair;
+    memcpy(&pair, &text[i], sizeof(pair));
+    hash = (hash ^ pair) * Multiplier;
+    hash ^= hash >> 32;
+  }
+  if (i < length) {
+    hash = (hash ^ text[i]) * Multiplier;
+    hash ^= hash >> 32;
+  }
+  return hash ^ (hash >> 29);
+}
 
-bool Bidi::RequiresAlgorithm(const Codepoint *text, const size_t length) {
-  for (int i = 0; i < (int)length; ++i) {
-    switch (Get_Bidi_Class(text[i])) {
-      case Bidi_Class::Right_To_Left:
-      case Bidi_Class::Right_To_Left_Embedding:
-      case Bidi_Class::Right_To_Left_Override:
-      case Bidi_Class::Right_To_Left_Isolate:
-      case Bidi_Class::Arabic_Letter:
-        return true;
-      default:
-        break;
+Bidi::RunCache::RunCache(const size_t memory_limit, const unsigned shard_count): state(new State(std::max(1u, shard_count))) {
+  state->shard_limit = memory_limit / state->shards.size();
+}
+
+Bidi::RunCache::~RunCache() {
+  Clear();
+  delete state;
+}
+
+void Bidi::RunCache::Run(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels) {
+  typedef State::Entry Entry;
+  const uint64_t hash = hash_text(text, length, base_direction);
+  State::Shard &shard = state->shard(hash);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (Entry *entry = shard.find(hash, text, length, base_direction)) {
+      ++shard.hits;
+      shard.unlink(entry);
+      shard.link_newest(entry);
+      resolved_paragraph_embedding_level = entry->paragraph_embedding_level;
+      EmbeddingLevel *levels = resolved_embedding_levels;
+      for (const State::CachedRun *run = entry->runs(), *end = run + entry->run_count; run < end; levels += run->length, ++run)
+        memset(levels, run->level, run->length);
+      return;
     }
+    ++shard.misses;
   }
-  return false;
+  
+  // resolved outside the lock, so other threads can look up meanwhile; if one of them resolved the same text first, that entry stays
+  Bidi::Run(text, length, base_direction, resolved_paragraph_embedding_level, resolved_embedding_levels, thread_scratch_buffer(ScratchBufferSize(length)));
+  size_t run_count = 0;
+  for (size_t i = 0; i < length; ++i)
+    run_count += i == 0 || resolved_embedding_levels[i] != resolved_embedding_levels[i - 1];
+  const size_t bytes = sizeof(Entry) + length * sizeof(Codepoint) + run_count * sizeof(State::CachedRun) + State::Index_Bytes;
+  if (bytes > state->shard_limit || length > UINT32_MAX)
+    return;
+  Entry *entry = (Entry *)malloc(bytes - State::Index_Bytes);
+  entry->hash = hash;
+  entry->length = length;
+  entry->run_count = run_count;
+  entry->bytes = bytes;
+  entry->base_direction = base_direction;
+  entry->paragraph_embedding_level = resolved_paragraph_embedding_level;
+  memcpy(entry->text(), text, length * sizeof(Codepoint));
+  State::CachedRun *run = entry->runs() - 1;
+  for (size_t i = 0; i < length; ++i) {
+    if (i == 0 || resolved_embedding_levels[i] != resolved_embedding_levels[i - 1])
+      *++run = State::CachedRun { 0, resolved_embedding_levels[i] };
+    ++run->length;
+  }
+  
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (shard.find(hash, text, length, base_direction)) {
+    free(entry);
+    return;
+  }
+  while (shard.bytes + bytes > state->shard_limit) {
+    shard.remove(shard.oldest);
+    ++shard.evictions;
+  }
+  shard.index.insert(std::make_pair(hash, entry));
+  shard.link_newest(entry);
+  shard.bytes += bytes;
 }
 
-size_t Bidi::ScratchBufferSize(const size_t text_length) {
-  return text_length * sizeof(BidiAlgorithm::Metadata);
+void Bidi::RunCache::Clear() {
+  for (State::Shard &shard : state->shards) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.clear();
+  }
 }
 
-void Bidi::Run(const Codepoint *text, const size_t length, const BaseDirection base_direction, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *resolved_embedding_levels, void *scratch_buffer
-#if UAX_BIDI_ENABLE_DEBUG_TRACE
-               , bool debug_trace
-#endif
-               ) {
-  BidiAlgorithm a;
-  #if UAX_BIDI_ENABLE_DEBUG_TRACE
-  a.debug_trace = debug_trace;
-  #endif
-  a.run(text, length, base_direction, (BidiAlgorithm::Metadata *)scratch_buffer, resolved_paragraph_embedding_level, resolved_embedding_levels);
+RunCache::Counters Bidi::RunCache::GetCounters() const {
+  Counters counters = Counters();
+  for (State::Shard &shard : state->shards) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    counters.hits += shard.hits;
+    counters.misses += shard.misses;
+    counters.evictions += shard.evictions;
+    counters.entries += shard.index.size();
+    counters.bytes += shard.bytes;
+  }
+  return counters;
 }
 
-void BidiAlgorithm::run(const uint32_t *_text, const size_t _length, const BaseDirection base_direction, Metadata *_metadata, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *_resolved_embedding_levels) {
+template<typename Index> template<typename Unit> void BidiAlgorithm<Index>::run(const Unit *_text, const size_t _length, const BaseDirection base_direction, void *scratch_buffer, EmbeddingLevel &resolved_paragraph_embedding_level, EmbeddingLevel *_resolved_embedding_levels, const LevelsFor levels_for) {
+  length = 0;
   if (_length < 1) {
     resolved_paragraph_embedding_level = 0;
     return;
   }
   text = _text;
-  length = _length;
-  metadata = _metadata;
-  resolved_embedding_levels = _resolved_embedding_levels;
-  Initializaton();
-  The_Paragraph_Level(base_direction);    DEBUG_TRACE("Initializaton+The_Paragraph_Level", true);
-  Explicit_Levels_and_Directions();       DEBUG_TRACE("Explicit_Levels_and_Directions", false);
-  Preparations_for_Implicit_Processing(); DEBUG_TRACE("Preparations_for_Implicit_Processing", false);
-  Resolving_Isolating_Run_Sequences();    DEBUG_TRACE("Resolving_Isolating_Run_Sequences", false);
+  code_unit_count = _length;
+  code_unit_size = sizeof(Unit);
+  use_scratch_buffer(scratch_buffer, Index(_length)); // one character per code unit at most
+  resolved_embedding_levels = _resolved_embedding_levels ? _resolved_embedding_levels : run_levels; // without them (for RunLevelRuns()) X1-X9 keep theirs where X10 compacts them into the run levels
+  Initializaton(_text);                   PHASE_LAP(Initializaton);
+  The_Paragraph_Level(base_direction);    PHASE_LAP(The_Paragraph_Level); DEBUG_TRACE("Initializaton+The_Paragraph_Level", true);
+  ThreadRunCounters &counters = this_thread_run_counters;
+  ThreadRunCounters::bump(counters.runs);
+  if (has_brackets)
+    ThreadRunCounters::bump(counters.bracket_pairings);
+  if (!has_explicit_formatting) { // X1-X10 leave every character at the paragraph level and in one isolating run sequence, and remove nothing
+    ThreadRunCounters::bump(counters.single_level_runs);
+    prepare_single_level_run();                                   PHASE_LAP(X10);
+    if (explicit_structure)
+      record_explicit_structure();
+    Resolving_Isolating_Run_Sequence(isolating_run_sequence(0));  DEBUG_TRACE("Resolving_Isolating_Run_Sequences", false);
+  } else {
+    Explicit_Levels_and_Directions();       PHASE_LAP(Explicit_Levels_and_Directions); DEBUG_TRACE("Explicit_Levels_and_Directions", false);
+    Preparations_for_Implicit_Processing(); PHASE_LAP(X9);                             DEBUG_TRACE("Preparations_for_Implicit_Processing", false);
+    Resolving_Isolating_Run_Sequences();                                               DEBUG_TRACE("Resolving_Isolating_Run_Sequences", false);
+  }
+  if (_resolved_embedding_levels) {
+    Resolving_Implicit_Levels();                                                       DEBUG_TRACE("Resolving_Implicit_Levels", false);
+  }
   resolved_paragraph_embedding_level = paragraph_embedding_level;
+  if (levels_for == LevelsFor::CodeUnits && sizeof(Unit) < sizeof(Codepoint))
+    spread_levels_over_code_units();
+  PHASE_LAP(I);
+  PHASE_COUNT(isolating_run_sequences, isolating_run_sequence_count);
+}
+
+template<typename Index> void BidiAlgorithm<Index>::run_sequence(const ClassifiedText *_text, const size_t _length, const EmbeddingLevel level, const EmbeddingLevel level_before, const EmbeddingLevel level_after, void *scratch_buffer, EmbeddingLevel *_resolved_embedding_levels) {
+  // W1-I2 for one isolating run sequence on its own, for EditableParagraph: the text is its characters as X1-X9 left them, at 'level', with an initiator and the PDI it
+  // steps over to next to each other; the levels before and after it are of the characters next to it in the paragraph, for sos and eos as isolating_run_sequence() finds them
+  length = 0;
+  if (_length < 1)
+    return;
+  text = _text;
+  code_unit_count = _length;
+  code_unit_size = 0;
+  use_scratch_buffer(scratch_buffer, Index(_length));
+  resolved_embedding_levels = _resolved_embedding_levels;
+  Initializaton(_text); // pairs up the initiators and PDIs for W4, which waits past them
+  paragraph_embedding_level = level;
+  prepare_single_level_run();
+  Resolving_Isolating_Run_Sequence(IsolatingRunSequence { 0, embedding_direction_for_embedding_level(std::max(level, level_before)), embedding_direction_for_embedding_level(std::max(level, level_after)) });
+  Resolving_Implicit_Levels();
+}
+
+template<typename Index> void BidiAlgorithm<Index>::use_scratch_buffer(void *scratch_buffer, const Index capacity) {
+  // the arrays with the widest elements first so that each is aligned, all sized for the worst case of one level run per character (and the one after the last)
+  matching_indices = (Index *)scratch_buffer;
+  run_starts = matching_indices + capacity;
+  run_next = run_starts + capacity + 1;
+  level_run_count = 0;
+  isolating_run_sequence_count = 0;
+  bidi_classes = (Bidi_Class *)(run_next + capacity);
+  flags = (Flags *)(bidi_classes + capacity);
+  run_levels = (EmbeddingLevel *)(flags + capacity);
 }
 
-#define BIDI_CLASS(I) metadata[I].bidi_class
+#define BIDI_CLASS(I) bidi_classes[I]
 #define EMBEDDING_LEVEL(I) resolved_embedding_levels[I]
-#define MATCHING_INDEX(I) metadata[I].matching_index
-#define IS_ISOLATE_BRIDGE(I) metadata[I].is_isolate_bridge
-#define NEXT_ISOLATING_RUN_SEQUENCE(I) metadata[I].next_isolating_run_sequence
-#define SOS(I) metadata[I].sos
-#define EOS(I) metadata[I].eos
+#define MATCHING_INDEX(I) matching_indices[I]
+#define IS_ISOLATE_BRIDGE(I) flags[I].is_isolate_bridge
 #define IGNORE_BY_X9(I) (BIDI_CLASS(I) == Bidi_Class::Boundary_Neutral)
+#define REMOVED_BY_X9(I) (EMBEDDING_LEVEL(I) == EMBEDDING_LEVEL_IGNORE)
+#define IS_OPEN_BRACKET(I) flags[I].is_open_bracket
+#define IS_CLOSE_BRACKET(I) flags[I].is_close_bracket
+#define IS_OVERRIDDEN(I) flags[I].is_overridden
+#define ENCLOSES_STRONG_L(I) flags[I].encloses_strong_l
+#define ENCLOSES_STRONG_R(I) flags[I].encloses_strong_r
 
-void BidiAlgorithm::Initializaton() {
-  int initiators[MAX_DEPTH];
+template<typename Index> template<typename Unit> void BidiAlgorithm<Index>::Initializaton(const Unit *text) {
+  static_assert(sizeof(Bidi_Class) == 1 && sizeof(Flags) == 1, "classes and flags are byte streams");
+  classify(text);
+  Index initiators[MAX_DEPTH];
   int count = 0;
   int overflow = 0;
-  for (int i = 0; i < length; ++i) {
-    BIDI_CLASS(i) = Get_Bidi_Class(text[i]);
+  Index isolate_count = 0;
+  has_explicit_formatting = false;
+  has_brackets = false;
+  for (Index i = 0; i < length; ++i) {
     EMBEDDING_LEVEL(i) = 0;
-    IS_ISOLATE_BRIDGE(i) = 0;
-    MATCHING_INDEX(i) = -1;
-    NEXT_ISOLATING_RUN_SEQUENCE(i) = -1;
-    if (Is_Isolate_Initiator(BIDI_CLASS(i))) {
+    switch (BIDI_CLASS(i)) {
+      case Bidi_Class::Right_To_Left_Embedding:
+      case Bidi_Class::Left_To_Right_Embedding:
+      case Bidi_Class::Right_To_Left_Override:
+      case Bidi_Class::Left_To_Right_Override:
+      case Bidi_Class::Pop_Directional_Format:
+      case Bidi_Class::Right_To_Left_Isolate:
+      case Bidi_Class::Left_To_Right_Isolate:
+      case Bidi_Class::First_Strong_Isolate:
+      case Bidi_Class::Pop_Directional_Isolate:
+      case Bidi_Class::Boundary_Neutral:
+        has_explicit_formatting = true;
+        break;
+      default:
+        break;
+    }
+    if (BIDI_CLASS(i) == Bidi_Class::Other_Neutral) {
+      has_brackets |= IS_OPEN_BRACKET(i) || IS_CLOSE_BRACKET(i);
+    } else if (Is_Isolate_Initiator(BIDI_CLASS(i))) {
       if (count < MAX_DEPTH) {
         initiators[count] = i;
         ++count;
@@ -134,6 +1932,7 @@ void BidiAlgorithm::Initializaton() {
         --overflow;
       } else {
         if (count > 0) {
+          ++isolate_count;
           IS_ISOLATE_BRIDGE(i) = 1;
           IS_ISOLATE_BRIDGE(initiators[count - 1]) = 1;
           MATCHING_INDEX(i) = initiators[count - 1];
@@ -143,18 +1942,107 @@ void BidiAlgorithm::Initializaton() {
       }
     }
   }
+  PHASE_COUNT(isolates, isolate_count);
+}
+
+static inline Codepoint next_codepoint(const uint8_t *text, const size_t length, size_t &i) { return Next_UTF8(text, length, i); }
+static inline Codepoint next_codepoint(const uint16_t *text, const size_t length, size_t &i) { return Next_UTF16(text, length, i); }
+static inline Codepoint next_codepoint(const Codepoint *text, const size_t /*length*/, size_t &i) { return text[i++]; }
+
+template<typename Index> void BidiAlgorithm<Index>::classify(const Codepoint *text) {
+  length = Index(code_unit_count);
+  Classify_Bidi(text, length, bidi_classes);
+  for (Index i = 0; i < length; ++i) {
+    MATCHING_INDEX(i) = None;
+    flags[i] = Flags();
+    if (BIDI_CLASS(i) == Bidi_Class::Other_Neutral) // brackets are a proper subset of ONs
+      classify_bracket(i, text[i], Get_Properties(text[i]).bidi_paired_bracket_type);
+  }
+}
+
+template<typename Index> void BidiAlgorithm<Index>::classify(const ClassifiedText *text) {
+  length = Index(code_unit_count);
+  memcpy(bidi_classes, text->classes, length * sizeof(Bidi_Class));
+  for (Index i = 0; i < length; ++i) {
+    MATCHING_INDEX(i) = None;
+    flags[i] = Flags();
+    if (text->brackets && BIDI_CLASS(i) == Bidi_Class::Other_Neutral)
+      set_bracket(i, text->brackets[i]);
+  }
+}
+
+template<typename Index> template<typename Unit> void BidiAlgorithm<Index>::classify(const Unit *text) { // UTF-8 and UTF-16, decoded here and not looked at again
+  // a block at a time into a buffer on the stack, so that Classify_Bidi() can still take many codepoints at once
+  const size_t Block_Length = 256;
+  Codepoint block[Block_Length];
+  Index i = 0;
+  for (size_t u = 0; u < code_unit_count; ) {
+    Index n = 0;
+    for (; n < Block_Length && u < code_unit_count; ++n) {
+      size_t start = u;
+      block[n] = next_codepoint(text, code_unit_count, u);
+      flags[i + n] = Flags();
+      flags[i + n].code_units = uint8_t(u - start - 1);
+    }
+    Classify_Bidi(block, n, &bidi_classes[i]);
+    for (Index k = 0; k < n; ++k, ++i) {
+      MATCHING_INDEX(i) = None;
+      if (BIDI_CLASS(i) == Bidi_Class::Other_Neutral)
+        classify_bracket(i, block[k], Get_Properties(block[k]).bidi_paired_bracket_type);
+    }
+  }
+  length = i;
+}
+
+static inline BracketInfo bracket_info(const Codepoint code, const Bidi_Paired_Bracket_Type bracket_type) {
+  // BD16 needs no more of a bracket than which others it pairs with, so each gets a key -- the opening bracket of its pair -- to stand in for its codepoint.
+  // http://www.unicode.org/L2/L2013/13123-norm-and-bpa.pdf also pairs U+2329 with U+3009 and U+3008 with U+232A, which is U+2329 and U+3008 sharing a key
+  if (bracket_type == Bidi_Paired_Bracket_Type::None)
+    return BracketInfo { bracket_type, 0 };
+  Bidi_Paired_Bracket_Type paired_bracket_type;
+  Codepoint key = bracket_type == Bidi_Paired_Bracket_Type::Open ? code : Get_Bidi_Paired_Bracket(code, paired_bracket_type);
+  if (key == 0x2329)
+    key = 0x3008;
+  return BracketInfo { bracket_type, key };
+}
+
+BracketInfo Bidi::GetBracketInfo(const Codepoint code) {
+  return bracket_info(code, Get_Properties(code).bidi_paired_bracket_type);
+}
+
+template<typename Index> void BidiAlgorithm<Index>::classify_bracket(const Index i, const Codepoint code, const Bidi_Paired_Bracket_Type bracket_type) {
+  if (bracket_type != Bidi_Paired_Bracket_Type::None)
+    set_bracket(i, bracket_info(code, bracket_type));
+}
+
+template<typename Index> void BidiAlgorithm<Index>::set_bracket(const Index i, const BracketInfo bracket) {
+  IS_OPEN_BRACKET(i) = bracket.type == Bidi_Paired_Bracket_Type::Open;
+  IS_CLOSE_BRACKET(i) = bracket.type == Bidi_Paired_Bracket_Type::Close;
+  if (!IS_OPEN_BRACKET(i) && !IS_CLOSE_BRACKET(i))
+    return;
+  assert(bracket.pair < None); // all brackets are in the BMP
+  MATCHING_INDEX(i) = Index(bracket.pair);
+}
+
+template<typename Index> void BidiAlgorithm<Index>::spread_levels_over_code_units() { // from one level per codepoint to one per code unit, from the end so as not to overwrite levels yet to be read
+  size_t u = code_unit_count;
+  for (Index i = length; i-- > 0; ) {
+    EmbeddingLevel level = EMBEDDING_LEVEL(i);
+    for (size_t n = flags[i].code_units + 1; n > 0; --n)
+      resolved_embedding_levels[--u] = level;
+  }
 }
 
-void BidiAlgorithm::The_Paragraph_Level(const BaseDirection base_direction) {
+template<typename Index> void BidiAlgorithm<Index>::The_Paragraph_Level(const BaseDirection base_direction) {
   switch (base_direction) {
-    case BaseDirection::Auto:  paragraph_embedding_level = paragraph_embedding_level_for_strong_character_index(find_first_strong_index(0, int(length)-1)); break; // P2, P3
+    case BaseDirection::Auto:  paragraph_embedding_level = paragraph_embedding_level_for_strong_character_index(find_first_strong_index(0, length - 1)); break; // P2, P3
     case BaseDirection::Left:  paragraph_embedding_level = 0; break; // HL1 override
     case BaseDirection::Right: paragraph_embedding_level = 1; break; // HL1 override
     default: paragraph_embedding_level = 0; break;
   }
 }
 
-void BidiAlgorithm::Explicit_Levels_and_Directions() { // 3.3.2
+template<typename Index> void BidiAlgorithm<Index>::Explicit_Levels_and_Directions() { // 3.3.2
   enum class DirectionalOverrideStatus {
     Neutral,
     RightToLeft,
@@ -166,8 +2054,8 @@ void BidiAlgorithm::Explicit_Levels_and_Directions() { // 3.3.2
       DirectionalOverrideStatus directional_override_status;
       bool directional_isolate_status;
     } stack[MAX_DEPTH + 2];
-    int count;
-    inline void set_empty() { count = 0; }
+    int count, max_count;
+    inline void set_empty() { count = max_count = 0; }
     inline const Item &top() const { return stack[count - 1]; }
     inline EmbeddingLevel next_embedding_level(int even_odd) const { // even_odd: 0=even, 1=odd
       int n = top().embedding_level;
@@ -181,6 +2069,7 @@ void BidiAlgorithm::Explicit_Levels_and_Directions() { // 3.3.2
         .directional_isolate_status = directional_isolate_status,
       };
       ++count;
+      max_count = std::max(max_count, count);
     }
     inline void pop() {
       assert(count > 0);
@@ -196,7 +2085,7 @@ void BidiAlgorithm::Explicit_Levels_and_Directions() { // 3.3.2
 
   #define VALID_EMBEDDING_LEVEL(E) (((E) <= MAX_DEPTH) && (overflow_embedding_count == 0) && (overflow_isolate_count == 0))
 
-  for (int i = 0; i < length; ++i) { // X2-X8
+  for (Index i = 0; i < length; ++i) { // X2-X8
     int even_odd;
     DirectionalOverrideStatus directional_override_status;
     
@@ -224,7 +2113,7 @@ void BidiAlgorithm::Explicit_Levels_and_Directions() { // 3.3.2
         even_odd = 0;
         goto Handle_Isolate;
       case Bidi_Class::First_Strong_Isolate: // X5c
-        if (paragraph_embedding_level_for_strong_character_index(find_first_strong_index(i+1, MATCHING_INDEX(i)-1)) == 1)
+        if ((MATCHING_INDEX(i) != None) && (paragraph_embedding_level_for_strong_character_index(find_first_strong_index(i+1, MATCHING_INDEX(i)-1)) == 1)) // P2 finds nothing for an FSI without a matching PDI
           goto treat_FSI_as_RLI;
         else
           goto treat_FSI_as_LRI;
@@ -233,8 +2122,8 @@ void BidiAlgorithm::Explicit_Levels_and_Directions() { // 3.3.2
         EMBEDDING_LEVEL(i) = directional_status_stack.top().embedding_level;
         switch (directional_status_stack.top().directional_override_status) {
           case DirectionalOverrideStatus::Neutral: break; // do nothing
-          case DirectionalOverrideStatus::LeftToRight: BIDI_CLASS(i) = Bidi_Class::Left_To_Right; break; // override character type
-          case DirectionalOverrideStatus::RightToLeft: BIDI_CLASS(i) = Bidi_Class::Right_To_Left; break; // override character type
+          case DirectionalOverrideStatus::LeftToRight: BIDI_CLASS(i) = Bidi_Class::Left_To_Right; IS_OVERRIDDEN(i) = 1; break; // override character type
+          case DirectionalOverrideStatus::RightToLeft: BIDI_CLASS(i) = Bidi_Class::Right_To_Left; IS_OVERRIDDEN(i) = 1; break; // override character type
         }
         break;
         
@@ -290,15 +2179,21 @@ void BidiAlgorithm::Explicit_Levels_and_Directions() { // 3.3.2
           ++valid_isolate_count;
         } else {
           ++overflow_isolate_count;
+          if (IS_ISOLATE_BRIDGE(i)) { // an isolate that doesn't raise the level is just its characters to the sequence it is in: no level runs end at it (BD7, BD13)
+            IS_ISOLATE_BRIDGE(MATCHING_INDEX(i)) = 0;
+            IS_ISOLATE_BRIDGE(i) = 0;
+          }
         }
         break;
       }
     }
   }
+  if (phase_clock)
+    phase_clock->stats.max_depth = directional_status_stack.max_count - 1;
 }
 
-void BidiAlgorithm::Preparations_for_Implicit_Processing() { // 3.3.3
-  for (int i = 0; i < length; ++i) { // X9
+template<typename Index> void BidiAlgorithm<Index>::Preparations_for_Implicit_Processing() { // 3.3.3
+  for (Index i = 0; i < length; ++i) { // X9
     switch (BIDI_CLASS(i)) {
       case Bidi_Class::Right_To_Left_Embedding:
       case Bidi_Class::Left_To_Right_Embedding:
@@ -315,203 +2210,251 @@ void BidiAlgorithm::Preparations_for_Implicit_Processing() { // 3.3.3
   }
 }
 
-struct BidiAlgorithm::IsolatingRunSequenceIterator {
-  const BidiAlgorithm &bidi;
-  const BidiAlgorithm::Metadata *metadata;
-  const EmbeddingLevel *resolved_embedding_levels;
+template<typename Index> struct BidiAlgorithm<Index>::IsolatingRunSequenceIterator { // visits the characters of one IRS level run by level run, skipping those removed by X9
+  const Bidi_Class *bidi_classes;
+  const Index *run_starts, *run_next;
+  const EmbeddingLevel *run_levels;
   const Bidi_Class sos, eos;
-  const int direction;
-  int index, reset_index;
-  EmbeddingLevel embedding_level;
-  Bidi_Class previous_type, current_type, last_strong_type;
+  const Index first_run;
+  Index run, index, run_end; // run_end is where the characters of 'run' end, those removed by X9 after the last one included
+  EmbeddingLevel embedding_level; // of every level run of the sequence (BD13)
+  Bidi_Class current_type, last_strong_type;
   bool NI_context;
-  IsolatingRunSequenceIterator(const BidiAlgorithm &_bidi, int _index, int _direction, Bidi_Class _sos = Bidi_Class::Left_To_Right, Bidi_Class _eos = Bidi_Class::Left_To_Right): bidi(_bidi), metadata(_bidi.metadata), resolved_embedding_levels(_bidi.resolved_embedding_levels), sos(_sos), eos(_eos), direction(_direction), NI_context(false) {
-    reset_index = bidi.irs_skip_ignores(_index, direction);
+  IsolatingRunSequenceIterator(const BidiAlgorithm &bidi, const IsolatingRunSequence &sequence): bidi_classes(bidi.bidi_classes), run_starts(bidi.run_starts), run_next(bidi.run_next), run_levels(bidi.run_levels), sos(sequence.sos), eos(sequence.eos), first_run(sequence.first_run), NI_context(false) {
     reset();
   }
   void reset() {
-    index = reset_index;
-    if (!end()) {
-      previous_type = sos;
-      last_strong_type = sos;
-      embedding_level = EMBEDDING_LEVEL(index);
-      current_type = BIDI_CLASS(index);
-    }
+    seek(first_run, run_starts[first_run]);
+  }
+  void seek(Index _run, Index _index) { // to a character of the sequence, by the 'run' and 'index' it was seen at before
+    run = _run;
+    index = _index;
+    run_end = run_starts[run + 1];
+    embedding_level = run_levels[run];
+    last_strong_type = sos;
+    current_type = BIDI_CLASS(index);
   }
   bool end() const {
-    return index == -1;
+    return index == None;
   }
-  void next() {
-    if (end()) return;
-    current_type = BIDI_CLASS(index); // current_type may have been mutated after the previous step, grab a fresh one here
+  void step() { // after the character at 'index' has been seen, as it is now
+    current_type = BIDI_CLASS(index);
     if (Is_Strong(current_type))
       last_strong_type = current_type;
     if (NI_context && Is_Strong_in_NI_context(current_type))
       last_strong_type = NI_influencing_direction(current_type);
-    
-    int ignore_jump;
-    EmbeddingLevel ignore_level;
-    index = bidi.irs_step(embedding_level, index, direction, ignore_jump, ignore_level);
+  }
+  void next() {
     if (end()) return;
-    
-    previous_type = current_type;
+    step();
+    do {
+      if (++index == run_end) { // on to the PDI of the isolate the level run ends with, if any
+        run = run_next[run];
+        if (run == None) {
+          index = None;
+          return;
+        }
+        index = run_starts[run];
+        run_end = run_starts[run + 1];
+        break;
+      }
+    } while (IGNORE_BY_X9(index));
     current_type = BIDI_CLASS(index);
   }
-  template<typename F> void each(F f) { // may be called after a next()
-    while (!end()) {
-      if (!f()) break;
-      next();
-    }
-  }
-  template<typename F> void all(F f) {
+  template<typename F> void all(F f) { // next() one span at a time
     reset();
-    each([&]{ f(); return true; });
-  }
-  template<typename F> void lookahead(F f) const {
-    IsolatingRunSequenceIterator iterator(bidi, index, direction, sos, eos);
-    iterator.next(); // step over current
-    iterator.each([&]{ return f(iterator); });
+    for (; run != None; run = run_next[run]) {
+      run_end = run_starts[run + 1];
+      for (index = run_starts[run]; index < run_end; ++index) {
+        current_type = BIDI_CLASS(index);
+        if (current_type == Bidi_Class::Boundary_Neutral) // IGNORE_BY_X9
+          continue;
+        f();
+        step();
+      }
+    }
+    index = None;
   }
 };
 
-void BidiAlgorithm::Resolving_Isolating_Run_Sequences() { // X10
-  int irs_start = 0;
-  do prepare_isolating_run_sequence(irs_start); // will set SOS, EOS and NEXT_ISOLATING_RUN_SEQUENCE
-  while ((irs_start = NEXT_ISOLATING_RUN_SEQUENCE(irs_start)) != -1);
-  
-  irs_start = 0;
-  do {
-    IsolatingRunSequenceIterator iterator(*this, irs_start, +1, SOS(irs_start) ? Bidi_Class::Right_To_Left : Bidi_Class::Left_To_Right, EOS(irs_start) ? Bidi_Class::Right_To_Left : Bidi_Class::Left_To_Right);
-    Resolving_Weak_Types(iterator);                             DEBUG_TRACE("Resolving_Weak_Types", false);
-    Resolving_Neutral_and_Isolate_Formatting_Types(iterator);   DEBUG_TRACE("Resolving_Neutral_and_Isolate_Formatting_Types", false);
-    Resolving_Implicit_Levels(iterator);                        DEBUG_TRACE("Resolving_Implicit_Levels", false);
-  } while ((irs_start = NEXT_ISOLATING_RUN_SEQUENCE(irs_start)) != -1);
-}
-
-void BidiAlgorithm::Resolving_Weak_Types(IsolatingRunSequenceIterator &iterator) { // W1-W7
-  iterator.all([&]{ // W1
-    if (iterator.current_type == Bidi_Class::Nonspacing_Mark) {
-      if (Is_Isolate_Initiator(iterator.previous_type) || (iterator.previous_type == Bidi_Class::Pop_Directional_Isolate)) {
-        BIDI_CLASS(iterator.index) = Bidi_Class::Other_Neutral;
-      } else {
-        BIDI_CLASS(iterator.index) = iterator.previous_type;
+template<typename Index> void BidiAlgorithm<Index>::Resolving_Isolating_Run_Sequences() { // X10
+  prepare_level_runs(); PHASE_LAP(X10);
+  if (explicit_structure)
+    record_explicit_structure();
+  for (Index r = 0; r < level_run_count; ++r) {
+    if (starts_isolating_run_sequence(r))
+      Resolving_Isolating_Run_Sequence(isolating_run_sequence(r));
+  }
+}
+
+template<typename Index> void BidiAlgorithm<Index>::Resolving_Isolating_Run_Sequence(const IsolatingRunSequence &sequence) {
+  IsolatingRunSequenceIterator iterator(*this, sequence);
+  Resolving_Weak_Types(iterator);                             PHASE_LAP(W);     DEBUG_TRACE("Resolving_Weak_Types", false);
+  Resolving_Neutral_and_Isolate_Formatting_Types(iterator);   PHASE_LAP(N1_N2); DEBUG_TRACE("Resolving_Neutral_and_Isolate_Formatting_Types", false);
+}
+
+template<typename Index> void BidiAlgorithm<Index>::Resolving_Weak_Types(IsolatingRunSequenceIterator &iterator) { // W1-W7, in two sweeps
+  // W1-W4. Each rule reads its neighbours as the previous rule left them, so those are tracked per rule. W4 needs the type of the next character that isn't an isolate bridge,
+  // so an ES or CS waits in 'separator' until that character has been through W1-W3
+  Bidi_Class w1_previous_type = iterator.sos;
+  Bidi_Class w2_last_strong_type = iterator.sos;
+  Bidi_Class w4_previous_type = iterator.sos;
+  Index previous_index = None;
+  Index separator = None;
+  Bidi_Class separator_previous_type = iterator.sos;
+  auto resolve_separator = [&](const Bidi_Class next_type) { // W4
+    Bidi_Class type = BIDI_CLASS(separator);
+    if (type == Bidi_Class::European_Separator && separator_previous_type == Bidi_Class::European_Number && next_type == Bidi_Class::European_Number) {
+      type = Bidi_Class::European_Number;
+    } else if (type == Bidi_Class::Common_Separator && separator_previous_type == next_type) { // common separator surrounded by two of the same type
+      if (separator_previous_type == Bidi_Class::European_Number || separator_previous_type == Bidi_Class::Arabic_Number) { // and those sandwiching types are number types
+        type = separator_previous_type;
       }
     }
-  });
-  iterator.all([&]{ // W2
-    if (iterator.current_type == Bidi_Class::European_Number) {
-      if (iterator.last_strong_type == Bidi_Class::Arabic_Letter) {
-        BIDI_CLASS(iterator.index) = Bidi_Class::Arabic_Number;
+    BIDI_CLASS(separator) = type;
+    if (separator == previous_index)
+      w4_previous_type = type;
+    separator = None;
+  };
+  iterator.all([&]{
+    Index i = iterator.index;
+    Bidi_Class type = BIDI_CLASS(i);
+    if (type == Bidi_Class::Nonspacing_Mark) { // W1
+      if (Is_Isolate_Initiator(w1_previous_type) || (w1_previous_type == Bidi_Class::Pop_Directional_Isolate)) {
+        type = Bidi_Class::Other_Neutral;
+      } else {
+        type = w1_previous_type;
       }
     }
-  });
-  iterator.all([&]{ // W3
-    if (iterator.current_type == Bidi_Class::Arabic_Letter) {
-      BIDI_CLASS(iterator.index) = Bidi_Class::Right_To_Left;
+    w1_previous_type = type;
+    if (type == Bidi_Class::European_Number && w2_last_strong_type == Bidi_Class::Arabic_Letter) { // W2
+      type = Bidi_Class::Arabic_Number;
     }
+    if (Is_Strong(type))
+      w2_last_strong_type = type;
+    if (type == Bidi_Class::Arabic_Letter) { // W3
+      type = Bidi_Class::Right_To_Left;
+    }
+    BIDI_CLASS(i) = type;
+    
+    if (separator != None && !IS_ISOLATE_BRIDGE(i))
+      resolve_separator(type);
+    if (type == Bidi_Class::European_Separator || type == Bidi_Class::Common_Separator) {
+      separator = i;
+      separator_previous_type = w4_previous_type;
+    }
+    w4_previous_type = type;
+    previous_index = i;
   });
-  iterator.all([&]{ // W4
-    Bidi_Class next_type = iterator.eos;
-    iterator.lookahead([&](IsolatingRunSequenceIterator &lookahead) {
-      if (!IS_ISOLATE_BRIDGE(lookahead.index)) {
-        next_type = lookahead.current_type;
-        return false; // stop
+  if (separator != None)
+    resolve_separator(iterator.eos);
+  
+  // W5-W7. W5 rewrites the runs of ET on either side of an EN by raw index, so a later EN can still reach back over ETs the sweep has passed. W6 and W7 therefore trail
+  // behind at 'settled' and catch up whenever the sweep reaches something other than ET, which no later W5 run can extend back past
+  IsolatingRunSequenceIterator settled(iterator);
+  settled.reset();
+  Bidi_Class w7_last_strong_type = iterator.sos;
+  auto settle_until = [&](const Index stop) {
+    while (!settled.end() && settled.index != stop) {
+      Index i = settled.index;
+      Bidi_Class type = BIDI_CLASS(i);
+      if (type == Bidi_Class::Common_Separator || type == Bidi_Class::European_Terminator || type == Bidi_Class::European_Separator) { // W6
+        type = Bidi_Class::Other_Neutral;
       }
-      return true;
-    });
-    if (iterator.current_type == Bidi_Class::European_Separator && iterator.previous_type == Bidi_Class::European_Number && next_type == Bidi_Class::European_Number) {
-      BIDI_CLASS(iterator.index) = Bidi_Class::European_Number;
-    } else if (iterator.current_type == Bidi_Class::Common_Separator && iterator.previous_type == next_type) { // common separator surrounded by two of the same type
-      if (iterator.previous_type == Bidi_Class::European_Number || iterator.previous_type == Bidi_Class::Arabic_Number) { // and those sandwiching types are number types
-        BIDI_CLASS(iterator.index) = iterator.previous_type;
+      if (type == Bidi_Class::European_Number && w7_last_strong_type == Bidi_Class::Left_To_Right) { // W7
+        type = Bidi_Class::Left_To_Right;
       }
+      BIDI_CLASS(i) = type;
+      if (Is_Strong(type))
+        w7_last_strong_type = type;
+      settled.next();
     }
-  });
-  iterator.all([&]{ // W5
-    if (iterator.current_type == Bidi_Class::European_Number) {
+  };
+  iterator.all([&]{
+    if (iterator.current_type == Bidi_Class::European_Number) { // W5, within the level run: a run of ETs doesn't go on past the isolate initiator or PDI at either end of it
       auto i = iterator.index;
-      for (int j = i - 1; j >= 0 && ((BIDI_CLASS(j) == Bidi_Class::European_Terminator) || IGNORE_BY_X9(j)); --j)
-        BIDI_CLASS(j) = Bidi_Class::European_Number;
-      for (int j = i + 1; j < length && ((BIDI_CLASS(j) == Bidi_Class::European_Terminator) || IGNORE_BY_X9(j)); ++j)
-        BIDI_CLASS(j) = Bidi_Class::European_Number;
-    }
-  });
-  iterator.all([&]{ // W6
-    if (iterator.current_type == Bidi_Class::Common_Separator || iterator.current_type == Bidi_Class::European_Terminator || iterator.current_type == Bidi_Class::European_Separator) {
-      BIDI_CLASS(iterator.index) = Bidi_Class::Other_Neutral;
-    }
-  });
-  iterator.all([&]{ // W7
-    if (iterator.current_type == Bidi_Class::European_Number && iterator.last_strong_type == Bidi_Class::Left_To_Right) {
-      BIDI_CLASS(iterator.index) = Bidi_Class::Left_To_Right;
+      Index before = i, after = i + 1;
+      for (const Index run_start = run_starts[iterator.run]; before > run_start && ((BIDI_CLASS(before - 1) == Bidi_Class::European_Terminator) || IGNORE_BY_X9(before - 1)); --before) {
+        if (!IGNORE_BY_X9(before - 1))
+          BIDI_CLASS(before - 1) = Bidi_Class::European_Number;
+      }
+      for (; after < iterator.run_end && ((BIDI_CLASS(after) == Bidi_Class::European_Terminator) || IGNORE_BY_X9(after)); ++after) {
+        if (!IGNORE_BY_X9(after))
+          BIDI_CLASS(after) = Bidi_Class::European_Number;
+      }
+      PHASE_COUNT(lookahead_steps, after - 1 - before);
     }
+    if (BIDI_CLASS(iterator.index) != Bidi_Class::European_Terminator)
+      settle_until(iterator.index);
   });
+  settle_until(None);
 }
 
-void BidiAlgorithm::Resolving_Neutral_and_Isolate_Formatting_Types(IsolatingRunSequenceIterator &iterator) { // N0-N2
-  assign_bracket_pairs(iterator.reset_index); // N0
-
+template<typename Index> void BidiAlgorithm<Index>::Resolving_Neutral_and_Isolate_Formatting_Types(IsolatingRunSequenceIterator &iterator) { // N0-N2
   iterator.NI_context = true;
-  iterator.all([&]{
-    int i = iterator.index;    
-    if ((iterator.current_type == Bidi_Class::Other_Neutral) && (MATCHING_INDEX(i) > i)) { // open half of a matched bracket pair (ONs with a matching != -1 can only be brackets)
-      auto open_index = i;
-      auto close_index = MATCHING_INDEX(i);
-      auto embedding_direction = embedding_direction_for_embedding_level(EMBEDDING_LEVEL(i));
-      
-      bool did_find_any_strong_types_within_bracket_pair = false;
-      IsolatingRunSequenceIterator withinbrackets(*this, open_index, +1);
-      withinbrackets.next(); // step past open bracket
-      withinbrackets.each([&]{
-        if (withinbrackets.index >= close_index)
-          return false;
-        if (Is_Strong_in_NI_context(withinbrackets.current_type)) {
-          did_find_any_strong_types_within_bracket_pair = true;
-          if (NI_influencing_direction(withinbrackets.current_type) == embedding_direction) {
-            BIDI_CLASS(open_index) = embedding_direction;
-            BIDI_CLASS(close_index) = embedding_direction;
-            return false;
-          }
-        }
-        return true;
-      });
-      
-      if (BIDI_CLASS(open_index) == Bidi_Class::Other_Neutral) { // withinbrackets iteration didn't set bracket class
-        if (did_find_any_strong_types_within_bracket_pair) {
+  if (has_brackets) { // N0
+    assign_bracket_pairs(iterator);
+    iterator.all([&]{
+      Index i = iterator.index;
+      if ((iterator.current_type == Bidi_Class::Other_Neutral) && (MATCHING_INDEX(i) != None) && (MATCHING_INDEX(i) > i)) { // open half of a matched bracket pair (ONs with a matching index can only be brackets)
+        auto open_index = i;
+        auto close_index = MATCHING_INDEX(i);
+        auto embedding_direction = embedding_direction_for_embedding_level(iterator.embedding_level);
+        bool encloses_embedding_direction = (embedding_direction == Bidi_Class::Left_To_Right) ? ENCLOSES_STRONG_L(open_index) : ENCLOSES_STRONG_R(open_index);
+        bool encloses_opposite_direction = (embedding_direction == Bidi_Class::Left_To_Right) ? ENCLOSES_STRONG_R(open_index) : ENCLOSES_STRONG_L(open_index);
+        Bidi_Class resolved_type;
+        if (encloses_embedding_direction) { // b
+          resolved_type = embedding_direction;
+        } else if (encloses_opposite_direction) {
           if (iterator.last_strong_type != embedding_direction) { // c.1 - last_strong_type is guaranteed to be only L or R at this point (previous rules replaced ALs, and we're using NI_context which will return ENs and ANs as Rs)
-            BIDI_CLASS(open_index) = iterator.last_strong_type;
-            BIDI_CLASS(close_index) = iterator.last_strong_type;
+            resolved_type = iterator.last_strong_type;
           } else { // c.2
-            BIDI_CLASS(open_index) = embedding_direction;
-            BIDI_CLASS(close_index) = embedding_direction;
+            resolved_type = embedding_direction;
           }
         } else {
-          // no strong types within bracket pair - do nothing
+          return; // d - no strong types within bracket pair - do nothing
         }
+        BIDI_CLASS(open_index) = resolved_type;
+        BIDI_CLASS(close_index) = resolved_type;
       }
-    }
-  });
-  DEBUG_TRACE("N0", false);
+    });
+  }
+  PHASE_LAP(N0); DEBUG_TRACE("N0", false);
 
-  iterator.all([&]{ // N1
-    if (Is_Neutral_or_Isolate(iterator.current_type)) {
-      auto next_strong_type = iterator.eos;
-      iterator.lookahead([&](IsolatingRunSequenceIterator &lookahead) {
-        if (Is_Strong_in_NI_context(lookahead.current_type)) {
-          next_strong_type = NI_influencing_direction(lookahead.current_type);
-          return false; // stop
-        }
-        return true;
-      });
-      if (iterator.last_strong_type == next_strong_type)
-        BIDI_CLASS(iterator.index) = next_strong_type;
+  // N1. A run of neutrals takes the direction on both sides of it, so instead of looking ahead from every neutral the run is remembered from 'neutrals' on
+  // and settled in one go once the sweep reaches the strong type after it (or eos). Every character is visited at most twice
+  Index neutrals = None, neutrals_run = None;
+  Bidi_Class neutrals_last_strong_type = iterator.sos;
+  auto settle_neutrals = [&](const Index stop, const Bidi_Class next_strong_type) {
+    if (neutrals == None)
+      return;
+    if (neutrals_last_strong_type == next_strong_type) {
+      IsolatingRunSequenceIterator walk(iterator);
+      walk.seek(neutrals_run, neutrals);
+      Index steps = 0;
+      for (; !walk.end() && walk.index != stop; walk.next(), ++steps) {
+        if (Is_Neutral_or_Isolate(walk.current_type))
+          BIDI_CLASS(walk.index) = next_strong_type;
+      }
+      PHASE_COUNT(lookahead_steps, steps);
+    }
+    neutrals = None;
+  };
+  iterator.all([&]{
+    if (Is_Strong_in_NI_context(iterator.current_type)) {
+      settle_neutrals(iterator.index, NI_influencing_direction(iterator.current_type));
+    } else if (neutrals == None && Is_Neutral_or_Isolate(iterator.current_type)) {
+      neutrals = iterator.index;
+      neutrals_run = iterator.run;
+      neutrals_last_strong_type = iterator.last_strong_type;
     }
   });
+  settle_neutrals(None, iterator.eos);
   DEBUG_TRACE("N1", false);
   
   iterator.all([&]{ // N2
     if (Is_Neutral_or_Isolate(iterator.current_type)) {
-      BIDI_CLASS(iterator.index) = embedding_direction_for_embedding_level(EMBEDDING_LEVEL(iterator.index));
+      BIDI_CLASS(iterator.index) = embedding_direction_for_embedding_level(iterator.embedding_level);
     }
   });
   DEBUG_TRACE("N2", false);
@@ -519,146 +2462,220 @@ void BidiAlgorithm::Resolving_Neutral_and_Isolate_Formatting_Types(IsolatingRunS
   iterator.NI_context = false;
 }
 
-void BidiAlgorithm::Resolving_Implicit_Levels(IsolatingRunSequenceIterator &iterator) { // I1-I2
-  iterator.all([&]{
-    if (EMBEDDING_LEVEL(iterator.index) & 1) { // odd embedding level
-      switch (iterator.current_type) {
-        case Bidi_Class::Left_To_Right:
-        case Bidi_Class::European_Number:
-        case Bidi_Class::Arabic_Number:
-          EMBEDDING_LEVEL(iterator.index) += 1;
-          break;
-        default:
-          break;
-      }
-    } else { // even embedding level
-      switch (iterator.current_type) {
-        case Bidi_Class::Right_To_Left:
-          EMBEDDING_LEVEL(iterator.index) += 1;
-          break;
-        case Bidi_Class::Arabic_Number:
-        case Bidi_Class::European_Number:
-          EMBEDDING_LEVEL(iterator.index) += 2;
-          break;
-        default:
-          break;
-      }
+template<typename Index> void BidiAlgorithm<Index>::Resolving_Implicit_Levels() { // I1-I2, once every sequence is resolved, from the level of each level run
+  for (Index r = 0; r < level_run_count; ++r) {
+    const EmbeddingLevel level = run_levels[r];
+    for (Index i = run_starts[r], end = run_starts[r + 1]; i < end; ++i) {
+      if (!IGNORE_BY_X9(i))
+        EMBEDDING_LEVEL(i) = implicit_level(level, BIDI_CLASS(i));
     }
-  });
-}
-
-Bidi_Class BidiAlgorithm::embedding_direction_for_embedding_level(EmbeddingLevel level) const {
-  return (level & 1) ? Bidi_Class::Right_To_Left : Bidi_Class::Left_To_Right;
+  }
 }
 
-int BidiAlgorithm::irs_skip_ignores(int i, const int direction) const {
-  while ((i >= 0) && (i < length) && IGNORE_BY_X9(i))
-    i += direction;
-  if (i < 0 || i >= length)
-    return -1;
-  return i;
-}
-
-int BidiAlgorithm::irs_step(EmbeddingLevel irs_embedding_level, int i, const int direction, int &did_jump, EmbeddingLevel &found_bordering_level) const {
-  i = irs_skip_ignores(i, direction);
-  if (i == -1)
-    return -1;
-  if (IS_ISOLATE_BRIDGE(i) && 
-       (((direction == +1) && (MATCHING_INDEX(i) > i)) || 
-       ((direction == -1) && (MATCHING_INDEX(i) < i))) ) {
-    int next = MATCHING_INDEX(i);
-    if (abs(next - i) > 1) // jumped at least one character
-      did_jump = i + direction;
-    return irs_skip_ignores(next, direction);
-  } else {
-    int next = irs_skip_ignores(i + direction, direction);
-    if (next == -1)
-      return -1;
-    if (irs_embedding_level != EMBEDDING_LEVEL(next))  { // at end if the level changed
-      found_bordering_level = EMBEDDING_LEVEL(next);
-      did_jump = next;
-      return -1;
+template<typename Index> EmbeddingLevel BidiAlgorithm<Index>::implicit_level(const EmbeddingLevel level, const Bidi_Class type) { // I1-I2
+  if (level & 1) { // odd embedding level
+    switch (type) {
+      case Bidi_Class::Left_To_Right:
+      case Bidi_Class::European_Number:
+      case Bidi_Class::Arabic_Number:
+        return level + 1;
+      default:
+        return level;
+    }
+  } else { // even embedding level
+    switch (type) {
+      case Bidi_Class::Right_To_Left:
+        return level + 1;
+      case Bidi_Class::Arabic_Number:
+      case Bidi_Class::European_Number:
+        return level + 2;
+      default:
+        return level;
     }
-    return next;
   }
 }
 
-void BidiAlgorithm::assign_bracket_pairs(const int irs_start) {
+template<typename Index> Bidi_Class BidiAlgorithm<Index>::embedding_direction_for_embedding_level(EmbeddingLevel level) const {
+  return (level & 1) ? Bidi_Class::Right_To_Left : Bidi_Class::Left_To_Right;
+}
+
+template<typename Index> void BidiAlgorithm<Index>::assign_bracket_pairs(IsolatingRunSequenceIterator iterator) { // BD16, also records which directions of strong type each pair encloses, for N0
+  // the bracket pairs enclose nothing that N0 changes before it gets to them, so counting strong types as the sequence goes by is enough:
+  // each open bracket on the stack remembers the counts at its position, and the difference at the matching close bracket is what the pair encloses
+  struct {
+    Index index, key;
+    Index strong_l_count, strong_r_count;
+  } open_brackets[MAX_DEPTH]; // stack of open brackets
   int count = 0;
-  int open_brackets[MAX_DEPTH]; // stack of indices of open brackets
-  IsolatingRunSequenceIterator iterator(*this, irs_start, +1);
+  Index strong_l_count = 0, strong_r_count = 0, pair_count = 0;
   iterator.all([&]{
-    int i = iterator.index;
-    if (iterator.current_type == Bidi_Class::Other_Neutral) { // brackets are a proper subset of ONs
-      Bidi_Paired_Bracket_Type paired_bracket_type;
-      uint32_t code = Get_Bidi_Paired_Bracket(text[i], paired_bracket_type);
-      if (paired_bracket_type == Bidi_Paired_Bracket_Type::Open) {
+    Index i = iterator.index;
+    Index key = None;
+    if (IS_OPEN_BRACKET(i) || IS_CLOSE_BRACKET(i)) { // take the key out of the matching index, which holds the pairing from here on
+      key = MATCHING_INDEX(i);
+      MATCHING_INDEX(i) = None;
+    }
+    if (Is_Strong_in_NI_context(iterator.current_type)) {
+      if (NI_influencing_direction(iterator.current_type) == Bidi_Class::Left_To_Right)
+        ++strong_l_count;
+      else
+        ++strong_r_count;
+    } else if (iterator.current_type == Bidi_Class::Other_Neutral) { // brackets are a proper subset of ONs
+      if (IS_OPEN_BRACKET(i)) {
         if (count < MAX_DEPTH) {
-          open_brackets[count] = i;
+          open_brackets[count].index = i;
+          open_brackets[count].key = key;
+          open_brackets[count].strong_l_count = strong_l_count;
+          open_brackets[count].strong_r_count = strong_r_count;
           ++count;
         }
-      } else if (paired_bracket_type == Bidi_Paired_Bracket_Type::Close) {
+      } else if (IS_CLOSE_BRACKET(i)) {
         for (int m = count - 1; m >= 0; --m) { // search stack from top down to find matching
-          if (code == text[open_brackets[m]]) { found_match:
-            MATCHING_INDEX(open_brackets[m]) = i; // one-way link (open->close) because we can do all processing upon discovering an open bracket
+          Index open = open_brackets[m].index;
+          if (open_brackets[m].key == key) { // see classify_bracket()
+            MATCHING_INDEX(open) = i; // one-way link (open->close) because we can do all processing upon discovering an open bracket
+            ENCLOSES_STRONG_L(open) = strong_l_count > open_brackets[m].strong_l_count;
+            ENCLOSES_STRONG_R(open) = strong_r_count > open_brackets[m].strong_r_count;
             count = m; // pop down past the one we just matched to
+            ++pair_count;
             break;
-          } else { // http://www.unicode.org/L2/L2013/13123-norm-and-bpa.pdf ...In practice this amounts to running the algorithm as before but including the following additional pairs: U+2329 with U+3009, and U+3008 with U+232A...
-            auto a = text[open_brackets[m]];
-            auto b = text[i];
-            if ((a == 0x2329 && b == 0x3009) || (a == 0x3008 && b == 0x232A))
-              goto found_match;
           }
         }
       }
     }
   });
+  PHASE_COUNT(bracket_pairs, pair_count);
 }
 
-void BidiAlgorithm::append_next_isolating_run_sequence(int head, int next) {
-  next = irs_skip_ignores(next, +1);
-  if (next == -1) // this potential IRS was really just empty
-    return;
-  if (IS_ISOLATE_BRIDGE(next) && (MATCHING_INDEX(next) < next)) // if the first valid character of this potential IRS is a PDI, it means it's already claimed by a different IRS altogether
-    return;
-  retry: if (NEXT_ISOLATING_RUN_SEQUENCE(head) == -1) { // 'head' is the current end of the chain, may append
-    NEXT_ISOLATING_RUN_SEQUENCE(head) = next; // append
-  } else if (NEXT_ISOLATING_RUN_SEQUENCE(head) == next) { // irs already exists in the chain, ignore
-    return;
-  } else {
-    head = NEXT_ISOLATING_RUN_SEQUENCE(head);
-    goto retry; // try appending to the end of the next item in the chain
-  }
-}
-
-void BidiAlgorithm::prepare_isolating_run_sequence(int irs_start) {
-  EmbeddingLevel previous_embedding_level = paragraph_embedding_level;
-  EmbeddingLevel current_embedding_level = paragraph_embedding_level;
-  EmbeddingLevel next_embedding_level = paragraph_embedding_level;
-  int i = irs_skip_ignores(irs_start, +1); // find current_embedding_level
-  if (i != -1) {
-    current_embedding_level = EMBEDDING_LEVEL(i);
-    i = irs_skip_ignores(irs_start, -1); // walk backwards to find previous_embedding_level
-    while (i != -1) {
-      int ignore_jump;
-      i = irs_step(current_embedding_level, i, -1, ignore_jump, previous_embedding_level); // will set previous_embedding_level if found (otherwise will stay paragraph_embedding_level)
-    }
-    i = irs_skip_ignores(irs_start, +1); // walk forwards, find next_embedding_level, link together NEXT_ISOLATING_RUN_SEQUENCEs
-    while (i != -1) {
-      int did_jump = -1;
-      i = irs_step(current_embedding_level, i, +1, did_jump, next_embedding_level);
-      if (did_jump != -1) {
-        append_next_isolating_run_sequence(irs_start, did_jump);
+template<typename Index> void BidiAlgorithm<Index>::prepare_level_runs() { // BD7, and how the level runs link up into BD13 isolating run sequences
+  // a level run also ends after each matched isolate initiator and before each matched PDI, so that each is in just one sequence: the one of the level run before it, or of
+  // the initiator's, or its own. That leaves apart what would otherwise run on from inside an isolate into its PDI (a paragraph separator at the level outside, say)
+  struct {
+    Index run, initiator;
+  } initiator_runs[MAX_DEPTH]; // stack of level runs that end with a matched isolate initiator, waiting for the level run that starts with its PDI
+  int count = 0;
+  Index previous = None; // the last character X9 left
+  EmbeddingLevel previous_level = 0;
+  for (Index i = 0; i < length; ++i) {
+    if (REMOVED_BY_X9(i))
+      continue;
+    const EmbeddingLevel level = EMBEDDING_LEVEL(i);
+    const bool is_matched_pdi = IS_ISOLATE_BRIDGE(i) && (MATCHING_INDEX(i) < i);
+    const bool after_matched_initiator = previous != None && IS_ISOLATE_BRIDGE(previous) && (MATCHING_INDEX(previous) > previous);
+    if (previous == None || is_matched_pdi || after_matched_initiator || level != previous_level) {
+      if (after_matched_initiator && (count < MAX_DEPTH)) {
+        initiator_runs[count].run = level_run_count - 1;
+        initiator_runs[count].initiator = previous;
+        ++count;
+      }
+      if (is_matched_pdi && (count > 0) && (initiator_runs[count - 1].initiator == MATCHING_INDEX(i))) {
+        run_next[initiator_runs[count - 1].run] = level_run_count;
+        --count;
+      } else {
+        ++isolating_run_sequence_count;
+      }
+      run_starts[level_run_count] = i;
+      run_next[level_run_count] = None;
+      run_levels[level_run_count] = level;
+      ++level_run_count;
+    }
+    previous = i;
+    previous_level = level;
+  }
+  run_starts[level_run_count] = length;
+}
+
+template<typename Index> bool BidiAlgorithm<Index>::starts_isolating_run_sequence(const Index run) const { // BD13: every level run but those that an earlier one goes on to
+  const Index start = run_starts[run];
+  return !(IS_ISOLATE_BRIDGE(start) && (MATCHING_INDEX(start) < start));
+}
+
+template<typename Index> typename BidiAlgorithm<Index>::IsolatingRunSequence BidiAlgorithm<Index>::isolating_run_sequence(const Index first_run) const { // X10, with sos and eos
+  Index last_run = first_run;
+  while (run_next[last_run] != None)
+    last_run = run_next[last_run];
+  const EmbeddingLevel level = run_levels[first_run];
+  const EmbeddingLevel previous_level = first_run > 0 ? run_levels[first_run - 1] : paragraph_embedding_level;
+  const EmbeddingLevel next_level = last_run + 1 < level_run_count ? run_levels[last_run + 1] : paragraph_embedding_level;
+  return IsolatingRunSequence { first_run, embedding_direction_for_embedding_level(std::max(level, previous_level)), embedding_direction_for_embedding_level(std::max(level, next_level)) };
+}
+
+template<typename Index> void BidiAlgorithm<Index>::prepare_single_level_run() { // X1-X10 for a paragraph without explicit formatting characters or BN, leaving I1-I2 every level to set
+  run_starts[0] = 0;
+  run_next[0] = None;
+  run_levels[0] = paragraph_embedding_level;
+  run_starts[1] = length;
+  level_run_count = 1;
+  isolating_run_sequence_count = 1;
+}
+
+template<typename Index> void BidiAlgorithm<Index>::record_explicit_structure() { // after X10, before any sequence is resolved
+  const uint32_t No_Sequence = uint32_t(-1);
+  for (Index i = 0; i < length; ++i) {
+    explicit_structure->levels[i] = Removed_Level;
+    explicit_structure->sequences[i] = No_Sequence;
+  }
+  uint32_t sequence = 0;
+  for (Index first_run = 0; first_run < level_run_count; ++first_run) {
+    if (!starts_isolating_run_sequence(first_run))
+      continue;
+    for (Index r = first_run; r != None; r = run_next[r]) {
+      for (Index i = run_starts[r]; i < run_starts[r + 1]; ++i) {
+        if (IGNORE_BY_X9(i))
+          continue;
+        explicit_structure->levels[i] = EmbeddingLevel(run_levels[r] | (IS_OVERRIDDEN(i) ? Overridden_Level : 0));
+        explicit_structure->sequences[i] = sequence;
+      }
+    }
+    ++sequence;
+  }
+}
+
+template<typename Index> size_t BidiAlgorithm<Index>::resolved_level_runs(ResolvedLevelRun *runs, const size_t run_capacity) const { // for RunLevelRuns(), after run() without levels
+  // I1-I2 as the runs are written: each character that X9 didn't remove is at the level of its level run, raised by its class; the characters removed between them (5.2) join
+  // the run before them -- those before the first level run join the run it starts
+  if (length == 0)
+    return 0;
+  size_t count = 0;
+  auto add_run = [&](const Index start, const Index end, const EmbeddingLevel level) {
+    if (count < run_capacity)
+      runs[count] = ResolvedLevelRun { uint32_t(start), uint32_t(end - start), level };
+    ++count;
+  };
+  Index start = 0;
+  EmbeddingLevel level = level_run_count > 0 ? implicit_level(run_levels[0], BIDI_CLASS(run_starts[0])) : paragraph_embedding_level; // with no level runs X9 removed everything
+  const uint64_t Bytes = 0x0101010101010101ull;
+  for (Index r = 0; r < level_run_count; ++r) {
+    const EmbeddingLevel run_level = run_levels[r];
+    Bidi_Class type = BIDI_CLASS(run_starts[r]); // the last class seen, whose characters are all at 'level'
+    if (implicit_level(run_level, type) != level) {
+      add_run(start, run_starts[r], level);
+      start = run_starts[r];
+      level = implicit_level(run_level, type);
+    }
+    for (Index i = run_starts[r] + 1, end = run_starts[r + 1]; i < end; ) {
+      uint64_t eight;
+      if (end - i >= 8 && (memcpy(&eight, &BIDI_CLASS(i), 8), eight == uint8_t(type) * Bytes)) { // most runs are of one class for longer than this
+        i += 8;
+        continue;
+      }
+      if (BIDI_CLASS(i) != type && !IGNORE_BY_X9(i)) {
+        type = BIDI_CLASS(i);
+        if (implicit_level(run_level, type) != level) {
+          add_run(start, i, level);
+          start = i;
+          level = implicit_level(run_level, type);
+        }
       }
+      ++i;
     }
   }
-#define SEQUENCE_BOUNDARY_TYPE(A, B) ((((A) > (B)) ? (A) : (B)) & 1)
-  SOS(irs_start) = SEQUENCE_BOUNDARY_TYPE(previous_embedding_level, current_embedding_level);
-  EOS(irs_start) = SEQUENCE_BOUNDARY_TYPE(current_embedding_level, next_embedding_level);
+  add_run(start, length, level);
+  return count;
 }
 
-EmbeddingLevel BidiAlgorithm::paragraph_embedding_level_for_strong_character_index(const int first_strong_index) const {
-  if (first_strong_index < 0) {
+template<typename Index> EmbeddingLevel BidiAlgorithm<Index>::paragraph_embedding_level_for_strong_character_index(const Index first_strong_index) const {
+  if (first_strong_index == None) {
     return 0; // no strong character found, default to L
   } else {
     switch (BIDI_CLASS(first_strong_index)) { // P3
@@ -671,19 +2688,19 @@ EmbeddingLevel BidiAlgorithm::paragraph_embedding_level_for_strong_character_ind
   }
 }
 
-int BidiAlgorithm::find_first_strong_index(const int irs_start, const int end_index) const {
-  IsolatingRunSequenceIterator iterator(*this, irs_start, +1);
-  int first_strong_index = -1;
-  iterator.each([&]{
-    if (iterator.index > end_index)
-      return false;
-    if (Is_Strong(iterator.current_type)) {
-      first_strong_index = iterator.index;
-      return false; // stop
-    }
-    return true;
-  });
-  return first_strong_index;
+template<typename Index> Index BidiAlgorithm<Index>::find_first_strong_index(const Index start_index, const Index end_index) const { // P2, skipping over the characters between isolate initiators and their matching PDIs
+  Index steps = 0;
+  Index i = start_index;
+  for (; (i <= end_index) && (i < length); ++i, ++steps) {
+    if (IGNORE_BY_X9(i))
+      continue;
+    if (Is_Strong(BIDI_CLASS(i)))
+      break;
+    if (IS_ISOLATE_BRIDGE(i) && (MATCHING_INDEX(i) > i))
+      i = MATCHING_INDEX(i) - 1; // on to the PDI
+  }
+  PHASE_COUNT(lookahead_steps, steps);
+  return (i <= end_index) && (i < length) ? i : None;
 }
 
 #if UAX_BIDI_ENABLE_DEBUG_TRACE
@@ -696,7 +2713,7 @@ static const char *BIDI_CODE(Bidi_Class cls) {
   return "?";
 }
 
-void BidiAlgorithm::trace(const char *step, bool headers) const {
+template<typename Index> void BidiAlgorithm<Index>::trace(const char *step, bool headers) const {
   if (!debug_trace)
     return;
   auto label = [](const char *s) { printf("%*s: ", 9, s); };
@@ -705,41 +2722,52 @@ void BidiAlgorithm::trace(const char *step, bool headers) const {
     label("pe");
     printf("%d\n", paragraph_embedding_level);
     label("index");
-    for (int i = 0; i < length; ++i) {
-      printf("% 4d ", i);
+    for (Index i = 0; i < length; ++i) {
+      printf("% 4d ", int(i));
     }
     printf("\n");
     label("character");
-    for (int i = 0; i < length; ++i) {
-      printf("%04X ", text[i]);
+    for (size_t i = 0, u = 0; i < length; ++i) {
+      switch (code_unit_size) {
+        case 1: printf("%04X ", next_codepoint((const uint8_t *)text, code_unit_count, u)); break;
+        case 2: printf("%04X ", next_codepoint((const uint16_t *)text, code_unit_count, u)); break;
+        case 4: printf("%04X ", next_codepoint((const Codepoint *)text, code_unit_count, u)); break;
+        default: printf("   - "); break; // classes without text
+      }
     }
     printf("\n");
   }
   label("matching");
-  for (int i = 0; i < length; ++i) {
-    if (MATCHING_INDEX(i) != -1) {
-      printf("% 4d ", MATCHING_INDEX(i));
+  for (Index i = 0; i < length; ++i) {
+    if (MATCHING_INDEX(i) != None) {
+      printf("% 4d ", int(MATCHING_INDEX(i)));
     } else {
       printf("   - ");
     }
   }
   printf("\n");
-  label("nextirs");
-  for (int i = 0; i < length; ++i) {
-    if (NEXT_ISOLATING_RUN_SEQUENCE(i) != -1) {
-      printf("% 4d ", NEXT_ISOLATING_RUN_SEQUENCE(i));
+  label("levelrun");
+  for (Index i = 0, r = 0; i < length; ++i) { // and the level run it continues to, if any
+    while (r < level_run_count && run_starts[r + 1] <= i)
+      ++r;
+    if (r < level_run_count && run_starts[r] <= i) {
+      if (run_next[r] != None && i + 1 == run_starts[r + 1]) {
+        printf("%2d>%-2d", int(r), int(run_next[r]));
+      } else {
+        printf("% 4d ", int(r));
+      }
     } else {
       printf("   - ");
     }
   }
   printf("\n");
   label("bidiclass");
-  for (int i = 0; i < length; ++i) {
+  for (Index i = 0; i < length; ++i) {
     printf("%*s ", 4, BIDI_CODE(BIDI_CLASS(i)));
   }
   printf("\n");
   label("embedding");
-  for (int i = 0; i < length; ++i) {
+  for (Index i = 0; i < length; ++i) {
     printf("% 4d ", EMBEDDING_LEVEL(i));
   }
   printf("\n");
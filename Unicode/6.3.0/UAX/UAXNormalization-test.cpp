@@ -1,8 +1,172 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <vector>
 #include "UAX.h"
 #include "UCDReader.h"
+#include "UAXTestUtil.h"
+
+#define ANSI_FOREGROUND_RED     "\x1b[31m"
+#define ANSI_FOREGROUND_GREEN   "\x1b[32m"
+#define ANSI_FOREGROUND_DEFAULT "\x1b[39m"
+
+using namespace UAX::Normalization;
+
+static const Form Forms[] = { Form::NFD, Form::NFC, Form::NFKD, Form::NFKC };
+static const char *Form_Names[] = { "NFD", "NFC", "NFKD", "NFKC" };
+
+/**
+ ** Normalize() into a buffer of exactly the documented size, with a guard past its end that must come back untouched
+ **/
+static std::vector<uint32_t> normalize(const std::vector<uint32_t> &text, Form form) {
+  const uint32_t Guard = 0xFFFFFFFF;
+  bool compatibility = form == Form::NFKD || form == Form::NFKC;
+  size_t size = compatibility ? BufferSizeForCompatibilityDecomposition(text.size()) : BufferSizeForCanonicalDecomposition(text.size());
+  std::vector<uint32_t> out(size + 1, Guard);
+  size_t n = Normalize(text.data(), text.size(), form, out.data());
+  if (n > size || out[size] != Guard)
+    return std::vector<uint32_t>(1, Guard);
+  out.resize(n);
+  return out;
+}
+
+/**
+ ** The same form built from the whole-text building blocks, without the quick check
+ **/
+static std::vector<uint32_t> compose_from_blocks(const std::vector<uint32_t> &text, Form form) {
+  bool compatibility = form == Form::NFKD || form == Form::NFKC;
+  std::vector<uint32_t> out(BufferSizeForCompatibilityDecomposition(text.size()));
+  size_t n = compatibility ? CompatibilityDecomposition(text.data(), text.size(), out.data()) : CanonicalDecomposition(text.data(), text.size(), out.data());
+  if (form == Form::NFC || form == Form::NFKC)
+    n = CanonicalComposition(out.data(), n);
+  out.resize(n);
+  return out;
+}
+
+static void print(const char *label, const std::vector<uint32_t> &text) {
+  printf("%s", label);
+  for (uint32_t c : text)
+    printf(" %04X", c);
+  printf("\n");
+}
+
+/**
+ ** One text in one form: Normalize() and the building blocks both give expected, and QuickCheck() doesn't contradict it
+ **/
+static int check(const std::vector<uint32_t> &text, Form form, const std::vector<uint32_t> &expected) {
+  std::vector<uint32_t> normalized = normalize(text, form);
+  std::vector<uint32_t> from_blocks = compose_from_blocks(text, form);
+  QuickCheckResult quick_check = QuickCheck(text.data(), text.size(), form);
+  bool quick_check_wrong = (quick_check == QuickCheckResult::Normalized && expected != text) || (quick_check == QuickCheckResult::NotNormalized && expected == text);
+  if (normalized == expected && from_blocks == expected && !quick_check_wrong)
+    return 0;
+  printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " %s, quick check %d\n", Form_Names[(int)form], (int)quick_check);
+  print("text:         ", text);
+  print("expected:     " ANSI_FOREGROUND_GREEN, expected);
+  printf(ANSI_FOREGROUND_DEFAULT);
+  print("normalized:   ", normalized);
+  print("from blocks:  ", from_blocks);
+  return 1;
+}
+
+/**
+ ** Random texts drawn from starters that compose, combining marks of several classes (some out of order), Hangul jamo and syllables, singletons, excluded
+ ** and compatibility characters, so segments start and end everywhere; Normalize() against the building blocks, and normalizing again changes nothing
+ **/
+int test_RandomTexts() {
+  int failed = 0;
+  static const uint32_t alphabet[] = {
+    'a', 'e', 'A', 'o', ' ', 0x00E9, 0x00C5, 0x00A0, 0x0300, 0x0301, 0x0316, 0x0323, 0x0327, 0x0338, 0x0344, 0x0345, 0x03D3, 0x0F73, 0x0F71, 0x0F72, 0x0F80,
+    0x1100, 0x1161, 0x11A8, 0xAC00, 0xAC01, 0x1E9B, 0x1E0A, 0x212B, 0x2126, 0x0B47, 0x0B3E, 0x0B57, 0xFB2C, 0xFDFA, 0x1D15E, 0x1D165, 0x2F800, 0x3099, 0x304B,
+  };
+  uint64_t random = 23;
+  for (int t = 0; t < 20000; ++t) {
+    std::vector<uint32_t> text = random_text(random, alphabet, random_below(random, 24));
+    for (Form form : Forms) {
+      std::vector<uint32_t> expected = compose_from_blocks(text, form);
+      failed += check(text, form, expected);
+      failed += check(expected, form, expected);
+    }
+  }
+  return failed;
+}
+
+/**
+ ** Hangul jamo sequences the arithmetic composition has to turn down -- a second trailing consonant, two vowels, a leading consonant straight before a
+ ** trailing one, and U+11A7, which is T_Base but not a trailing consonant -- with their NFC worked out by hand
+ **/
+int test_Hangul() {
+  int failed = 0;
+  struct Case {
+    std::vector<uint32_t> text;
+    std::vector<uint32_t> nfc;
+  };
+  static const Case cases[] = {
+    { { 0x1100, 0x1161, 0x11A8 }, { 0xAC01 } },
+    { { 0x1100, 0x1161, 0x11A8, 0x11A8 }, { 0xAC01, 0x11A8 } },
+    { { 0xAC01, 0x11A8 }, { 0xAC01, 0x11A8 } },
+    { { 0x1100, 0x1161, 0x1161 }, { 0xAC00, 0x1161 } },
+    { { 0x1100, 0x11A8 }, { 0x1100, 0x11A8 } },
+    { { 0xAC00, 0x11A7 }, { 0xAC00, 0x11A7 } },
+    { { 0xAC00, 0x1161 }, { 0xAC00, 0x1161 } },
+  };
+  for (const Case &c : cases)
+    failed += check(c.text, Form::NFC, c.nfc);
+  return failed;
+}
 
 int main (int argc, char const *argv[]) {
+  int failed = 0;
+  int total = 0;
+
+  failed += test_Hangul();
+  failed += test_RandomTexts();
+
+  // NormalizationTest.txt -- UAX #15 conformance: columns c1..c5 and their normalizations
+  //   NFC:  c2 == NFC(c1) == NFC(c2) == NFC(c3),  c4 == NFC(c4) == NFC(c5)
+  //   NFD:  c3 == NFD(c1) == NFD(c2) == NFD(c3),  c5 == NFD(c4) == NFD(c5)
+  //   NFKC: c4 == NFKC(c1) == ... == NFKC(c5)
+  //   NFKD: c5 == NFKD(c1) == ... == NFKD(c5)
+  // and every codepoint that isn't a c1 of Part 1 is its own normalization in all four forms
+  std::vector<bool> in_part1(0x110000, false);
+  int part = -1;
+  withUCDFormattedFile("../UCD/NormalizationTest.txt", [&](Fields fields) {
+    if (fields.fields[0].length > 0 && fields.fields[0].text[0] == '@') {
+      part = fields.fields[0].text[fields.fields[0].length - 1] - '0';
+      return;
+    }
+    assert(fields.count == 5);
+    std::vector<uint32_t> c[5];
+    for (int i = 0; i < 5; ++i)
+      fields.fields[i].asCodepointSequence([&](codepoint code) { c[i].push_back(code); });
+    if (part == 1)
+      in_part1[c[0][0]] = true;
+
+    int failed_before = failed;
+    for (int i = 0; i < 5; ++i) {
+      failed += check(c[i], Form::NFC, i < 3 ? c[1] : c[3]);
+      failed += check(c[i], Form::NFD, i < 3 ? c[2] : c[4]);
+      failed += check(c[i], Form::NFKC, c[3]);
+      failed += check(c[i], Form::NFKD, c[4]);
+    }
+    if (failed != failed_before) {
+      printf("line: ");
+      fields.print();
+      printf("\n");
+    }
+    ++total;
+  });
+
+  for (uint32_t code = 0; code < 0x110000; ++code) {
+    if (in_part1[code])
+      continue;
+    std::vector<uint32_t> text(1, code);
+    for (Form form : Forms)
+      failed += check(text, form, text);
+    ++total;
+  }
+
+  printf("failed %d / %d\n", failed, total);
+  if (failed > 0)
+    return -1;
   return 0;
 }
@@ -5,10 +5,40 @@
 using namespace UAX;
 using namespace Normalization;
 
-struct NormalizationAlgorithm {
+namespace {
+  /**
+   ** Per-codepoint normalization properties, deduplicated like UCD::Properties. quick_check holds a QuickCheckResult in 2 bits per Form
+   ** (NFD in the lowest); boundary has 1 bit per Form, set when nothing before the codepoint can reorder or compose with it or anything after it
+   **/
+  struct Normalization_Record {
+    uint8_t combining_class;
+    uint8_t quick_check;
+    uint8_t boundary;
+  };
+
+  struct Composition_Pair {
+    Codepoint first;
+    Codepoint second;
+    Codepoint composite;
+  };
+
+  #include "_Derived/Normalization.h"
 };
 
-// bool Normalization::
+// two-stage table lookup (see CodepointTable in UCDReader-main.cpp), codepoints past 0x10FFFF land in the last (default) block
+#define TABLE_LOOKUP(TABLE, CODE) TABLE##_Blocks[(TABLE##_Index[((CODE) >> TABLE##_Shift) < TABLE##_IndexLast ? ((CODE) >> TABLE##_Shift) : TABLE##_IndexLast] << TABLE##_Shift) | ((CODE) & TABLE##_Mask)]
+
+static inline const Normalization_Record &record_for(const Codepoint code) {
+  return Normalization_Records[TABLE_LOOKUP(Normalization, code)];
+}
+
+static inline QuickCheckResult quick_check(const Normalization_Record &record, const Form form) {
+  return (QuickCheckResult)((record.quick_check >> (2 * (int)form)) & 3);
+}
+
+static inline bool is_boundary(const Normalization_Record &record, const Form form) {
+  return (record.boundary >> (int)form) & 1;
+}
 
 // from ucdn.c
 /*
@@ -38,7 +68,7 @@ struct NormalizationAlgorithm {
 #define TCOUNT 28
 #define NCOUNT (VCOUNT * TCOUNT)
 
-int hangul_pair_decompose(uint32_t code, uint32_t *a, uint32_t *b)
+static int hangul_pair_decompose(uint32_t code, uint32_t *a, uint32_t *b)
 {
     int si = code - SBASE;
 
@@ -58,7 +88,7 @@ int hangul_pair_decompose(uint32_t code, uint32_t *a, uint32_t *b)
     }
 }
 
-int hangul_pair_compose(uint32_t *code, uint32_t a, uint32_t b)
+static int hangul_pair_compose(uint32_t *code, uint32_t a, uint32_t b)
 {
     if (b < VBASE || b >= (TBASE + TCOUNT))
         return 0;
@@ -68,14 +98,238 @@ int hangul_pair_compose(uint32_t *code, uint32_t a, uint32_t b)
         return 0;
 
     if (a >= SBASE) {
-        /* LV,T */
+        /* LV,T -- only an LV syllable takes a trailing consonant, and TBASE itself is not one */
+        if ((a - SBASE) % TCOUNT || b <= TBASE)
+            return 0;
         *code = a + (b - TBASE);
         return 3;
     } else {
         /* L,V */
+        if (b >= VBASE + VCOUNT)
+            return 0;
         int li = a - LBASE;
         int vi = b - VBASE;
         *code = SBASE + li * NCOUNT + vi * TCOUNT;
         return 2;
     }
 }
+
+/**
+ ** Full decomposition of one codepoint (Decomposition_Data, see UCDReader-main.cpp), or the codepoint itself if it has none. Returns the number written
+ **/
+static inline size_t decompose(const Codepoint code, const bool compatibility, Codepoint *out) {
+  uint32_t a, b;
+  switch (hangul_pair_decompose(code, &a, &b)) {
+    case 2:
+      out[0] = a;
+      out[1] = b;
+      return 2;
+    case 3:
+      hangul_pair_decompose(a, &out[0], &out[1]);
+      out[2] = b;
+      return 3;
+  }
+  const uint16_t offset = TABLE_LOOKUP(Decomposition, code);
+  const uint16_t header = Decomposition_Data[offset];
+  const uint16_t *units = &Decomposition_Data[offset + 1];
+  size_t unit_count = header & 0xFF;
+  if (compatibility && (header >> 8) != 0) {
+    units += unit_count;
+    unit_count = header >> 8;
+  }
+  if (unit_count == 0) { // no decomposition at all (offset 0), or only a compatibility one
+    out[0] = code;
+    return 1;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < unit_count; ++i) {
+    Codepoint unit = units[i];
+    if (unit - 0xD800 < 0x400) // a generated table, so the trail surrogate is there
+      unit = 0x10000 + ((unit - 0xD800) << 10) + (units[++i] - 0xDC00);
+    out[n++] = unit;
+  }
+  return n;
+}
+
+/**
+ ** Decompose code onto the end of out[0, length) and keep it in canonical order: each non-starter sinks back past the ones with a higher combining class,
+ ** which is the stable sort the canonical ordering algorithm asks for. last_combining_class is that of out[length - 1] (0 for an empty out), so marks that
+ ** already come in order need no lookups of what's before them. Returns the new length
+ **/
+static inline size_t append_decomposition(const Codepoint code, const bool compatibility, Codepoint *out, size_t length, uint8_t &last_combining_class) {
+  Codepoint decomposition[Decomposition_Max_Compatibility];
+  const size_t count = decompose(code, compatibility, decomposition);
+  for (size_t d = 0; d < count; ++d) {
+    const Codepoint c = decomposition[d];
+    const uint8_t combining_class = record_for(c).combining_class;
+    if (combining_class == 0 || combining_class >= last_combining_class) {
+      out[length++] = c;
+      last_combining_class = combining_class;
+      continue;
+    }
+    size_t i = length++;
+    for (; i > 0 && record_for(out[i - 1]).combining_class > combining_class; --i)
+      out[i] = out[i - 1];
+    out[i] = c;
+  }
+  return length;
+}
+
+/**
+ ** The primary composite of first and second, or 0
+ **/
+static inline Codepoint compose(const Codepoint first, const Codepoint second) {
+  uint32_t composite;
+  if (hangul_pair_compose(&composite, first, second))
+    return composite;
+  // branch-free binary search: the pairs a mark is looked up for are all over the table, so the comparisons wouldn't predict anyway
+  const uint64_t key = ((uint64_t)first << 32) | second;
+  const Composition_Pair *base = Composition_Pairs;
+  for (size_t n = sizeof(Composition_Pairs) / sizeof(Composition_Pairs[0]); n > 1; ) {
+    const size_t half = n / 2;
+    base = ((((uint64_t)base[half].first << 32) | base[half].second) <= key) ? base + half : base;
+    n -= half;
+  }
+  return (base->first == first && base->second == second) ? base->composite : 0;
+}
+
+size_t Normalization::BufferSizeForCanonicalDecomposition(size_t length) {
+  return length * Decomposition_Max_Canonical;
+}
+
+size_t Normalization::BufferSizeForCompatibilityDecomposition(size_t length) {
+  return length * Decomposition_Max_Compatibility;
+}
+
+QuickCheckResult Normalization::QuickCheck(const Codepoint *text, const size_t length, const Form form) {
+  const Codepoint stable_below = Normalization_Stable_Below[(int)form];
+  QuickCheckResult result = QuickCheckResult::Normalized;
+  uint8_t last_combining_class = 0;
+  for (size_t i = 0; i < length; ++i) {
+    if (text[i] < stable_below) {
+      last_combining_class = 0;
+      continue;
+    }
+    const Normalization_Record &record = record_for(text[i]);
+    if (record.combining_class != 0 && last_combining_class > record.combining_class)
+      return QuickCheckResult::NotNormalized;
+    switch (quick_check(record, form)) {
+      case QuickCheckResult::NotNormalized:
+        return QuickCheckResult::NotNormalized;
+      case QuickCheckResult::MaybeNormalized:
+        result = QuickCheckResult::MaybeNormalized;
+        break;
+      case QuickCheckResult::Normalized:
+        break;
+    }
+    last_combining_class = record.combining_class;
+  }
+  return result;
+}
+
+size_t Normalization::CanonicalDecomposition(const Codepoint *text, const size_t length, Codepoint *out) {
+  size_t n = 0;
+  uint8_t last_combining_class = 0;
+  for (size_t i = 0; i < length; ++i)
+    n = append_decomposition(text[i], false, out, n, last_combining_class);
+  return n;
+}
+
+size_t Normalization::CompatibilityDecomposition(const Codepoint *text, const size_t length, Codepoint *out) {
+  size_t n = 0;
+  uint8_t last_combining_class = 0;
+  for (size_t i = 0; i < length; ++i)
+    n = append_decomposition(text[i], true, out, n, last_combining_class);
+  return n;
+}
+
+/**
+ ** Canonical composition -- UAX #15 section 3 (D117). A character composes with the last starter unless something between them blocks it: a starter,
+ ** or a non-starter of the same or higher combining class. Only characters whose NFC quick check isn't Yes can be the second of a primary composite
+ **/
+size_t Normalization::CanonicalComposition(Codepoint *text, const size_t length) {
+  if (length == 0)
+    return 0;
+  size_t starter = 0;
+  bool have_starter = record_for(text[0]).combining_class == 0;
+  int last_combining_class = have_starter ? 0 : 256;
+  size_t n = 1;
+  for (size_t i = 1; i < length; ++i) {
+    const Codepoint code = text[i];
+    const Normalization_Record &record = record_for(code);
+    const int combining_class = record.combining_class;
+    if (have_starter && (last_combining_class < combining_class || last_combining_class == 0) && quick_check(record, Form::NFC) != QuickCheckResult::Normalized) {
+      const Codepoint composite = compose(text[starter], code);
+      if (composite != 0) {
+        text[starter] = composite;
+        continue;
+      }
+    }
+    if (combining_class == 0) {
+      starter = n;
+      have_starter = true;
+    }
+    last_combining_class = combining_class;
+    text[n++] = code;
+  }
+  return n;
+}
+
+size_t Normalization::Normalize(const Codepoint *text, const size_t length, const Form form, Codepoint *out) {
+  const bool compatibility = form == Form::NFKD || form == Form::NFKC;
+  const bool composition = form == Form::NFC || form == Form::NFKC;
+  const Codepoint stable_below = Normalization_Stable_Below[(int)form];
+  size_t n = 0;
+  size_t segment = 0; // where the segment text[i] belongs to starts; text[segment, i) has been copied to out as it is
+  uint8_t last_combining_class = 0;
+  for (size_t i = 0; i < length; ++i) {
+    const Codepoint code = text[i];
+    if (code < stable_below) { // a stretch of these, each a boundary and normalized by itself, is copied in one go
+      do {
+        out[n++] = text[i++];
+      } while (i < length && text[i] < stable_below);
+      segment = --i;
+      last_combining_class = 0;
+      continue;
+    }
+    const Normalization_Record &record = record_for(code);
+    if (is_boundary(record, form))
+      segment = i;
+    if (quick_check(record, form) == QuickCheckResult::Normalized && (record.combining_class == 0 || last_combining_class <= record.combining_class)) {
+      out[n++] = code;
+      last_combining_class = record.combining_class;
+      continue;
+    }
+    // take back what was copied of the segment, then normalize all of it, up to the next boundary
+    n -= i - segment;
+    size_t end = i + 1;
+    while (end < length && !(text[end] < stable_below || is_boundary(record_for(text[end]), form)))
+      ++end;
+    const size_t start = n;
+    uint8_t segment_combining_class = 0;
+    for (size_t k = segment; k < end; ++k)
+      n = append_decomposition(text[k], compatibility, out + start, n - start, segment_combining_class) + start;
+    if (composition)
+      n = start + CanonicalComposition(out + start, n - start);
+    segment = end;
+    last_combining_class = 0;
+    i = end - 1;
+  }
+  return n;
+}
+
+size_t Normalization::NFD(const Codepoint *text, const size_t length, Codepoint *out) {
+  return Normalize(text, length, Form::NFD, out);
+}
+
+size_t Normalization::NFC(const Codepoint *text, const size_t length, Codepoint *out) {
+  return Normalize(text, length, Form::NFC, out);
+}
+
+size_t Normalization::NFKD(const Codepoint *text, const size_t length, Codepoint *out) {
+  return Normalize(text, length, Form::NFKD, out);
+}
+
+size_t Normalization::NFKC(const Codepoint *text, const size_t length, Codepoint *out) {
+  return Normalize(text, length, Form::NFKC, out);
+}
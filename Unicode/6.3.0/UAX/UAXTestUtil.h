@@ -0,0 +1,44 @@
+#include <stdint.h>
+#include <vector>
+
+static void append_utf16(std::vector<uint16_t> &out, uint32_t code) {
+  if (code >= 0x10000) {
+    out.push_back(0xD800 + ((code - 0x10000) >> 10));
+    out.push_back(0xDC00 + ((code - 0x10000) & 0x3FF));
+  } else {
+    out.push_back(code);
+  }
+}
+
+static void append_utf8(std::vector<uint8_t> &out, uint32_t code) {
+  if (code < 0x80) {
+    out.push_back(code);
+  } else if (code < 0x800) {
+    out.push_back(0xC0 | (code >> 6));
+    out.push_back(0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    out.push_back(0xE0 | (code >> 12));
+    out.push_back(0x80 | ((code >> 6) & 0x3F));
+    out.push_back(0x80 | (code & 0x3F));
+  } else {
+    out.push_back(0xF0 | (code >> 18));
+    out.push_back(0x80 | ((code >> 12) & 0x3F));
+    out.push_back(0x80 | ((code >> 6) & 0x3F));
+    out.push_back(0x80 | (code & 0x3F));
+  }
+}
+
+/**
+ ** The random numbers of the tests: a 64-bit LCG whose state is the seed, so a test that fails fails the same way every time
+ **/
+static uint32_t random_below(uint64_t &seed, uint32_t n) {
+  seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+  return (uint32_t)((seed >> 33) % n);
+}
+
+template<size_t N> static std::vector<uint32_t> random_text(uint64_t &seed, const uint32_t (&alphabet)[N], size_t length) {
+  std::vector<uint32_t> text(length);
+  for (uint32_t &c : text)
+    c = alphabet[random_below(seed, N)];
+  return text;
+}
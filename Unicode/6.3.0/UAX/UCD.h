@@ -10,11 +10,39 @@ namespace Unicode {
 namespace UCD {
   using namespace Unicode;
   
+  /**
+   ** Packed per-codepoint property record. Get_Properties() returns all of these with a single table lookup; the individual getters below read from it
+   **/
+  struct Properties {
+    Bidi_Class bidi_class;
+    Line_Break line_break;
+    Script script;
+    East_Asian_Width east_asian_width;
+    Bidi_Paired_Bracket_Type bidi_paired_bracket_type;
+    uint8_t has_bracket:1; // Get_Bidi_Paired_Bracket() returns a paired bracket
+    uint8_t has_mirror:1; // Get_Bidi_Mirroring() returns a mirrored glyph
+  };
+  
+  Properties Get_Properties(const Codepoint code);
   Codepoint Get_Bidi_Paired_Bracket(const Codepoint code, Bidi_Paired_Bracket_Type &bracket_type);
   Codepoint Get_Bidi_Mirroring(const Codepoint code);
   Script Get_Script(const Codepoint code);
   Bidi_Class Get_Bidi_Class(const Codepoint code);
   Line_Break Get_Line_Break(const Codepoint code);
+  East_Asian_Width Get_East_Asian_Width(const Codepoint code);
+  
+  /**
+   ** Batch Get_Bidi_Class(): classes[i] = Get_Bidi_Class(text[i]) for all i < length. Stretches of codepoints below U+0100 are classified 16 (SSSE3) or 32 (AVX2) at a time when the CPU supports it
+   **/
+  void Classify_Bidi(const Codepoint *text, const size_t length, Bidi_Class *classes);
+  
+  /**
+   ** Switch every lookup above over to a property database written by UCDReader (_Derived/UCD.db), mapped read-only so processes share its pages.
+   ** Returns false and keeps the current tables if the file can't be mapped or fails validation (see UCDDatabase.h).
+   ** Unload_Database() goes back to the compiled-in tables. Neither may run concurrently with lookups
+   **/
+  bool Load_Database(const char *path);
+  void Unload_Database();
 
   inline bool Is_Isolate_Initiator(const Bidi_Class cls) {
     switch (cls) {
@@ -0,0 +1,48 @@
+#ifndef UCD_DATABASE_H
+#define UCD_DATABASE_H
+
+#include "UCD.h"
+
+/**
+ ** On-disk layout of the property database UCDReader writes to _Derived/UCD.db and UCD::Load_Database() maps.
+ ** The file holds the same tables that are compiled into UCDUtils.cpp, in native byte order, each section starting on a Database_Alignment boundary:
+ **   Properties index (uint16_t), Properties blocks (uint16_t record numbers), Properties records (UCD::Properties),
+ **   Latin-1 Bidi_Class row table (256 bytes), Bidi_Paired_Bracket pairs and Bidi_Mirroring pairs (Codepoint_Pair, sorted by code)
+ **/
+namespace UCD {
+
+  struct Codepoint_Pair {
+    Codepoint code;
+    Codepoint value;
+  };
+
+  static const char Database_Magic[8] = { 'U', 'C', 'D', '.', 'd', 'b', 0, 0 };
+  static const uint32_t Database_Byte_Order = 0x01020304; // reads back differently on a machine of the other endianness
+  static const uint32_t Database_Format_Version = 1;
+  static const uint32_t Database_Alignment = 64;
+  static const uint32_t Database_Unicode_Version = 0x060300; // 0xMMmmuu, the UCD this tree is built from; a database of another version is refused
+
+  struct Database_Header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t format_version;
+    uint32_t unicode_version; // 0xMMmmuu
+    uint32_t file_size;
+    uint32_t record_size; // sizeof(Properties) of the writer
+    uint32_t properties_shift;
+    uint32_t properties_index_count;
+    uint32_t properties_index_offset;
+    uint32_t properties_blocks_count;
+    uint32_t properties_blocks_offset;
+    uint32_t properties_records_count;
+    uint32_t properties_records_offset;
+    uint32_t latin1_bidi_class_offset;
+    uint32_t bidi_brackets_count;
+    uint32_t bidi_brackets_offset;
+    uint32_t bidi_mirroring_count;
+    uint32_t bidi_mirroring_offset;
+  };
+
+};
+
+#endif
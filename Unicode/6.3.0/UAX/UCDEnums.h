@@ -228,6 +228,16 @@ namespace UCD {
     EAST_ASIAN_WIDTH_LIST
     #undef X
   };
+
+  // the number of values of each enum, for range checks on data that didn't come from this build (see Load_Database())
+  #define X(...) + 1
+  static const int Bidi_Class_Count = 0 BIDI_CLASS_LIST;
+  static const int Bidi_Paired_Bracket_Type_Count = 0 BIDI_PAIRED_BRACKET_TYPE_LIST;
+  static const int Line_Break_Count = 0 LINE_BREAK_LIST;
+  static const int Script_Count = 0 SCRIPT_LIST;
+  static const int Case_Folding_Status_Count = 0 CASE_FOLDING_STATUS_LIST;
+  static const int East_Asian_Width_Count = 0 EAST_ASIAN_WIDTH_LIST;
+  #undef X
 };
 
 #endif
@@ -1,6 +1,11 @@
 #include "UCDReader.h"
+#include "UCDDatabase.h"
 #include <limits.h>
+#include <algorithm>
+#include <functional>
 #include <stdarg.h>
+#include <map>
+#include <vector>
 
 using namespace UCD;
 
@@ -20,6 +25,81 @@ template<typename F> void withOutputFile(const char *path, F func) {
   fclose(f);
 }
 
+/**
+ Accumulates one property value per codepoint, then writes it out as a two-stage lookup table:
+   value(code) == NAME_Blocks[(NAME_Index[min(code >> NAME_Shift, NAME_IndexLast)] << NAME_Shift) | (code & NAME_Mask)]
+ Identical blocks are stored once. The block size is whichever gives the smallest total table size.
+ The extra last index entry points at a block of default values, so codepoints past 0x10FFFF need no branch.
+ */
+template<typename T> struct CodepointTable {
+  static const codepoint Count = 0x110000;
+  std::vector<T> values;
+  const T default_value;
+  
+  CodepointTable(T _default_value): values(Count, _default_value), default_value(_default_value) {}
+  
+  void set(codepoint_range range, T value) {
+    assert(range.first <= range.last && range.last < Count);
+    for (codepoint c = range.first; c <= range.last; ++c)
+      values[c] = value;
+  }
+  
+  struct Layout {
+    int shift;
+    std::vector<uint16_t> index; // block number for each (code >> shift), plus the out-of-range entry
+    std::vector<T> blocks;
+    size_t size() const { return index.size() * sizeof(uint16_t) + blocks.size() * sizeof(T); }
+  };
+  
+  Layout layout(int shift) const {
+    Layout l;
+    l.shift = shift;
+    const codepoint block_size = 1 << shift;
+    std::map<std::vector<T>, uint16_t> block_numbers;
+    auto block_number = [&](const std::vector<T> &block) {
+      auto found = block_numbers.find(block);
+      if (found != block_numbers.end())
+        return found->second;
+      assert(block_numbers.size() < 0x10000);
+      uint16_t n = (uint16_t)block_numbers.size();
+      block_numbers[block] = n;
+      l.blocks.insert(l.blocks.end(), block.begin(), block.end());
+      return n;
+    };
+    for (codepoint c = 0; c < Count; c += block_size)
+      l.index.push_back(block_number(std::vector<T>(values.begin() + c, values.begin() + c + block_size)));
+    l.index.push_back(block_number(std::vector<T>(block_size, default_value)));
+    return l;
+  }
+  
+  Layout best_layout() const {
+    Layout best = layout(4);
+    for (int shift = 5; shift <= 12; ++shift) {
+      Layout l = layout(shift);
+      if (l.size() < best.size())
+        best = l;
+    }
+    return best;
+  }
+  
+  void write(FILE *out, const char *name, const Layout &best) const {
+    const char *index_type = "uint16_t";
+    const char *value_type = sizeof(T) == 1 ? "uint8_t" : "uint16_t";
+    fprintf(out, "// %d bytes\n", (int)best.size());
+    fprintf(out, "static const int %s_Shift = %d;\n", name, best.shift);
+    fprintf(out, "static const Codepoint %s_Mask = 0x%X;\n", name, (1 << best.shift) - 1);
+    fprintf(out, "static const Codepoint %s_IndexLast = 0x%X;\n", name, (int)best.index.size() - 1);
+    fprintf(out, "static const %s %s_Index[%d] = {", index_type, name, (int)best.index.size());
+    for (size_t i = 0; i < best.index.size(); ++i)
+      fprintf(out, "%s%d,", (i % 32) ? "" : "\n", best.index[i]);
+    fprintf(out, "\n};\n");
+    fprintf(out, "static const %s %s_Blocks[%d] = {", value_type, name, (int)best.blocks.size());
+    for (size_t i = 0; i < best.blocks.size(); ++i)
+      fprintf(out, "%s%d,", (i % 32) ? "" : "\n", (int)best.blocks[i]);
+    fprintf(out, "\n};\n");
+  }
+};
+
 int main(int argc, char const *argv[]) {
 
   assert(argc == 3);
@@ -76,40 +156,401 @@ int main(int argc, char const *argv[]) {
     fprintf(out, ")\n");
   } DONE;
   
+  std::vector<Codepoint_Pair> bidi_brackets;
   PROCESS(BidiBrackets, BidiBrackets) {
     codepoint bracket, paired_bracket;
     Bidi_Paired_Bracket_Type bracket_type;
     fields.BidiBrackets(bracket, paired_bracket, bracket_type);
-    fprintf(out, "case " HEX_FMT ": bracket_type = %s; return " HEX_FMT ";\n", bracket, Bidi_Paired_Bracket_Type_to_string(bracket_type), paired_bracket);
+    assert(bidi_brackets.empty() || bidi_brackets.back().code < bracket); // looked up by binary search
+    bidi_brackets.push_back({ bracket, paired_bracket });
+    fprintf(out, "{ " HEX_FMT ", " HEX_FMT " },\n", bracket, paired_bracket);
   } DONE;
   
+  std::vector<Codepoint_Pair> bidi_mirroring;
   PROCESS(BidiMirroring, BidiMirroring) {
     codepoint code, mirror;
     fields.BidiMirroring(code, mirror);
-    fprintf(out, "case " HEX_FMT ": return " HEX_FMT ";\n", code, mirror);
+    assert(bidi_mirroring.empty() || bidi_mirroring.back().code < code); // looked up by binary search
+    bidi_mirroring.push_back({ code, mirror });
+    fprintf(out, "{ " HEX_FMT ", " HEX_FMT " },\n", code, mirror);
   } DONE;
   
-  PROCESS(Scripts, Scripts) {
+  #define READ(IN) withUCDFormattedFile(UCD_FILE_PATH(IN), [&](Fields fields) {
+  // between READ and DONE_READ, `Fields fields` will be in scope
+  #define DONE_READ })
+  
+  CodepointTable<uint8_t> scripts((uint8_t)Script::Unknown);
+  READ(Scripts) {
     codepoint_range range;
     Script script;
     fields.Scripts(range, script);
-    fprintf(out, "case %s: return %s;\n", RANGE_STR(range), Script_to_string(script));
-  } DONE;
+    scripts.set(range, (uint8_t)script);
+  } DONE_READ;
   
-  PROCESS(extracted/DerivedBidiClass, DerivedBidiClass) {
+  CodepointTable<uint8_t> bidi_classes((uint8_t)Bidi_Class::Left_To_Right);
+  READ(extracted/DerivedBidiClass) {
     codepoint_range range;
     Bidi_Class cls;
     fields.DerivedBidiClass(range, cls);
-    fprintf(out, "case %s: return %s;\n", RANGE_STR(range), Bidi_Class_to_string(cls));
-  } DONE;
+    bidi_classes.set(range, (uint8_t)cls);
+  } DONE_READ;
   
-  PROCESS(extracted/DerivedLineBreak, DerivedLineBreak) {
+  CodepointTable<uint8_t> line_breaks((uint8_t)Line_Break::Unknown);
+  READ(extracted/DerivedLineBreak) {
     codepoint_range range;
     Line_Break line_break;
     fields.DerivedLineBreak(range, line_break);
-    fprintf(out, "case %s: return %s;\n", RANGE_STR(range), Line_Break_to_string(line_break));
-  } DONE;
+    line_breaks.set(range, (uint8_t)line_break);
+  } DONE_READ;
+  
+  CodepointTable<uint8_t> east_asian_widths((uint8_t)East_Asian_Width::Neutral);
+  READ(extracted/DerivedEastAsianWidth) {
+    codepoint_range range;
+    East_Asian_Width width;
+    fields.DerivedEastAsianWidth(range, width);
+    east_asian_widths.set(range, (uint8_t)width);
+  } DONE_READ;
   
+  CodepointTable<uint8_t> bracket_types((uint8_t)Bidi_Paired_Bracket_Type::None);
+  READ(BidiBrackets) {
+    codepoint bracket, paired_bracket;
+    Bidi_Paired_Bracket_Type bracket_type;
+    fields.BidiBrackets(bracket, paired_bracket, bracket_type);
+    bracket_types.set({bracket, bracket}, (uint8_t)bracket_type);
+  } DONE_READ;
+  
+  CodepointTable<uint8_t> has_mirrors(0);
+  READ(BidiMirroring) {
+    codepoint code, mirror;
+    fields.BidiMirroring(code, mirror);
+    has_mirrors.set({code, code}, 1);
+  } DONE_READ;
+  
+  { // Properties: deduplicated packed records (UCD::Properties) + a two-stage table of record numbers
+    struct Record {
+      uint8_t bidi_class, line_break, script, east_asian_width, bidi_paired_bracket_type, has_mirror;
+      bool operator<(const Record &other) const { return memcmp(this, &other, sizeof(Record)) < 0; }
+    };
+    auto record_for = [&](codepoint c) {
+      return Record {
+        .bidi_class = bidi_classes.values[c],
+        .line_break = line_breaks.values[c],
+        .script = scripts.values[c],
+        .east_asian_width = east_asian_widths.values[c],
+        .bidi_paired_bracket_type = bracket_types.values[c],
+        .has_mirror = has_mirrors.values[c],
+      };
+    };
+    std::vector<Record> records;
+    std::map<Record, uint16_t> record_numbers;
+    auto record_number = [&](const Record &record) {
+      auto found = record_numbers.find(record);
+      if (found != record_numbers.end())
+        return found->second;
+      assert(records.size() < 0x10000);
+      uint16_t n = (uint16_t)records.size();
+      record_numbers[record] = n;
+      records.push_back(record);
+      return n;
+    };
+    CodepointTable<uint16_t> properties(record_number(Record { // record 0 holds the defaults, also used past 0x10FFFF
+      .bidi_class = bidi_classes.default_value,
+      .line_break = line_breaks.default_value,
+      .script = scripts.default_value,
+      .east_asian_width = east_asian_widths.default_value,
+      .bidi_paired_bracket_type = bracket_types.default_value,
+      .has_mirror = has_mirrors.default_value,
+    }));
+    for (codepoint c = 0; c < properties.Count; ++c)
+      properties.values[c] = record_number(record_for(c));
+    auto layout = properties.best_layout();
+    
+    withOutputFile(OUTPUT_PATH(Properties), [&](FILE *out) {
+      fprintf(out, "static const Properties Properties_Records[%d] = {\n", (int)records.size());
+      for (auto &record : records) {
+        fprintf(out, "{ %s, ", Bidi_Class_to_string((Bidi_Class)record.bidi_class));
+        fprintf(out, "%s, ", Line_Break_to_string((Line_Break)record.line_break));
+        fprintf(out, "%s, ", Script_to_string((Script)record.script));
+        fprintf(out, "%s, ", East_Asian_Width_to_string((East_Asian_Width)record.east_asian_width));
+        fprintf(out, "%s, ", Bidi_Paired_Bracket_Type_to_string((Bidi_Paired_Bracket_Type)record.bidi_paired_bracket_type));
+        fprintf(out, "%d, %d },\n", record.bidi_paired_bracket_type != (uint8_t)Bidi_Paired_Bracket_Type::None, record.has_mirror);
+      }
+      fprintf(out, "};\n");
+      properties.write(out, "Properties", layout);
+      fprintf(out, "static const uint8_t Latin1_Bidi_Class[256] = {"); // row-per-high-nibble table for the SIMD batch classifier
+      for (codepoint c = 0; c < 256; ++c)
+        fprintf(out, "%s%d,", (c % 16) ? "" : "\n", bidi_classes.values[c]);
+      fprintf(out, "\n};\n");
+    });
+    
+    withOutputFile(scratch_str("%s/UCD.db", output_path), [&](FILE *out) { // the same tables as a file for UCD::Load_Database()
+      Database_Header header;
+      memset(&header, 0, sizeof(header));
+      uint32_t offset = 0;
+      auto section = [&](size_t size) {
+        offset = (offset + Database_Alignment - 1) & ~(Database_Alignment - 1);
+        uint32_t start = offset;
+        offset += size;
+        return start;
+      };
+      section(sizeof(Database_Header));
+      memcpy(header.magic, Database_Magic, sizeof(header.magic));
+      header.byte_order = Database_Byte_Order;
+      header.format_version = Database_Format_Version;
+      header.unicode_version = Database_Unicode_Version;
+      header.record_size = sizeof(Properties);
+      header.properties_shift = layout.shift;
+      header.properties_index_count = (uint32_t)layout.index.size();
+      header.properties_index_offset = section(layout.index.size() * sizeof(uint16_t));
+      header.properties_blocks_count = (uint32_t)layout.blocks.size();
+      header.properties_blocks_offset = section(layout.blocks.size() * sizeof(uint16_t));
+      header.properties_records_count = (uint32_t)records.size();
+      header.properties_records_offset = section(records.size() * sizeof(Properties));
+      header.latin1_bidi_class_offset = section(256);
+      header.bidi_brackets_count = (uint32_t)bidi_brackets.size();
+      header.bidi_brackets_offset = section(bidi_brackets.size() * sizeof(Codepoint_Pair));
+      header.bidi_mirroring_count = (uint32_t)bidi_mirroring.size();
+      header.bidi_mirroring_offset = section(bidi_mirroring.size() * sizeof(Codepoint_Pair));
+      header.file_size = section(0);
+      
+      auto write_at = [&](uint32_t at, const void *bytes, size_t size) {
+        static const uint8_t padding[Database_Alignment] = {};
+        long position = ftell(out);
+        assert(position >= 0 && at >= (uint32_t)position && at - position < Database_Alignment);
+        fwrite(padding, 1, at - position, out);
+        fwrite(bytes, 1, size, out);
+      };
+      std::vector<Properties> properties_records;
+      for (auto &record : records) {
+        Properties p;
+        memset(&p, 0, sizeof(p));
+        p.bidi_class = (Bidi_Class)record.bidi_class;
+        p.line_break = (Line_Break)record.line_break;
+        p.script = (Script)record.script;
+        p.east_asian_width = (East_Asian_Width)record.east_asian_width;
+        p.bidi_paired_bracket_type = (Bidi_Paired_Bracket_Type)record.bidi_paired_bracket_type;
+        p.has_bracket = record.bidi_paired_bracket_type != (uint8_t)Bidi_Paired_Bracket_Type::None;
+        p.has_mirror = record.has_mirror;
+        properties_records.push_back(p);
+      }
+      uint8_t latin1_bidi_class[256];
+      for (codepoint c = 0; c < 256; ++c)
+        latin1_bidi_class[c] = bidi_classes.values[c];
+      write_at(0, &header, sizeof(header));
+      write_at(header.properties_index_offset, layout.index.data(), layout.index.size() * sizeof(uint16_t));
+      write_at(header.properties_blocks_offset, layout.blocks.data(), layout.blocks.size() * sizeof(uint16_t));
+      write_at(header.properties_records_offset, properties_records.data(), properties_records.size() * sizeof(Properties));
+      write_at(header.latin1_bidi_class_offset, latin1_bidi_class, sizeof(latin1_bidi_class));
+      write_at(header.bidi_brackets_offset, bidi_brackets.data(), bidi_brackets.size() * sizeof(Codepoint_Pair));
+      write_at(header.bidi_mirroring_offset, bidi_mirroring.data(), bidi_mirroring.size() * sizeof(Codepoint_Pair));
+      write_at(header.file_size, nullptr, 0);
+    });
+  }
+
+  { // Normalization: per-codepoint records (combining class, quick check, segment boundaries), full decompositions and primary composites for UAXNormalization.cpp
+    const codepoint S_Base = 0xAC00, L_Base = 0x1100, V_Base = 0x1161, T_Base = 0x11A7;
+    const codepoint S_Count = 11172, V_Count = 21, T_Count = 28;
+    auto is_hangul_syllable = [&](codepoint c) { return c >= S_Base && c < S_Base + S_Count; };
+
+    struct Mapping {
+      bool compatibility;
+      std::vector<codepoint> codepoints;
+    };
+    std::vector<uint8_t> combining_classes(CodepointTable<uint8_t>::Count, 0);
+    std::map<codepoint, Mapping> mappings;
+    READ(UnicodeData) {
+      codepoint code;
+      int canonical_combining_class;
+      const int Capacity = 32;
+      codepoint decomposition[Capacity];
+      int decomposition_count;
+      Mapping mapping;
+      fields.UnicodeData(code, canonical_combining_class, mapping.compatibility, decomposition, decomposition_count, Capacity);
+      assert(decomposition_count < Capacity);
+      combining_classes[code] = canonical_combining_class;
+      if (decomposition_count > 0) {
+        mapping.codepoints.assign(decomposition, decomposition + decomposition_count);
+        mappings[code] = mapping;
+      }
+    } DONE_READ;
+    std::vector<bool> excluded(CodepointTable<uint8_t>::Count, false);
+    READ(CompositionExclusions) {
+      codepoint code;
+      fields.CompositionExclusions(code);
+      excluded[code] = true;
+    } DONE_READ;
+
+    std::function<void(codepoint, bool, std::vector<codepoint> &)> decompose = [&](codepoint c, bool compatibility, std::vector<codepoint> &out) {
+      if (is_hangul_syllable(c)) {
+        codepoint s = c - S_Base;
+        out.push_back(L_Base + s / (V_Count * T_Count));
+        out.push_back(V_Base + (s % (V_Count * T_Count)) / T_Count);
+        if (s % T_Count)
+          out.push_back(T_Base + s % T_Count);
+        return;
+      }
+      auto found = mappings.find(c);
+      if (found == mappings.end() || (found->second.compatibility && !compatibility)) {
+        out.push_back(c);
+        return;
+      }
+      for (codepoint d : found->second.codepoints)
+        decompose(d, compatibility, out);
+    };
+
+    // primary composites: canonical pairs that aren't excluded, singletons or non-starter decompositions (Full_Composition_Exclusion). Hangul L+V and LV+T
+    // are composed arithmetically, so they only show up as the Maybe quick check of V and T
+    std::map<codepoint, std::map<codepoint, codepoint>> compositions; // looked up by binary search
+    size_t composition_count = 0;
+    std::vector<bool> composes_with_previous(CodepointTable<uint8_t>::Count, false);
+    for (auto &entry : mappings) {
+      codepoint c = entry.first;
+      const Mapping &mapping = entry.second;
+      if (mapping.compatibility)
+        continue;
+      if (mapping.codepoints.size() == 1 || combining_classes[c] != 0 || combining_classes[mapping.codepoints[0]] != 0)
+        excluded[c] = true;
+      if (excluded[c])
+        continue;
+      assert(mapping.codepoints.size() == 2);
+      compositions[mapping.codepoints[0]][mapping.codepoints[1]] = c;
+      ++composition_count;
+      composes_with_previous[mapping.codepoints[1]] = true;
+    }
+    for (codepoint c = V_Base; c < V_Base + V_Count; ++c)
+      composes_with_previous[c] = true;
+    for (codepoint c = T_Base + 1; c < T_Base + T_Count; ++c)
+      composes_with_previous[c] = true;
+
+    // quick check values are UAX::Normalization::QuickCheckResult: 0 Normalized (Yes), 1 MaybeNormalized (Maybe), 2 NotNormalized (No)
+    enum { Yes = 0, Maybe = 1, No = 2 };
+    enum { NFD, NFC, NFKD, NFKC, Form_Count }; // UAX::Normalization::Form
+    struct Record {
+      uint8_t combining_class, quick_check, boundary; // quick_check: 2 bits per form; boundary: 1 bit per form
+      bool operator<(const Record &other) const { return memcmp(this, &other, sizeof(Record)) < 0; }
+    };
+    std::vector<int> quick_checks[Form_Count];
+    for (auto &values : quick_checks)
+      values.assign(CodepointTable<uint8_t>::Count, Yes);
+    std::vector<Record> records;
+    std::map<Record, uint8_t> record_numbers;
+    CodepointTable<uint8_t> normalization(0);
+    records.push_back(Record { 0, 0, (1 << Form_Count) - 1 }); // record 0: starter, normalized in every form, a boundary in every form
+    record_numbers[records[0]] = 0;
+    codepoint stable_below[Form_Count] = { CodepointTable<uint8_t>::Count, CodepointTable<uint8_t>::Count, CodepointTable<uint8_t>::Count, CodepointTable<uint8_t>::Count };
+    for (codepoint c = 0; c < CodepointTable<uint8_t>::Count; ++c) {
+      std::vector<codepoint> canonical, compatible;
+      decompose(c, false, canonical);
+      decompose(c, true, compatible);
+      bool has_canonical = canonical.size() != 1 || canonical[0] != c;
+      bool has_compatible = compatible.size() != 1 || compatible[0] != c;
+      quick_checks[NFD][c] = has_canonical ? No : Yes;
+      quick_checks[NFKD][c] = has_compatible ? No : Yes;
+      quick_checks[NFC][c] = excluded[c] ? No : composes_with_previous[c] ? Maybe : Yes;
+      quick_checks[NFKC][c] = (quick_checks[NFC][c] == No || compatible != canonical) ? No : quick_checks[NFC][c];
+      assert(!(excluded[c] && composes_with_previous[c])); // a Maybe that is also No would need both answers
+
+      // a segment boundary before c: nothing before c reorders or composes with c or anything after it
+      bool boundaries[Form_Count] = {
+        combining_classes[c] == 0 && combining_classes[canonical[0]] == 0,
+        combining_classes[c] == 0 && quick_checks[NFC][c] == Yes,
+        combining_classes[c] == 0 && combining_classes[compatible[0]] == 0,
+        combining_classes[c] == 0 && quick_checks[NFKC][c] == Yes,
+      };
+      Record record { combining_classes[c], 0, 0 };
+      for (int form = 0; form < Form_Count; ++form) {
+        record.quick_check |= quick_checks[form][c] << (2 * form);
+        record.boundary |= boundaries[form] << form;
+        if (stable_below[form] == CodepointTable<uint8_t>::Count && (quick_checks[form][c] != Yes || !boundaries[form]))
+          stable_below[form] = c;
+      }
+      auto found = record_numbers.find(record);
+      if (found == record_numbers.end()) {
+        assert(records.size() < 0x100);
+        found = record_numbers.insert({ record, (uint8_t)records.size() }).first;
+        records.push_back(record);
+      }
+      normalization.values[c] = found->second;
+    }
+
+    // the derived quick check properties should come out the same as the ones computed above
+    READ(DerivedNormalizationProps) {
+      codepoint_range range;
+      const char *property, *value;
+      size_t property_len, value_len;
+      fields.DerivedNormalizationProps(range, property, property_len, value, value_len);
+      static const char *names[Form_Count] = { "NFD_QC", "NFC_QC", "NFKD_QC", "NFKC_QC" };
+      for (int form = 0; form < Form_Count; ++form) {
+        if (strlen(names[form]) != property_len || strncmp(names[form], property, property_len) != 0)
+          continue;
+        assert(value_len == 1 && (value[0] == 'N' || value[0] == 'M'));
+        for (codepoint c = range.first; c <= range.last; ++c)
+          assert(quick_checks[form][c] == (value[0] == 'N' ? No : Maybe));
+        for (codepoint c = range.first; c <= range.last; ++c)
+          quick_checks[form][c] = -1; // seen, anything left over afterwards must be Yes
+      }
+    } DONE_READ;
+    for (auto &values : quick_checks)
+      for (int value : values)
+        assert(value == -1 || value == Yes);
+
+    // full decompositions, UTF-16 in one array: a header unit (canonical length | compatibility length << 8, both in units, the compatibility one 0 when it's
+    // the same as the canonical one) then the units. Hangul syllables are decomposed arithmetically and have no entry
+    CodepointTable<uint16_t> decompositions(0);
+    std::vector<uint16_t> decomposition_data(1, 0); // offset 0 is "no decomposition"
+    size_t max_canonical = 3, max_compatible = 3; // codepoints per codepoint; 3 is an LVT Hangul syllable
+    auto append_units = [&](const std::vector<codepoint> &codepoints) {
+      size_t start = decomposition_data.size();
+      for (codepoint d : codepoints) {
+        if (d >= 0x10000) {
+          decomposition_data.push_back(0xD800 + ((d - 0x10000) >> 10));
+          decomposition_data.push_back(0xDC00 + ((d - 0x10000) & 0x3FF));
+        } else {
+          decomposition_data.push_back(d);
+        }
+      }
+      assert(decomposition_data.size() - start < 0x100);
+      return (uint16_t)(decomposition_data.size() - start);
+    };
+    for (auto &entry : mappings) {
+      codepoint c = entry.first;
+      std::vector<codepoint> canonical, compatible;
+      decompose(c, false, canonical);
+      decompose(c, true, compatible);
+      max_canonical = std::max(max_canonical, canonical.size());
+      max_compatible = std::max(max_compatible, compatible.size());
+      size_t offset = decomposition_data.size();
+      assert(offset < 0x10000);
+      decomposition_data.push_back(0);
+      uint16_t canonical_units = entry.second.compatibility ? 0 : append_units(canonical);
+      uint16_t compatible_units = (compatible == canonical && !entry.second.compatibility) ? 0 : append_units(compatible);
+      decomposition_data[offset] = canonical_units | (compatible_units << 8);
+      decompositions.set({c, c}, (uint16_t)offset);
+    }
+
+    withOutputFile(OUTPUT_PATH(Normalization), [&](FILE *out) {
+      fprintf(out, "static const Normalization_Record Normalization_Records[%d] = {\n", (int)records.size());
+      for (auto &record : records)
+        fprintf(out, "{ %d, 0x%02X, 0x%X },\n", record.combining_class, record.quick_check, record.boundary);
+      fprintf(out, "};\n");
+      normalization.write(out, "Normalization", normalization.best_layout());
+      fprintf(out, "static const Codepoint Normalization_Stable_Below[%d] = { " HEX_FMT ", " HEX_FMT ", " HEX_FMT ", " HEX_FMT " };\n", Form_Count, stable_below[NFD], stable_below[NFC], stable_below[NFKD], stable_below[NFKC]);
+      fprintf(out, "static const size_t Decomposition_Max_Canonical = %d;\n", (int)max_canonical);
+      fprintf(out, "static const size_t Decomposition_Max_Compatibility = %d;\n", (int)max_compatible);
+      decompositions.write(out, "Decomposition", decompositions.best_layout());
+      fprintf(out, "// %d bytes\n", (int)(decomposition_data.size() * sizeof(uint16_t)));
+      fprintf(out, "static const uint16_t Decomposition_Data[%d] = {", (int)decomposition_data.size());
+      for (size_t i = 0; i < decomposition_data.size(); ++i)
+        fprintf(out, "%s0x%X,", (i % 16) ? "" : "\n", decomposition_data[i]);
+      fprintf(out, "\n};\n");
+      fprintf(out, "static const Composition_Pair Composition_Pairs[%d] = {\n", (int)composition_count); // sorted by first, then second
+      for (auto &entry : compositions)
+        for (auto &pair : entry.second)
+          fprintf(out, "{ " HEX_FMT ", " HEX_FMT ", " HEX_FMT " },\n", entry.first, pair.first, pair.second);
+      fprintf(out, "};\n");
+    });
+  }
+
 #if 0
   PROCESS(Blocks) {
     codepoint_range range;
@@ -84,6 +84,16 @@ const char *Bidi_Class_to_string(Bidi_Class cls) {
   return "";
 }
 
+const char *East_Asian_Width_to_string(East_Asian_Width width) {
+  switch (width) {
+    #define X(CODE, NAME) case East_Asian_Width::NAME: return "East_Asian_Width::" #NAME;
+    EAST_ASIAN_WIDTH_LIST
+    #undef X
+  }
+  UNKNOWN_CODE;
+  return "";
+}
+
 const char *Line_Break_to_string(Line_Break line_break) {
   switch (line_break) {
     #define X(CODE, NAME) case Line_Break::NAME: return "Line_Break::" #NAME;
@@ -163,6 +173,15 @@ struct Fields {
     code = fields[0].asCodepoint();
   }
   
+  void DerivedNormalizationProps(codepoint_range &range, const char * &property, size_t &property_len, const char * &value, size_t &value_len) {
+    assert(count == 2 || count == 3);
+    range = fields[0].asCodepointRange();
+    property = fields[1].text;
+    property_len = fields[1].length;
+    value = count == 3 ? fields[2].text : "";
+    value_len = count == 3 ? fields[2].length : 0;
+  }
+  
   void EastAsianWidth(codepoint_range &range, East_Asian_Width &width) {
     assert(count == 2);
     range = fields[0].asCodepointRange();
@@ -180,6 +199,29 @@ struct Fields {
     script = text_to_Script(fields[1].text, fields[1].length);
   }
   
+  /**
+   Only the fields normalization needs: Canonical_Combining_Class and Decomposition_Mapping, split into the <tag> (compatibility) flag and the codepoints
+   */
+  void UnicodeData(codepoint &code, int &canonical_combining_class, bool &compatibility, codepoint *decomposition, int &decomposition_count, int decomposition_capacity) {
+    assert(count >= 6);
+    code = fields[0].asCodepoint();
+    canonical_combining_class = fields[3].asDecimal();
+    const char *mapping = fields[5].text;
+    size_t len = fields[5].length;
+    compatibility = len > 0 && mapping[0] == '<';
+    if (compatibility) {
+      while (len > 0 && mapping[0] != '>') {
+        ++mapping;
+        --len;
+      }
+      assert(len > 0);
+      ++mapping;
+      --len;
+      trim(mapping, len, trim_whitespace);
+    }
+    codepoint_list(mapping, len, decomposition, decomposition_count, decomposition_capacity);
+  }
+  
   void DerivedBidiClass(codepoint_range &range, Bidi_Class &cls) {
     assert(count == 2);
     range = fields[0].asCodepointRange();
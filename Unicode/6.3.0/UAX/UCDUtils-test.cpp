@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+#include "UCD.h"
+#include "UCDDatabase.h"
+
+#define ANSI_FOREGROUND_RED     "\x1b[31m"
+#define ANSI_FOREGROUND_DEFAULT "\x1b[39m"
+
+using namespace UCD;
+
+struct Lookups {
+  Properties properties;
+  Codepoint paired_bracket;
+  Bidi_Paired_Bracket_Type bracket_type;
+  Codepoint mirror;
+  Bidi_Class classified;
+};
+
+static Lookups lookups(Codepoint c) {
+  Lookups l;
+  memset(&l, 0, sizeof(l));
+  l.properties = Get_Properties(c);
+  l.paired_bracket = Get_Bidi_Paired_Bracket(c, l.bracket_type);
+  l.mirror = Get_Bidi_Mirroring(c);
+  Classify_Bidi(&c, 1, &l.classified);
+  return l;
+}
+
+static bool same(const Lookups &a, const Lookups &b) {
+  return a.properties.bidi_class == b.properties.bidi_class
+    && a.properties.line_break == b.properties.line_break
+    && a.properties.script == b.properties.script
+    && a.properties.east_asian_width == b.properties.east_asian_width
+    && a.properties.bidi_paired_bracket_type == b.properties.bidi_paired_bracket_type
+    && a.properties.has_bracket == b.properties.has_bracket
+    && a.properties.has_mirror == b.properties.has_mirror
+    && a.paired_bracket == b.paired_bracket
+    && a.bracket_type == b.bracket_type
+    && a.mirror == b.mirror
+    && a.classified == b.classified;
+}
+
+static std::vector<uint8_t> read_file(const char *path) {
+  std::vector<uint8_t> bytes;
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return bytes;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    bytes.insert(bytes.end(), buffer, buffer + n);
+  fclose(f);
+  return bytes;
+}
+
+static bool load_bytes(const char *path, const std::vector<uint8_t> &bytes) {
+  FILE *f = fopen(path, "wb");
+  fwrite(bytes.data(), 1, bytes.size(), f);
+  fclose(f);
+  bool loaded = Load_Database(path);
+  unlink(path);
+  return loaded;
+}
+
+int main (int argc, char const *argv[]) {
+  int failed = 0;
+  #define CHECK(CONDITION, ...) if (!(CONDITION)) { printf(ANSI_FOREGROUND_RED "FAIL" ANSI_FOREGROUND_DEFAULT " " __VA_ARGS__); printf("\n"); ++failed; }
+
+  const Codepoint Last = 0x110010; // a few past the end of the codespace too
+  std::vector<Lookups> compiled;
+  for (Codepoint c = 0; c <= Last; ++c)
+    compiled.push_back(lookups(c));
+
+  CHECK(Load_Database("_Derived/UCD.db"), "Load_Database _Derived/UCD.db");
+  for (Codepoint c = 0; c <= Last; ++c)
+    CHECK(same(lookups(c), compiled[c]), "database lookup U+%04X", c);
+
+  std::vector<Bidi_Class> classes_mapped(256), classes_compiled(256);
+  std::vector<Codepoint> latin1(256);
+  for (Codepoint c = 0; c < 256; ++c)
+    latin1[c] = c;
+  Classify_Bidi(latin1.data(), latin1.size(), classes_mapped.data());
+  Unload_Database();
+  Classify_Bidi(latin1.data(), latin1.size(), classes_compiled.data());
+  CHECK(classes_mapped == classes_compiled, "Classify_Bidi Latin-1 rows");
+
+  const char *Scratch_Path = "_Derived/UCD-test.db";
+  std::vector<uint8_t> original = read_file("_Derived/UCD.db");
+  CHECK(original.size() >= sizeof(Database_Header), "read _Derived/UCD.db");
+  if (original.size() >= sizeof(Database_Header)) {
+    Database_Header header;
+    memcpy(&header, original.data(), sizeof(header));
+
+    std::vector<uint8_t> bytes = original;
+    CHECK(load_bytes(Scratch_Path, bytes), "Load_Database of an unmodified copy");
+    Unload_Database();
+
+    bytes.resize(original.size() / 2);
+    CHECK(!load_bytes(Scratch_Path, bytes), "truncated database was accepted");
+
+    bytes = original;
+    bytes[0] ^= 0xFF;
+    CHECK(!load_bytes(Scratch_Path, bytes), "bad magic was accepted");
+
+    bytes = original;
+    ((Database_Header *)bytes.data())->byte_order = __builtin_bswap32(Database_Byte_Order);
+    CHECK(!load_bytes(Scratch_Path, bytes), "other byte order was accepted");
+
+    bytes = original;
+    ((uint16_t *)&bytes[header.properties_index_offset])[3] = 0xFFFF;
+    CHECK(!load_bytes(Scratch_Path, bytes), "out-of-range block number was accepted");
+
+    bytes = original;
+    ((uint16_t *)&bytes[header.properties_blocks_offset])[5] = (uint16_t)header.properties_records_count;
+    CHECK(!load_bytes(Scratch_Path, bytes), "out-of-range record number was accepted");
+
+    bytes = original;
+    ((Database_Header *)bytes.data())->unicode_version = 0x070000;
+    CHECK(!load_bytes(Scratch_Path, bytes), "database of another Unicode version was accepted");
+
+    bytes = original;
+    ((Properties *)&bytes[header.properties_records_offset])[1].script = (Script)Script_Count;
+    CHECK(!load_bytes(Scratch_Path, bytes), "record with an out-of-range Script was accepted");
+
+    bytes = original;
+    ((Properties *)&bytes[header.properties_records_offset])[header.properties_records_count - 1].bidi_class = (Bidi_Class)0xFF;
+    CHECK(!load_bytes(Scratch_Path, bytes), "record with an out-of-range Bidi_Class was accepted");
+
+    bytes = original;
+    bytes[header.latin1_bidi_class_offset + 'A'] = (uint8_t)Bidi_Class_Count;
+    CHECK(!load_bytes(Scratch_Path, bytes), "out-of-range Latin-1 Bidi_Class was accepted");
+
+    bytes = original;
+    ((Database_Header *)bytes.data())->bidi_mirroring_offset = header.file_size - 8;
+    CHECK(!load_bytes(Scratch_Path, bytes), "section past the end of the file was accepted");
+  }
+  CHECK(!Load_Database("_Derived/does-not-exist.db"), "missing file was accepted");
+
+  // a failed load keeps the tables that were in use
+  for (Codepoint c = 0; c <= Last; ++c)
+    CHECK(same(lookups(c), compiled[c]), "compiled lookup U+%04X after failed loads", c);
+
+  printf("UCDUtils failed %d\n", failed);
+  if (failed > 0)
+    return -1;
+  return 0;
+}
@@ -1,39 +1,314 @@
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "UCD.h"
+#include "UCDDatabase.h"
 
 using namespace UCD;
 
-Codepoint UCD::Get_Bidi_Paired_Bracket(const Codepoint code, Bidi_Paired_Bracket_Type &bracket_type) {
-  switch (code) {
+namespace {
+  #include "_Derived/Properties.h"
+  
+  const Codepoint_Pair Bidi_Brackets[] = {
     #include "_Derived/BidiBrackets.h"
-    default: bracket_type = Bidi_Paired_Bracket_Type::None; return 0;
+  };
+  
+  const Codepoint_Pair Bidi_Mirroring[] = {
+    #include "_Derived/BidiMirroring.h"
+  };
+  
+  /**
+   ** The tables every lookup goes through: the compiled-in ones above, or the sections of a database mapped by Load_Database()
+   **/
+  struct Tables {
+    int shift;
+    Codepoint mask;
+    Codepoint index_last;
+    const uint16_t *index;
+    const uint16_t *blocks;
+    const Properties *records;
+    const uint8_t *latin1_bidi_class;
+    const Codepoint_Pair *bidi_brackets;
+    size_t bidi_brackets_count;
+    const Codepoint_Pair *bidi_mirroring;
+    size_t bidi_mirroring_count;
+  };
+  
+  const Tables Compiled_Tables = {
+    Properties_Shift, Properties_Mask, Properties_IndexLast, Properties_Index, Properties_Blocks, Properties_Records, Latin1_Bidi_Class,
+    Bidi_Brackets, sizeof(Bidi_Brackets) / sizeof(Bidi_Brackets[0]),
+    Bidi_Mirroring, sizeof(Bidi_Mirroring) / sizeof(Bidi_Mirroring[0]),
+  };
+  
+  Tables tables = Compiled_Tables;
+  void *mapped_database = nullptr;
+  size_t mapped_database_size = 0;
+};
+
+// two-stage table lookup (see CodepointTable in UCDReader-main.cpp), codepoints past 0x10FFFF land in the last (default) block
+#define TABLE_LOOKUP(TABLE, CODE) TABLE##_Blocks[(TABLE##_Index[((CODE) >> TABLE##_Shift) < TABLE##_IndexLast ? ((CODE) >> TABLE##_Shift) : TABLE##_IndexLast] << TABLE##_Shift) | ((CODE) & TABLE##_Mask)]
+
+static inline const Properties &properties_for(const Codepoint code) {
+  if (__builtin_expect(mapped_database == nullptr, 1)) // the compiled-in layout is known at compile time, which makes for a shorter lookup
+    return Properties_Records[TABLE_LOOKUP(Properties, code)];
+  Codepoint block = code >> tables.shift;
+  if (block > tables.index_last)
+    block = tables.index_last;
+  return tables.records[tables.blocks[(tables.index[block] << tables.shift) | (code & tables.mask)]];
+}
+
+static inline Codepoint find_pair(const Codepoint_Pair *pairs, size_t count, const Codepoint code) {
+  size_t low = 0, high = count;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    if (pairs[middle].code < code)
+      low = middle + 1;
+    else
+      high = middle;
   }
+  return (low < count && pairs[low].code == code) ? pairs[low].value : 0;
 }
 
-Codepoint UCD::Get_Bidi_Mirroring(const Codepoint code) {
-  switch (code) {
-    #include "_Derived/BidiMirroring.h"
-    default: return 0;
+Properties UCD::Get_Properties(const Codepoint code) {
+  return properties_for(code);
+}
+
+Codepoint UCD::Get_Bidi_Paired_Bracket(const Codepoint code, Bidi_Paired_Bracket_Type &bracket_type) {
+  const Properties &properties = properties_for(code);
+  if (!properties.has_bracket) {
+    bracket_type = Bidi_Paired_Bracket_Type::None;
+    return 0;
   }
+  bracket_type = properties.bidi_paired_bracket_type;
+  return find_pair(tables.bidi_brackets, tables.bidi_brackets_count, code);
+}
+
+Codepoint UCD::Get_Bidi_Mirroring(const Codepoint code) {
+  if (!properties_for(code).has_mirror)
+    return 0;
+  return find_pair(tables.bidi_mirroring, tables.bidi_mirroring_count, code);
 }
 
 Script UCD::Get_Script(const Codepoint code) {
-  switch (code) {
-    #include "_Derived/Scripts.h"
-    default: return Script::Unknown;
-  }
+  return Get_Properties(code).script;
 }
 
 Bidi_Class UCD::Get_Bidi_Class(const Codepoint code) {
-  switch (code) {
-    #include "_Derived/DerivedBidiClass.h"
-    default: return Bidi_Class::Left_To_Right;
-  }
+  return Get_Properties(code).bidi_class;
 }
 
 Line_Break UCD::Get_Line_Break(const Codepoint code) {
-  switch (code) {
-    #include "_Derived/DerivedLineBreak.h"
-    default: return Line_Break::Unknown;
+  return Get_Properties(code).line_break;
+}
+
+East_Asian_Width UCD::Get_East_Asian_Width(const Codepoint code) {
+  return Get_Properties(code).east_asian_width;
+}
+
+/**
+ ** Classify_Bidi -- Latin-1 fast path. Latin1_Bidi_Class is laid out as 16 rows of 16, so a block of codepoints that are all below U+0100 is
+ ** packed down to bytes and each row is applied with an in-register shuffle on the low nibble, masked to the lanes whose high nibble selects that row.
+ ** Blocks holding anything above U+00FF go through the regular table lookup.
+ **/
+static inline Bidi_Class bidi_class_for(const Codepoint code) {
+  return properties_for(code).bidi_class;
+}
+
+typedef size_t (*Classify_Bidi_Kernel)(const Codepoint *text, const size_t length, Bidi_Class *classes); // returns how many codepoints it classified, whole blocks only
+
+static size_t classify_bidi_scalar(const Codepoint *text, const size_t length, Bidi_Class *classes) {
+  for (size_t i = 0; i < length; ++i)
+    classes[i] = bidi_class_for(text[i]);
+  return length;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("ssse3")))
+static size_t classify_bidi_ssse3(const Codepoint *text, const size_t length, Bidi_Class *classes) {
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  const uint8_t *latin1_bidi_class = tables.latin1_bidi_class;
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)&text[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *)&text[i + 4]);
+    __m128i c = _mm_loadu_si128((const __m128i *)&text[i + 8]);
+    __m128i d = _mm_loadu_si128((const __m128i *)&text[i + 12]);
+    __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(any, 8), _mm_setzero_si128())) != 0xFFFF) { // something above U+00FF
+      classify_bidi_scalar(&text[i], 16, &classes[i]);
+      continue;
+    }
+    int rows = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(any, 7), _mm_setzero_si128())) == 0xFFFF ? 8 : 16; // ASCII only needs the first 8 rows
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+    __m128i lo = _mm_and_si128(bytes, nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+    __m128i result = _mm_setzero_si128();
+    for (int row = 0; row < rows; ++row) {
+      __m128i table = _mm_loadu_si128((const __m128i *)&latin1_bidi_class[row * 16]);
+      __m128i in_row = _mm_cmpeq_epi8(hi, _mm_set1_epi8((char)row));
+      result = _mm_or_si128(result, _mm_and_si128(in_row, _mm_shuffle_epi8(table, lo)));
+    }
+    _mm_storeu_si128((__m128i *)&classes[i], result);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t classify_bidi_avx2(const Codepoint *text, const size_t length, Bidi_Class *classes) {
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const uint8_t *latin1_bidi_class = tables.latin1_bidi_class;
+  const __m256i unpack_order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7); // packs/packus work per 128-bit lane, this puts the dwords back in text order
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)&text[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i *)&text[i + 8]);
+    __m256i c = _mm256_loadu_si256((const __m256i *)&text[i + 16]);
+    __m256i d = _mm256_loadu_si256((const __m256i *)&text[i + 24]);
+    __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+    if (!_mm256_testz_si256(any, _mm256_set1_epi32(~0xFF))) { // something above U+00FF
+      classify_bidi_scalar(&text[i], 32, &classes[i]);
+      continue;
+    }
+    int rows = _mm256_testz_si256(any, _mm256_set1_epi32(0x80)) ? 8 : 16; // ASCII only needs the first 8 rows
+    __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d)), unpack_order);
+    __m256i lo = _mm256_and_si256(bytes, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+    __m256i result = _mm256_setzero_si256();
+    for (int row = 0; row < rows; ++row) {
+      __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&latin1_bidi_class[row * 16]));
+      __m256i in_row = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)row));
+      result = _mm256_or_si256(result, _mm256_and_si256(in_row, _mm256_shuffle_epi8(table, lo)));
+    }
+    _mm256_storeu_si256((__m256i *)&classes[i], result);
+  }
+  return i;
+}
+
+static Classify_Bidi_Kernel classify_bidi_kernel() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return classify_bidi_avx2;
+  if (__builtin_cpu_supports("ssse3"))
+    return classify_bidi_ssse3;
+  return classify_bidi_scalar;
+}
+#else
+static Classify_Bidi_Kernel classify_bidi_kernel() {
+  return classify_bidi_scalar;
+}
+#endif
+
+void UCD::Classify_Bidi(const Codepoint *text, const size_t length, Bidi_Class *classes) {
+  static const auto kernel = classify_bidi_kernel(); // CPU dispatch, decided once
+  size_t i = kernel(text, length, classes);
+  classify_bidi_scalar(&text[i], length - i, &classes[i]);
+}
+
+/**
+ ** Load_Database -- everything in the file is checked before any of it is used, so a truncated or corrupt database is refused rather than read out of bounds
+ **/
+static bool section_fits(const Database_Header &header, uint32_t offset, uint32_t count, size_t element_size) {
+  return offset % Database_Alignment == 0 && offset <= header.file_size && count <= (header.file_size - offset) / element_size;
+}
+
+static bool validate_database(const uint8_t *bytes, size_t size, Tables &loaded) {
+  if (size < sizeof(Database_Header))
+    return false;
+  const Database_Header &header = *(const Database_Header *)bytes;
+  if (memcmp(header.magic, Database_Magic, sizeof(header.magic)) != 0 || header.byte_order != Database_Byte_Order)
+    return false;
+  if (header.format_version != Database_Format_Version || header.unicode_version != Database_Unicode_Version || header.record_size != sizeof(Properties) || header.file_size != size)
+    return false;
+  if (header.properties_shift < 1 || header.properties_shift > 16 || header.properties_index_count == 0 || header.properties_records_count == 0)
+    return false;
+  if (header.properties_index_count != (0x110000u >> header.properties_shift) + 1 || header.properties_blocks_count % (1u << header.properties_shift) != 0)
+    return false;
+  if (!section_fits(header, header.properties_index_offset, header.properties_index_count, sizeof(uint16_t))
+      || !section_fits(header, header.properties_blocks_offset, header.properties_blocks_count, sizeof(uint16_t))
+      || !section_fits(header, header.properties_records_offset, header.properties_records_count, sizeof(Properties))
+      || !section_fits(header, header.latin1_bidi_class_offset, 256, 1)
+      || !section_fits(header, header.bidi_brackets_offset, header.bidi_brackets_count, sizeof(Codepoint_Pair))
+      || !section_fits(header, header.bidi_mirroring_offset, header.bidi_mirroring_count, sizeof(Codepoint_Pair)))
+    return false;
+  
+  const uint16_t *index = (const uint16_t *)(bytes + header.properties_index_offset);
+  const uint16_t *blocks = (const uint16_t *)(bytes + header.properties_blocks_offset);
+  const uint32_t block_count = header.properties_blocks_count >> header.properties_shift;
+  for (uint32_t i = 0; i < header.properties_index_count; ++i)
+    if (index[i] >= block_count)
+      return false;
+  for (uint32_t i = 0; i < header.properties_blocks_count; ++i)
+    if (blocks[i] >= header.properties_records_count)
+      return false;
+  const Properties *records = (const Properties *)(bytes + header.properties_records_offset);
+  for (uint32_t i = 0; i < header.properties_records_count; ++i) // every enum in range, so a lookup never hands out a value the switches downstream don't know
+    if ((int)records[i].bidi_class >= Bidi_Class_Count || (int)records[i].line_break >= Line_Break_Count || (int)records[i].script >= Script_Count
+        || (int)records[i].east_asian_width >= East_Asian_Width_Count || (int)records[i].bidi_paired_bracket_type >= Bidi_Paired_Bracket_Type_Count)
+      return false;
+  const uint8_t *latin1_bidi_class = bytes + header.latin1_bidi_class_offset;
+  for (int i = 0; i < 256; ++i)
+    if (latin1_bidi_class[i] >= Bidi_Class_Count)
+      return false;
+  const Codepoint_Pair *bidi_brackets = (const Codepoint_Pair *)(bytes + header.bidi_brackets_offset);
+  for (uint32_t i = 1; i < header.bidi_brackets_count; ++i)
+    if (bidi_brackets[i - 1].code >= bidi_brackets[i].code)
+      return false;
+  const Codepoint_Pair *bidi_mirroring = (const Codepoint_Pair *)(bytes + header.bidi_mirroring_offset);
+  for (uint32_t i = 1; i < header.bidi_mirroring_count; ++i)
+    if (bidi_mirroring[i - 1].code >= bidi_mirroring[i].code)
+      return false;
+  
+  loaded.shift = header.properties_shift;
+  loaded.mask = (1u << header.properties_shift) - 1;
+  loaded.index_last = header.properties_index_count - 1;
+  loaded.index = index;
+  loaded.blocks = blocks;
+  loaded.records = records;
+  loaded.latin1_bidi_class = latin1_bidi_class;
+  loaded.bidi_brackets = bidi_brackets;
+  loaded.bidi_brackets_count = header.bidi_brackets_count;
+  loaded.bidi_mirroring = bidi_mirroring;
+  loaded.bidi_mirroring_count = header.bidi_mirroring_count;
+  return true;
+}
+
+bool UCD::Load_Database(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)info.st_size;
+  void *bytes = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (bytes == MAP_FAILED)
+    return false;
+  
+  Tables loaded;
+  if (!validate_database((const uint8_t *)bytes, size, loaded)) {
+    munmap(bytes, size);
+    return false;
   }
+  Unload_Database();
+  tables = loaded;
+  mapped_database = bytes;
+  mapped_database_size = size;
+  return true;
+}
+
+void UCD::Unload_Database() {
+  tables = Compiled_Tables;
+  if (mapped_database)
+    munmap(mapped_database, mapped_database_size);
+  mapped_database = nullptr;
+  mapped_database_size = 0;
 }